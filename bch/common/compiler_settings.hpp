@@ -28,6 +28,15 @@ Copyright: Jesper Storm Bache (bache.name)
 
 // -----------------------------------------------------------------------------
 
+// Hint that the memory at address will be read soon
+#if defined(__GNUC__) || defined(__clang__)
+#define BCH_PREFETCH(address)       __builtin_prefetch(address)
+#else
+#define BCH_PREFETCH(address)       ((void)0)
+#endif
+
+// -----------------------------------------------------------------------------
+
 /* Preprocessor defines that are used by the smart-pointer implementation.
 General pattern is that the project that use the functionality use the _ENABLE
 variation, and we then calculate necessary preprocessor symbols based n this.
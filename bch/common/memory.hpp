@@ -32,6 +32,19 @@ void AllocateInstancePair(  std::size_t size1,
                             void*& ptr1,
                             void*& ptr2);
 
+/* Offset from the first to the second instance in a block created by
+AllocateInstancePair.
+The padding between the two instances depends on the address returned by malloc.
+When the alignment of the second instance does not exceed the alignment of the
+memory returned by malloc (alignof(std::max_align_t)), then the padding only
+depends on size1, and the offset can be calculated at compile time. This allows
+the address of the first instance to be calculated from the second instance.
+*/
+constexpr std::size_t InstancePairOffset(std::size_t size1, std::size_t alignment)
+{
+    return size1 + ((alignment - (size1 & (alignment - 1))) & (alignment - 1));
+}
+
 }   // namespace bch
 
 #include "bch/common/header_suffix.hpp"
@@ -0,0 +1,75 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#ifndef BCH_RELOCATION
+#define BCH_RELOCATION
+
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "bch/common/header_prefix.hpp"
+
+namespace bch {
+
+/* Trait that is true if an instance of T can be relocated by copying its bytes to a
+new location and then forgetting the source (without invoking a move constructor
+and a destructor).
+This is true for trivially copyable types, and for types that do not store pointers
+to themselves (and are not registered by address elsewhere). Such types specialize
+the trait (for example shared_ptr_nc and weak_ptr).
+*/
+template <typename T>
+struct is_trivially_relocatable:
+#if defined(__has_builtin)
+#if __has_builtin(__is_trivially_relocatable)
+    std::bool_constant<__is_trivially_relocatable(T)>
+#else
+    std::is_trivially_copyable<T>
+#endif
+#else
+    std::is_trivially_copyable<T>
+#endif
+{
+};
+
+template <typename T>
+constexpr bool is_trivially_relocatable_v = is_trivially_relocatable<T>::value;
+
+/* Relocate count instances from source to destination. The destination memory is
+uninitialized and must not overlap the source. After the call the source memory
+is uninitialized.
+Trivially relocatable types are relocated with a single memcpy. Other types are
+move constructed and the source is destroyed.
+*/
+template <typename T>
+void relocate(T* source, std::size_t count, T* destination) noexcept
+{
+    if constexpr (is_trivially_relocatable_v<T>)
+    {
+        if (count != 0)
+            memcpy(static_cast<void*>(destination), static_cast<const void*>(source), count * sizeof(T));
+    }
+    else
+    {
+        static_assert(std::is_nothrow_move_constructible_v<T>,
+            "relocation requires a trivially relocatable or a nothrow move constructible type");
+
+        for (std::size_t index = 0; index < count; ++index)
+        {
+            new (destination + index) T(std::move(source[index]));
+            source[index].~T();
+        }
+    }
+}
+
+}   // namespace bch
+
+#include "bch/common/header_suffix.hpp"
+
+#endif  // BCH_RELOCATION
@@ -0,0 +1,388 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#ifndef BCH_COMPACT_SHARED_PTR
+#define BCH_COMPACT_SHARED_PTR
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <utility>
+
+#include "bch/shared_ptr_nc.hpp"
+#include "bch/common/memory.hpp"
+
+#include "bch/common/header_prefix.hpp"
+
+namespace bch {
+
+template <typename T>
+class compact_region;
+
+template <typename T>
+class compact_shared_ptr;
+
+namespace detail {
+
+/* Type independent part of compact_region.
+A region is a fixed size array of slots. Each slot holds a control block and an
+instance. Regions are registered in a global table, so a slot can be addressed with
+a 32 bit region id and a 32 bit slot index.
+Allocating and releasing slots is thread safe.
+*/
+class CompactRegionBase
+{
+public:
+    // Maximum number of regions that can exist at the same time
+    static constexpr std::uint32_t kMaxRegionCount = 4096;
+    // Region id that is never used (the id of an empty compact_shared_ptr)
+    static constexpr std::uint32_t kNoRegion = 0;
+
+    static CompactRegionBase* region(std::uint32_t id) noexcept {
+        return sRegions[id];
+    }
+
+    void* slot(std::uint32_t index) const noexcept {
+        return mSlots + (static_cast<std::size_t>(index) * mSlotSize);
+    }
+
+    std::uint32_t id() const noexcept {
+        return mId;
+    }
+
+    std::uint32_t capacity() const noexcept {
+        return mCapacity;
+    }
+
+    // Number of slots that are in use (by a live instance or a weak reference)
+    std::uint32_t size() const noexcept;
+
+    /* Return a slot to the free list.
+    Invoked by the control block of the slot (from on_zero_weak).
+    */
+    void release_slot(std::uint32_t index) noexcept;
+
+protected:
+    /* Allocate memory for capacity slots of slotSize bytes and register the region.
+    Throws std::bad_alloc if the memory cannot be allocated, or if there are
+    kMaxRegionCount - 1 live regions.
+    */
+    CompactRegionBase(std::size_t slotSize, std::uint32_t capacity);
+    ~CompactRegionBase();
+
+    /* Return the index of an unused slot.
+    Throws std::bad_alloc if all slots are used.
+    */
+    std::uint32_t allocate_slot();
+
+private:
+    CompactRegionBase(const CompactRegionBase&) = delete;
+    CompactRegionBase(CompactRegionBase&&) = delete;
+    CompactRegionBase& operator=(const CompactRegionBase&) = delete;
+    CompactRegionBase& operator=(CompactRegionBase&&) = delete;
+
+    static constexpr std::uint32_t kNoSlot = 0xFFFFFFFF;
+
+    static CompactRegionBase*   sRegions[kMaxRegionCount];
+
+    char*                   mSlots{nullptr};
+    std::size_t             mSlotSize{0};
+    std::uint32_t           mCapacity{0};
+    std::uint32_t           mId{kNoRegion};
+    // Protects the slot allocation data
+    mutable std::mutex      mMutex;
+    // Number of slots that have been handed out (including released slots)
+    std::uint32_t           mUsedCount{0};
+    // Head of the list of released slots. The next index is stored in the slot.
+    std::uint32_t           mFreeList{kNoSlot};
+    std::uint32_t           mLiveCount{0};
+};
+
+/* Control block of a compact_region slot. The instance is stored after the control
+block (at instance_offset).
+The region id and slot index are stored in the control block, so the slot can be
+returned to its region when both reference counts reach 0.
+*/
+template <typename T>
+class ControlBlockRegion: public ControlBlock
+{
+public:
+    ControlBlockRegion(std::uint32_t regionId, std::uint32_t index) noexcept :
+        mRegionId(regionId),
+        mIndex(index)
+    { }
+
+    static constexpr std::size_t instance_offset() noexcept {
+        return InstancePairOffset(sizeof(ControlBlockRegion), alignof(T));
+    }
+
+    // Size of a slot. Slots are stored in an array, so the size is a multiple of the alignment.
+    static constexpr std::size_t slot_size() noexcept {
+        constexpr std::size_t alignment = (alignof(T) > alignof(ControlBlockRegion)) ? alignof(T) : alignof(ControlBlockRegion);
+        return (instance_offset() + sizeof(T) + alignment - 1) & ~(alignment - 1);
+    }
+
+    static T* instance(void* slot) noexcept {
+        return reinterpret_cast<T*>(static_cast<char*>(slot) + instance_offset());
+    }
+
+    T* get() noexcept {
+        return instance(this);
+    }
+
+protected:
+    virtual void on_zero_shared()
+    {
+        get()->~T();
+    }
+
+    virtual void on_zero_weak() noexcept
+    {
+        CompactRegionBase* const region = CompactRegionBase::region(mRegionId);
+        const std::uint32_t index = mIndex;
+        this->~ControlBlockRegion();
+        region->release_slot(index);
+    }
+
+private:
+    std::uint32_t   mRegionId;
+    std::uint32_t   mIndex;
+};
+
+}   // namespace detail
+
+/* Fixed capacity storage for instances of T that are referenced by
+compact_shared_ptr.
+The region must outlive all pointers to its instances (including shared_ptr_nc and
+weak_ptr instances created with compact_shared_ptr::to_shared).
+*/
+template <typename T>
+class compact_region: public detail::CompactRegionBase
+{
+public:
+    explicit compact_region(std::uint32_t capacity);
+    ~compact_region();
+
+    /* Create an instance of T in an unused slot.
+    Throws std::bad_alloc if all slots are in use.
+    */
+    template <typename ... Args>
+    compact_shared_ptr<T> make_shared(Args&& ... args);
+
+private:
+    static_assert(alignof(T) <= alignof(std::max_align_t), "over-aligned types are not supported");
+    static_assert(!std::is_base_of_v<detail::SharedFromThisInlineBase, T>,
+        "enable_shared_from_this_inline requires instances created by make_shared");
+};
+
+/* Shared pointer to an instance in a compact_region.
+A compact_shared_ptr is 8 bytes (a 32 bit region id and a 32 bit slot index)
+instead of the 16 bytes of a shared_ptr_nc. The slot holds a regular control block,
+so reference counting follows the shared_ptr_nc rules, and compact pointers can be
+converted to shared_ptr_nc (and from there to weak_ptr).
+Dereferencing the pointer looks up the region in the region table.
+
+The pointer always refers to the T instance of the slot (no aliasing and no
+conversion to base classes).
+*/
+template <typename T>
+class compact_shared_ptr
+{
+public:
+    using element_type = T;
+
+    constexpr compact_shared_ptr() noexcept = default;
+    constexpr compact_shared_ptr(std::nullptr_t) noexcept {}
+
+    compact_shared_ptr(const compact_shared_ptr& ptr) noexcept;
+    compact_shared_ptr(compact_shared_ptr&& ptr) noexcept;
+    ~compact_shared_ptr();
+
+    compact_shared_ptr& operator=(const compact_shared_ptr& ptr);
+    compact_shared_ptr& operator=(compact_shared_ptr&& ptr) noexcept;
+
+    void swap(compact_shared_ptr& ptr) noexcept;
+    void reset();
+
+    // Return a shared pointer to the instance
+    shared_ptr_nc<T> to_shared() const noexcept;
+
+    T* get() const noexcept {
+        return (mRegion != detail::CompactRegionBase::kNoRegion) ? block()->get() : nullptr;
+    }
+
+    T& operator*() const noexcept {
+        return *block()->get();
+    }
+
+    T* operator->() const noexcept {
+        return block()->get();
+    }
+
+    explicit operator bool() const noexcept {
+        return (mRegion != detail::CompactRegionBase::kNoRegion);
+    }
+
+    long use_count() const noexcept {
+        return (mRegion != detail::CompactRegionBase::kNoRegion) ? static_cast<long>(block()->use_count()) : 0;
+    }
+
+    bool operator==(const compact_shared_ptr& ptr) const noexcept {
+        return (mRegion == ptr.mRegion) && (mIndex == ptr.mIndex);
+    }
+
+    bool operator!=(const compact_shared_ptr& ptr) const noexcept {
+        return !(*this == ptr);
+    }
+
+private:
+    friend class compact_region<T>;
+
+    // Take over the strong reference of the instance in the slot
+    compact_shared_ptr(std::uint32_t region, std::uint32_t index) noexcept :
+        mRegion(region),
+        mIndex(index)
+    { }
+
+    detail::ControlBlockRegion<T>* block() const noexcept {
+        return static_cast<detail::ControlBlockRegion<T>*>(detail::CompactRegionBase::region(mRegion)->slot(mIndex));
+    }
+
+    std::uint32_t   mRegion{detail::CompactRegionBase::kNoRegion};
+    std::uint32_t   mIndex{0};
+};
+
+template <typename T>
+struct is_trivially_relocatable<compact_shared_ptr<T>>: std::true_type {};
+
+// -----------------------------------------------------------------------------
+
+inline std::uint32_t detail::CompactRegionBase::size() const noexcept
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mLiveCount;
+}
+
+// -----------------------------------------------------------------------------
+
+template <typename T>
+inline
+compact_region<T>::compact_region(std::uint32_t capacity) :
+    CompactRegionBase(detail::ControlBlockRegion<T>::slot_size(), capacity)
+{
+}
+
+template <typename T>
+inline
+compact_region<T>::~compact_region()
+{
+#if BCH_SMART_PTR_DEBUG
+    // All pointers to the instances of the region must have been released
+    assert(size() == 0);
+#endif
+}
+
+template <typename T>
+template <typename ... Args>
+compact_shared_ptr<T> compact_region<T>::make_shared(Args&& ... args)
+{
+    typedef detail::ControlBlockRegion<T> ControlBlockType;
+
+    const std::uint32_t index = allocate_slot();
+    void* const address = slot(index);
+
+    /* The constructor of ControlBlockRegion cannot throw, so the slot only has to be
+    returned if the constructor of T throws.
+    */
+    T* ptr = nullptr;
+    try
+    {
+        ptr = new (ControlBlockType::instance(address)) T(std::forward<Args>(args)...);
+    }
+    catch (...)
+    {
+        release_slot(index);
+        throw;
+    }
+
+    ControlBlockType* const cbPtr = new (address) ControlBlockType(id(), index);
+    detail::set_shared_from_this<T>(ptr, cbPtr);
+    return compact_shared_ptr<T>(id(), index);
+}
+
+// -----------------------------------------------------------------------------
+
+template <typename T>
+inline
+compact_shared_ptr<T>::compact_shared_ptr(const compact_shared_ptr& ptr) noexcept :
+    mRegion(ptr.mRegion),
+    mIndex(ptr.mIndex)
+{
+    if (mRegion != detail::CompactRegionBase::kNoRegion)
+        block()->add_shared();
+}
+
+template <typename T>
+inline
+compact_shared_ptr<T>::compact_shared_ptr(compact_shared_ptr&& ptr) noexcept :
+    mRegion(ptr.mRegion),
+    mIndex(ptr.mIndex)
+{
+    ptr.mRegion = detail::CompactRegionBase::kNoRegion;
+    ptr.mIndex = 0;
+}
+
+template <typename T>
+inline
+compact_shared_ptr<T>::~compact_shared_ptr()
+{
+    if (mRegion != detail::CompactRegionBase::kNoRegion)
+        block()->release_shared();
+}
+
+template <typename T>
+inline compact_shared_ptr<T>&
+compact_shared_ptr<T>::operator=(const compact_shared_ptr& ptr)
+{
+    compact_shared_ptr(ptr).swap(*this);
+    return *this;
+}
+
+template <typename T>
+inline compact_shared_ptr<T>&
+compact_shared_ptr<T>::operator=(compact_shared_ptr&& ptr) noexcept
+{
+    compact_shared_ptr(std::move(ptr)).swap(*this);
+    return *this;
+}
+
+template <typename T>
+inline void compact_shared_ptr<T>::swap(compact_shared_ptr& ptr) noexcept
+{
+    std::swap(mRegion, ptr.mRegion);
+    std::swap(mIndex, ptr.mIndex);
+}
+
+template <typename T>
+inline void compact_shared_ptr<T>::reset()
+{
+    compact_shared_ptr().swap(*this);
+}
+
+template <typename T>
+inline shared_ptr_nc<T> compact_shared_ptr<T>::to_shared() const noexcept
+{
+    if (mRegion == detail::CompactRegionBase::kNoRegion)
+        return shared_ptr_nc<T>();
+
+    detail::ControlBlockRegion<T>* const block = this->block();
+    return detail::SharedPtrAccess::make(static_cast<detail::ControlBlock*>(block), block->get(), true);
+}
+
+}   // namespace bch
+
+#include "bch/common/header_suffix.hpp"
+
+#endif  // BCH_COMPACT_SHARED_PTR
@@ -0,0 +1,151 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#ifndef BCH_COW_PTR_NC
+#define BCH_COW_PTR_NC
+
+#pragma once
+
+#include <cassert>
+#include <type_traits>
+#include <utility>
+
+#include "bch/shared_ptr_nc.hpp"
+
+#include "bch/common/header_prefix.hpp"
+
+namespace bch {
+
+/* Copy on write value of type T.
+Copies of a cow_ptr_nc share the instance. Reading never copies. write() copies the
+instance if it is shared (use_count() > 1), and otherwise returns the instance so it
+can be mutated in place. The reference counts are not atomic, so the check is a
+plain load.
+
+The instance is always created as a T (there is no conversion from a pointer to a
+derived type), so a copy never slices the instance.
+A moved-from cow_ptr_nc has no instance and may only be assigned or destroyed.
+*/
+template <typename T>
+class cow_ptr_nc
+{
+public:
+    static_assert(!std::is_const_v<T>, "cow_ptr_nc manages the constness of T");
+
+    using element_type = T;
+
+    cow_ptr_nc();
+    cow_ptr_nc(const T& value);
+    cow_ptr_nc(T&& value);
+
+    template <typename ... Args>
+    explicit cow_ptr_nc(std::in_place_t, Args&& ... args);
+
+    cow_ptr_nc(const cow_ptr_nc&) noexcept = default;
+    cow_ptr_nc(cow_ptr_nc&&) noexcept = default;
+    cow_ptr_nc& operator=(const cow_ptr_nc&) = default;
+    cow_ptr_nc& operator=(cow_ptr_nc&&) = default;
+
+    const T& operator*() const noexcept {
+        return *mPtr;
+    }
+
+    const T* operator->() const noexcept {
+        return mPtr.get();
+    }
+
+    const T& read() const noexcept {
+        return *mPtr;
+    }
+
+    // Return the instance for mutation, copying it first if it is shared
+    T& write();
+
+    /* Move the instance out of the pointer. The instance is moved if this is the
+    only reference, and copied otherwise. The pointer has no instance afterwards.
+    */
+    T try_unwrap();
+
+    bool unique() const noexcept {
+        return mPtr.unique();
+    }
+
+    long use_count() const noexcept {
+        return mPtr.use_count();
+    }
+
+    // Share the current instance with code that expects a shared_ptr_nc
+    shared_ptr_nc<const T> share() const noexcept {
+        return mPtr;
+    }
+
+    // True if both pointers share the same instance (the values are then equal)
+    bool shares_with(const cow_ptr_nc& other) const noexcept {
+        return (mPtr == other.mPtr);
+    }
+
+private:
+    shared_ptr_nc<T>    mPtr;
+};
+
+template <typename T>
+struct is_trivially_relocatable<cow_ptr_nc<T>>: std::true_type {};
+
+// -----------------------------------------------------------------------------
+
+template <typename T>
+inline
+cow_ptr_nc<T>::cow_ptr_nc() :
+    mPtr(bch::make_shared<T>())
+{ }
+
+template <typename T>
+inline
+cow_ptr_nc<T>::cow_ptr_nc(const T& value) :
+    mPtr(bch::make_shared<T>(value))
+{ }
+
+template <typename T>
+inline
+cow_ptr_nc<T>::cow_ptr_nc(T&& value) :
+    mPtr(bch::make_shared<T>(std::move(value)))
+{ }
+
+template <typename T>
+template <typename ... Args>
+inline
+cow_ptr_nc<T>::cow_ptr_nc(std::in_place_t, Args&& ... args) :
+    mPtr(bch::make_shared<T>(std::forward<Args>(args)...))
+{ }
+
+template <typename T>
+inline T& cow_ptr_nc<T>::write()
+{
+#if BCH_SMART_PTR_DEBUG
+    assert(mPtr);
+#endif
+
+    if (!mPtr.unique())
+        mPtr = bch::make_shared<T>(static_cast<const T&>(*mPtr));
+    return *mPtr;
+}
+
+template <typename T>
+T cow_ptr_nc<T>::try_unwrap()
+{
+#if BCH_SMART_PTR_DEBUG
+    assert(mPtr);
+#endif
+
+    shared_ptr_nc<T> ptr = std::move(mPtr);
+    if (ptr.unique())
+        return T(std::move(*ptr));
+    return T(static_cast<const T&>(*ptr));
+}
+
+}   // namespace bch
+
+#include "bch/common/header_suffix.hpp"
+
+#endif  // BCH_COW_PTR_NC
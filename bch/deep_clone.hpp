@@ -0,0 +1,249 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#ifndef BCH_DEEP_CLONE
+#define BCH_DEEP_CLONE
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <type_traits>
+#include <typeinfo>
+#include <unordered_map>
+#include <utility>
+
+#include "bch/shared_ptr_nc.hpp"
+
+#include "bch/common/header_prefix.hpp"
+
+namespace bch {
+
+/* Clone a graph of shared_ptr_nc instances while keeping the sharing of the graph.
+The context maps each original instance (its control block and address) to its
+clone, so an instance that is reachable through several pointers is only cloned once, and all
+pointers to it refer to the same clone. Cycles are supported.
+
+An instance is cloned with its copy constructor. The copy then still points to the
+original children. A type with children replaces them with clones in a function that
+is found by argument dependent lookup:
+/code
+    void clone_members(bch::clone_context& context, Node& copy)
+    {
+        copy.mChild = context.clone(copy.mChild);
+    }
+/endcode
+Types without that function are copied as leaves (their pointers are shared with the
+original graph).
+
+Lazy mode (write and current) copies an instance the first time it is mutated, and
+leaves the rest of the graph shared with the original (see lazy_clone).
+
+Pointers must point to the exact type of the instance (a copy through a base class
+would slice the instance).
+The context holds a strong reference to each original and each clone, so the
+mapping stays valid for the lifetime of the context.
+*/
+class clone_context
+{
+public:
+    clone_context() = default;
+    ~clone_context();
+
+    // Return the clone of ptr (cloning the instance and its children on first use)
+    template <typename T>
+    shared_ptr_nc<T> clone(const shared_ptr_nc<T>& ptr);
+
+    /* Lazy mode: return a mutable reference to the clone of *ptr, and make ptr point
+    to it. The instance is copied (without cloning its children) on the first write,
+    later writes through any pointer to the same original return the same copy.
+    ptr must be held by an instance that has been written (or by the root), since ptr
+    itself is changed.
+    */
+    template <typename T>
+    std::remove_const_t<T>& write(shared_ptr_nc<T>& ptr);
+
+    // Return the clone of ptr if the instance has been cloned, and ptr otherwise
+    template <typename T>
+    shared_ptr_nc<T> current(const shared_ptr_nc<T>& ptr) const noexcept;
+
+    // Number of instances that have been cloned
+    std::size_t size() const noexcept {
+        return mCloneCount;
+    }
+
+private:
+    clone_context(const clone_context&) = delete;
+    clone_context(clone_context&&) = delete;
+    clone_context& operator=(const clone_context&) = delete;
+    clone_context& operator=(clone_context&&) = delete;
+
+    struct Clone
+    {
+        detail::ControlBlock*   mHandle;
+        void*                   mPtr;
+    };
+
+    // Return the clone of the instance at ptr (nullptr if it has not been cloned)
+    const Clone* find(const detail::ControlBlock* handle, const void* ptr) const noexcept;
+
+    /* Remember that clone is the clone of original. The context takes a strong
+    reference to both.
+    */
+    void add(detail::ControlBlock* original, const void* originalPtr, detail::ControlBlock* clone, void* ptr);
+
+    // Copy the instance of ptr (without its children) and remember the copy
+    template <typename T>
+    shared_ptr_nc<std::remove_const_t<T>> copy(const shared_ptr_nc<T>& ptr);
+
+    /* Maps originals to their clones, and each clone to itself (so a pointer that
+    has already been replaced by a clone is not cloned again).
+    */
+    std::unordered_map<detail::InstanceKey, Clone, detail::InstanceKeyHash> mClones;
+    std::size_t                                                             mCloneCount{0};
+};
+
+/* Copy on write clone of a graph. Nothing is copied until an instance is written:
+writing an instance copies it (and only it), so editing a small part of a large graph
+costs proportionally to the edit.
+Only instances on the path to the root can be written: the root with write_root,
+and a child with write(member), where member is a pointer held by an instance that
+has been written:
+/code
+    bch::lazy_clone<Model> edit(model);
+    Model& root = edit.write_root();
+    Layer& layer = edit.write(root.mLayers[3]);
+    layer.mName = "renamed";
+    // edit.root() is a new model that shares everything but the root and layer 3
+/endcode
+Instances that are shared within the graph stay shared: writing another pointer to
+an instance that has been written returns the same copy. Use read to see the current
+version of an instance through a pointer that has not been written.
+*/
+template <typename T>
+class lazy_clone
+{
+public:
+    explicit lazy_clone(shared_ptr_nc<T> original) noexcept :
+        mRoot(std::move(original))
+    { }
+
+    const shared_ptr_nc<T>& root() const noexcept {
+        return mRoot;
+    }
+
+    std::remove_const_t<T>& write_root() {
+        return mContext.write(mRoot);
+    }
+
+    template <typename U>
+    std::remove_const_t<U>& write(shared_ptr_nc<U>& member) {
+        return mContext.write(member);
+    }
+
+    template <typename U>
+    shared_ptr_nc<U> read(const shared_ptr_nc<U>& member) const noexcept {
+        return mContext.current(member);
+    }
+
+    // Number of instances that have been copied
+    std::size_t copy_count() const noexcept {
+        return mContext.size();
+    }
+
+private:
+    clone_context       mContext;
+    shared_ptr_nc<T>    mRoot;
+};
+
+// Clone ptr and everything reachable from it (see clone_context)
+template <typename T>
+shared_ptr_nc<T> deep_clone(const shared_ptr_nc<T>& ptr);
+
+// -----------------------------------------------------------------------------
+
+namespace detail {
+
+template <typename T, typename = void>
+struct HasCloneMembers: std::false_type {};
+
+template <typename T>
+struct HasCloneMembers<T, std::void_t<decltype(clone_members(std::declval<clone_context&>(), std::declval<T&>()))>>:
+    std::true_type {};
+
+}   // namespace detail
+
+template <typename T>
+shared_ptr_nc<std::remove_const_t<T>> clone_context::copy(const shared_ptr_nc<T>& ptr)
+{
+    typedef std::remove_const_t<T> Type;
+    static_assert(std::is_copy_constructible_v<Type>, "cloned types must be copy constructible");
+
+#if BCH_SMART_PTR_DEBUG
+    if constexpr (std::is_polymorphic_v<Type>)
+        assert(typeid(*ptr) == typeid(Type));
+#endif
+
+    shared_ptr_nc<Type> result = bch::make_shared<Type>(static_cast<const Type&>(*ptr));
+    add(detail::SharedPtrAccess::handle(ptr), ptr.get(), detail::SharedPtrAccess::handle(result), result.get());
+    return result;
+}
+
+template <typename T>
+shared_ptr_nc<T> clone_context::clone(const shared_ptr_nc<T>& ptr)
+{
+    const detail::ControlBlock* const handle = detail::SharedPtrAccess::handle(ptr);
+    if (handle == nullptr)
+        return shared_ptr_nc<T>();
+
+    if (const Clone* const existing = find(handle, ptr.get()))
+        return detail::SharedPtrAccess::make(existing->mHandle, static_cast<T*>(existing->mPtr), true);
+
+    // The copy is known before its children are cloned, so a cycle resolves to the copy
+    shared_ptr_nc<std::remove_const_t<T>> result = copy(ptr);
+    if constexpr (detail::HasCloneMembers<std::remove_const_t<T>>::value)
+        clone_members(*this, *result);
+    return result;
+}
+
+template <typename T>
+std::remove_const_t<T>& clone_context::write(shared_ptr_nc<T>& ptr)
+{
+#if BCH_SMART_PTR_DEBUG
+    assert(ptr);
+#endif
+
+    if (const Clone* const existing = find(detail::SharedPtrAccess::handle(ptr), ptr.get()))
+    {
+        if (existing->mPtr != ptr.get())
+            ptr = detail::SharedPtrAccess::make(existing->mHandle, static_cast<T*>(existing->mPtr), true);
+    }
+    else
+    {
+        ptr = copy(ptr);
+    }
+    return const_cast<std::remove_const_t<T>&>(*ptr);
+}
+
+template <typename T>
+shared_ptr_nc<T> clone_context::current(const shared_ptr_nc<T>& ptr) const noexcept
+{
+    const Clone* const existing = find(detail::SharedPtrAccess::handle(ptr), ptr.get());
+    if (existing == nullptr)
+        return ptr;
+    return detail::SharedPtrAccess::make(existing->mHandle, static_cast<T*>(existing->mPtr), true);
+}
+
+template <typename T>
+inline shared_ptr_nc<T> deep_clone(const shared_ptr_nc<T>& ptr)
+{
+    clone_context context;
+    return context.clone(ptr);
+}
+
+}   // namespace bch
+
+#include "bch/common/header_suffix.hpp"
+
+#endif  // BCH_DEEP_CLONE
@@ -0,0 +1,81 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#ifndef BCH_EXPIRY_LISTENER
+#define BCH_EXPIRY_LISTENER
+
+#pragma once
+
+#include "bch/shared_ptr_nc.hpp"
+
+#include "bch/common/header_prefix.hpp"
+
+namespace bch {
+
+/* Listener that is notified when the strong reference count of an instance reaches 0.
+Observers of an instance (for example caches of weak_ptr values) can then react to
+the expiry immediately, instead of finding expired weak pointers later.
+
+Listeners are stored in a table that is keyed by the control block, and the control
+block marks that it has listeners with a bit in its weak reference count. Releasing
+an instance without listeners therefore only tests the bit. The table is guarded by
+a mutex, so listeners for instances that are used by different threads can be
+registered concurrently.
+
+Immortal instances never expire: listening to them has no effect.
+*/
+class expiry_listener
+{
+public:
+    expiry_listener() noexcept = default;
+
+    // Cancels the registration
+    virtual ~expiry_listener();
+
+    /* Listen for the expiry of the instance of ptr (which must not be empty). A
+    listener listens to one instance at a time: a previous registration is cancelled.
+    Throws std::bad_alloc if the registration cannot be stored.
+    */
+    template <typename T>
+    void listen(const shared_ptr_nc<T>& ptr) {
+        listen(detail::SharedPtrAccess::handle(ptr));
+    }
+
+    void cancel() noexcept;
+
+    bool listening() const noexcept {
+        return (mHandle != nullptr);
+    }
+
+protected:
+    /* Invoked when the strong reference count of the instance reaches 0 (after the
+    instance has been destroyed). The listener is no longer registered, and may be
+    destroyed by the callback.
+    */
+    virtual void on_expired() noexcept = 0;
+
+private:
+    friend void detail::NotifyExpiry(detail::ControlBlock* handle) noexcept;
+
+    expiry_listener(const expiry_listener&) = delete;
+    expiry_listener(expiry_listener&&) = delete;
+    expiry_listener& operator=(const expiry_listener&) = delete;
+    expiry_listener& operator=(expiry_listener&&) = delete;
+
+    void listen(detail::ControlBlock* handle);
+
+    // Remove the listener from the list of its control block (the table lock must be held)
+    void unlink() noexcept;
+
+    detail::ControlBlock*   mHandle{nullptr};
+    // Other listeners of the same control block
+    expiry_listener*        mPrevious{nullptr};
+    expiry_listener*        mNext{nullptr};
+};
+
+}   // namespace bch
+
+#include "bch/common/header_suffix.hpp"
+
+#endif  // BCH_EXPIRY_LISTENER
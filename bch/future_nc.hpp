@@ -0,0 +1,706 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#ifndef BCH_FUTURE_NC
+#define BCH_FUTURE_NC
+
+#pragma once
+
+#include <cassert>
+#include <coroutine>
+#include <cstddef>
+#include <cstdlib>
+#include <exception>
+#include <future>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "bch/shared_ptr_nc.hpp"
+#include "bch/common/relocation.hpp"
+
+#include "bch/common/header_prefix.hpp"
+
+namespace bch {
+
+template <typename T>
+class future_nc;
+
+template <typename T>
+class promise_nc;
+
+namespace detail {
+
+// Value stored for future_nc<void>
+struct FutureVoid {};
+
+template <typename T>
+using FutureValue = std::conditional_t<std::is_void_v<T>, FutureVoid, T>;
+
+// Exception stored by a promise_nc that is destroyed before it is satisfied
+std::exception_ptr BrokenPromiseException();
+
+[[noreturn]] void ThrowFutureError(std::future_errc error);
+
+// Coroutine promise of a coroutine that returns future_nc<T>
+template <typename T>
+class FutureCoroutine;
+
+/* Shared state of a promise_nc and its future_nc. The state is a control block, so
+the promise and the future share it with the non atomic reference counts. The
+result and a single continuation are stored in the control block (one allocation).
+*/
+template <typename T>
+class ControlBlockFuture: public ControlBlock
+{
+public:
+    typedef FutureValue<T> Value;
+
+    // Allocate a state with a reference count of 1. Throws std::bad_alloc.
+    static ControlBlockFuture* Create();
+
+    bool ready() const noexcept {
+        return (mStatus != Status::kPending);
+    }
+
+    // Throws std::future_error if the future has already been retrieved
+    void retrieve_future();
+
+    // Store the result and run the continuation. Throws std::future_error if the state is ready.
+    template <typename ... Args>
+    void set_value(Args&& ... args);
+    void set_exception(std::exception_ptr exception);
+
+    // Set the broken promise exception if the result can still be observed
+    void abandon() noexcept;
+
+    // Move the result out of a ready state (rethrows a stored exception)
+    T take();
+
+    /* Invoke function(*this) once the state is ready (immediately if it is ready).
+    function must not throw. A function of up to kInlineSize bytes is stored in the
+    state; larger functions are allocated. Only one continuation can be set.
+    */
+    template <typename F>
+    void set_continuation(F&& function);
+
+protected:
+    virtual void on_zero_shared();
+
+private:
+    ControlBlockFuture() noexcept = default;
+
+    enum class Status: unsigned char
+    {
+        kPending,
+        kValue,
+        kException
+    };
+
+    static constexpr std::size_t kInlineSize = 4 * sizeof(void*);
+
+    typedef void (*RunContinuation)(void* storage, ControlBlockFuture& state) noexcept;
+    typedef void (*DestroyContinuation)(void* storage) noexcept;
+
+    template <typename F>
+    static constexpr bool is_inline() noexcept {
+        return (sizeof(F) <= kInlineSize) && (alignof(F) <= alignof(std::max_align_t)) &&
+               std::is_nothrow_move_constructible_v<F>;
+    }
+
+    template <typename F>
+    static F* continuation(void* storage) noexcept {
+        if constexpr (is_inline<F>())
+            return static_cast<F*>(storage);
+        else
+            return *static_cast<F**>(storage);
+    }
+
+    template <typename F>
+    static void run_continuation(void* storage, ControlBlockFuture& state) noexcept;
+
+    template <typename F>
+    static void destroy_continuation(void* storage) noexcept;
+
+    Value* value() noexcept {
+        return reinterpret_cast<Value*>(mResult);
+    }
+
+    std::exception_ptr* exception() noexcept {
+        return reinterpret_cast<std::exception_ptr*>(mResult);
+    }
+
+    // Invoke the continuation (if any)
+    void complete() noexcept;
+
+    static constexpr std::size_t kResultSize =
+        (sizeof(Value) > sizeof(std::exception_ptr)) ? sizeof(Value) : sizeof(std::exception_ptr);
+
+    Status                  mStatus{Status::kPending};
+    bool                    mFutureRetrieved{false};
+    // The continuation is stored in mContinuation (or allocated if it does not fit)
+    RunContinuation         mRunContinuation{nullptr};
+    DestroyContinuation     mDestroyContinuation{nullptr};
+    alignas(std::max_align_t) unsigned char                 mContinuation[kInlineSize];
+    alignas(Value) alignas(std::exception_ptr) unsigned char mResult[kResultSize];
+};
+
+// Result type of future_nc<T>::then(function)
+template <typename T, typename F>
+struct FutureThenResult
+{
+    typedef std::invoke_result_t<F, T> type;
+};
+
+template <typename F>
+struct FutureThenResult<void, F>
+{
+    typedef std::invoke_result_t<F> type;
+};
+
+}   // namespace detail
+
+/* Producer side of a single threaded future (see future_nc).
+The promise and its future share one allocation: the state is a control block with
+non atomic reference counts, and stores the result and one continuation.
+Destroying a promise that has not been satisfied stores a std::future_error
+(broken_promise) for its future.
+*/
+template <typename T>
+class promise_nc
+{
+public:
+    // Allocate the shared state. Throws std::bad_alloc.
+    promise_nc();
+
+    promise_nc(promise_nc&& other) noexcept :
+        mState(other.mState)
+    {
+        other.mState = nullptr;
+    }
+
+    ~promise_nc();
+
+    promise_nc& operator=(promise_nc&& other) noexcept;
+
+    // Return the future of the promise. Throws std::future_error if invoked twice.
+    future_nc<T> get_future();
+
+    /* Store the value and run the continuation of the future. Throws std::future_error
+    if the promise is satisfied.
+    */
+    template <typename ... Args>
+    void set_value(Args&& ... args);
+
+    void set_exception(std::exception_ptr exception);
+
+    void swap(promise_nc& other) noexcept {
+        std::swap(mState, other.mState);
+    }
+
+private:
+    promise_nc(const promise_nc&) = delete;
+    promise_nc& operator=(const promise_nc&) = delete;
+
+    typedef detail::ControlBlockFuture<T> State;
+
+    State*  mState;
+};
+
+/* Consumer side of a single threaded future.
+A future_nc is ready when its promise has been satisfied. The result is taken with
+get, chained with then, or awaited from a coroutine:
+/code
+    bch::future_nc<int> Length(bch::future_nc<std::string> text)
+    {
+        const std::string value = co_await std::move(text);
+        co_return static_cast<int>(value.size());
+    }
+
+    Length(std::move(future)).then([](int length) { Print(length); });
+/endcode
+A coroutine that returns future_nc<T> runs until it first suspends, and completes
+the returned future when it returns.
+
+Continuations run on the thread that satisfies the promise, inside set_value (or
+immediately if the future is ready). then and co_await do not allocate for the
+continuation; then allocates the state of the returned future.
+Not thread safe: the promise and the future must be used by one thread.
+*/
+template <typename T>
+class future_nc
+{
+public:
+    typedef detail::FutureCoroutine<T> promise_type;
+
+    future_nc() noexcept = default;
+
+    future_nc(future_nc&& other) noexcept :
+        mState(other.mState)
+    {
+        other.mState = nullptr;
+    }
+
+    ~future_nc();
+
+    future_nc& operator=(future_nc&& other) noexcept;
+
+    // Returns true if the future has a state (it has not been consumed)
+    bool valid() const noexcept {
+        return (mState != nullptr);
+    }
+
+    bool ready() const noexcept {
+        return (mState != nullptr) && mState->ready();
+    }
+
+    /* Return the result of a ready future (rethrows the stored exception). The future
+    is consumed.
+    A single threaded future cannot wait for its promise: get throws std::future_error
+    (no_state) if the future has no state or is not ready (the future is then not
+    consumed).
+    */
+    T get();
+
+    /* Invoke function with the value when the future is ready, and return a future of
+    the result of function. An exception (stored or thrown by function) is passed
+    on to the returned future. The future is consumed.
+    Throws std::bad_alloc.
+    */
+    template <typename F>
+    future_nc<typename detail::FutureThenResult<T, F>::type> then(F&& function) &&;
+
+    class awaiter;
+
+    // Suspend a coroutine until the future is ready. The future is consumed.
+    awaiter operator co_await() && noexcept;
+
+    void swap(future_nc& other) noexcept {
+        std::swap(mState, other.mState);
+    }
+
+private:
+    future_nc(const future_nc&) = delete;
+    future_nc& operator=(const future_nc&) = delete;
+
+    friend class promise_nc<T>;
+
+    typedef detail::ControlBlockFuture<T> State;
+
+    explicit future_nc(State* state) noexcept :
+        mState(state)
+    { }
+
+    // Transfer the reference to the state to the caller
+    State* release_state() noexcept;
+
+    State*  mState{nullptr};
+};
+
+template <typename T>
+class future_nc<T>::awaiter
+{
+public:
+    explicit awaiter(State* state) noexcept :
+        mState(state)
+    { }
+
+    awaiter(awaiter&& other) noexcept :
+        mState(other.mState)
+    {
+        other.mState = nullptr;
+    }
+
+    ~awaiter() {
+        if (mState != nullptr)
+            mState->release_shared();
+    }
+
+    bool await_ready() const noexcept {
+        return mState->ready();
+    }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+        mState->set_continuation([handle](State&) noexcept { handle.resume(); });
+    }
+
+    T await_resume() {
+        return mState->take();
+    }
+
+private:
+    awaiter(const awaiter&) = delete;
+    awaiter& operator=(const awaiter&) = delete;
+    awaiter& operator=(awaiter&&) = delete;
+
+    State*  mState;
+};
+
+namespace detail {
+
+/* Coroutine promise of a coroutine that returns future_nc<T>. The coroutine runs
+eagerly (until it first suspends), and its frame is destroyed when it completes.
+*/
+template <typename T>
+class FutureCoroutineBase
+{
+public:
+    future_nc<T> get_return_object() {
+        return mPromise.get_future();
+    }
+
+    std::suspend_never initial_suspend() const noexcept {
+        return std::suspend_never();
+    }
+
+    std::suspend_never final_suspend() const noexcept {
+        return std::suspend_never();
+    }
+
+    void unhandled_exception() noexcept {
+        mPromise.set_exception(std::current_exception());
+    }
+
+protected:
+    promise_nc<T>   mPromise;
+};
+
+template <typename T>
+class FutureCoroutine: public FutureCoroutineBase<T>
+{
+public:
+    template <typename U>
+    void return_value(U&& value) {
+        this->mPromise.set_value(std::forward<U>(value));
+    }
+};
+
+template <>
+class FutureCoroutine<void>: public FutureCoroutineBase<void>
+{
+public:
+    void return_void() {
+        mPromise.set_value();
+    }
+};
+
+}   // namespace detail
+
+template <typename T>
+struct is_trivially_relocatable<promise_nc<T>>: std::true_type {};
+
+template <typename T>
+struct is_trivially_relocatable<future_nc<T>>: std::true_type {};
+
+// Return a future that is ready with value. Throws std::bad_alloc.
+template <typename T>
+future_nc<std::decay_t<T>> make_ready_future_nc(T&& value);
+
+future_nc<void> make_ready_future_nc();
+
+// -----------------------------------------------------------------------------
+
+template <typename T>
+detail::ControlBlockFuture<T>* detail::ControlBlockFuture<T>::Create()
+{
+    static_assert(alignof(Value) <= alignof(std::max_align_t), "over-aligned values are not supported");
+
+    void* const address = malloc(sizeof(ControlBlockFuture));
+    if (address == nullptr)
+        throw std::bad_alloc();
+    return new (address) ControlBlockFuture();
+}
+
+template <typename T>
+inline void detail::ControlBlockFuture<T>::retrieve_future()
+{
+    if (mFutureRetrieved)
+        ThrowFutureError(std::future_errc::future_already_retrieved);
+    mFutureRetrieved = true;
+}
+
+template <typename T>
+template <typename ... Args>
+void detail::ControlBlockFuture<T>::set_value(Args&& ... args)
+{
+    if (ready())
+        ThrowFutureError(std::future_errc::promise_already_satisfied);
+
+    new (value()) Value(std::forward<Args>(args)...);
+    mStatus = Status::kValue;
+    complete();
+}
+
+template <typename T>
+void detail::ControlBlockFuture<T>::set_exception(std::exception_ptr exception)
+{
+    if (ready())
+        ThrowFutureError(std::future_errc::promise_already_satisfied);
+
+    new (this->exception()) std::exception_ptr(std::move(exception));
+    mStatus = Status::kException;
+    complete();
+}
+
+template <typename T>
+void detail::ControlBlockFuture<T>::abandon() noexcept
+{
+    // Nobody can observe the result of a state without a future
+    if (ready() || !mFutureRetrieved)
+        return;
+
+    new (exception()) std::exception_ptr(BrokenPromiseException());
+    mStatus = Status::kException;
+    complete();
+}
+
+template <typename T>
+T detail::ControlBlockFuture<T>::take()
+{
+#if BCH_SMART_PTR_DEBUG
+    assert(ready());
+#endif
+
+    if (mStatus == Status::kException)
+        std::rethrow_exception(*exception());
+    if constexpr (!std::is_void_v<T>)
+        return std::move(*value());
+}
+
+template <typename T>
+template <typename F>
+void detail::ControlBlockFuture<T>::set_continuation(F&& function)
+{
+    typedef std::decay_t<F> Function;
+
+#if BCH_SMART_PTR_DEBUG
+    assert(mRunContinuation == nullptr);
+#endif
+
+    if (ready())
+    {
+        // A ready state runs the continuation without storing it
+        function(*this);
+        return;
+    }
+
+    if constexpr (is_inline<Function>())
+        new (mContinuation) Function(std::forward<F>(function));
+    else
+        *reinterpret_cast<Function**>(mContinuation) = new Function(std::forward<F>(function));
+
+    mRunContinuation = &run_continuation<Function>;
+    mDestroyContinuation = &destroy_continuation<Function>;
+}
+
+template <typename T>
+template <typename F>
+void detail::ControlBlockFuture<T>::run_continuation(void* storage, ControlBlockFuture& state) noexcept
+{
+    (*continuation<F>(storage))(state);
+    destroy_continuation<F>(storage);
+}
+
+template <typename T>
+template <typename F>
+void detail::ControlBlockFuture<T>::destroy_continuation(void* storage) noexcept
+{
+    if constexpr (is_inline<F>())
+        continuation<F>(storage)->~F();
+    else
+        delete continuation<F>(storage);
+}
+
+template <typename T>
+inline void detail::ControlBlockFuture<T>::complete() noexcept
+{
+    if (mRunContinuation == nullptr)
+        return;
+
+    const RunContinuation run = mRunContinuation;
+    mRunContinuation = nullptr;
+    mDestroyContinuation = nullptr;
+    run(mContinuation, *this);
+}
+
+template <typename T>
+void detail::ControlBlockFuture<T>::on_zero_shared()
+{
+    if (mDestroyContinuation != nullptr)
+        mDestroyContinuation(mContinuation);
+
+    if (mStatus == Status::kValue)
+        value()->~Value();
+    else if (mStatus == Status::kException)
+        exception()->~exception_ptr();
+}
+
+// -----------------------------------------------------------------------------
+
+template <typename T>
+inline promise_nc<T>::promise_nc() :
+    mState(State::Create())
+{
+}
+
+template <typename T>
+inline promise_nc<T>::~promise_nc()
+{
+    if (mState != nullptr)
+    {
+        mState->abandon();
+        mState->release_shared();
+    }
+}
+
+template <typename T>
+inline promise_nc<T>& promise_nc<T>::operator=(promise_nc&& other) noexcept
+{
+    promise_nc(std::move(other)).swap(*this);
+    return *this;
+}
+
+template <typename T>
+future_nc<T> promise_nc<T>::get_future()
+{
+    if (mState == nullptr)
+        detail::ThrowFutureError(std::future_errc::no_state);
+
+    mState->retrieve_future();
+    mState->add_shared();
+    return future_nc<T>(mState);
+}
+
+template <typename T>
+template <typename ... Args>
+inline void promise_nc<T>::set_value(Args&& ... args)
+{
+    if (mState == nullptr)
+        detail::ThrowFutureError(std::future_errc::no_state);
+    mState->set_value(std::forward<Args>(args)...);
+}
+
+template <typename T>
+inline void promise_nc<T>::set_exception(std::exception_ptr exception)
+{
+    if (mState == nullptr)
+        detail::ThrowFutureError(std::future_errc::no_state);
+    mState->set_exception(std::move(exception));
+}
+
+// -----------------------------------------------------------------------------
+
+template <typename T>
+inline future_nc<T>::~future_nc()
+{
+    if (mState != nullptr)
+        mState->release_shared();
+}
+
+template <typename T>
+inline future_nc<T>& future_nc<T>::operator=(future_nc&& other) noexcept
+{
+    future_nc(std::move(other)).swap(*this);
+    return *this;
+}
+
+template <typename T>
+inline typename future_nc<T>::State* future_nc<T>::release_state() noexcept
+{
+    State* const state = mState;
+    mState = nullptr;
+    return state;
+}
+
+template <typename T>
+T future_nc<T>::get()
+{
+    if ((mState == nullptr) || !mState->ready())
+        detail::ThrowFutureError(std::future_errc::no_state);
+
+    future_nc consumed(release_state());
+    return consumed.mState->take();
+}
+
+template <typename T>
+template <typename F>
+future_nc<typename detail::FutureThenResult<T, F>::type> future_nc<T>::then(F&& function) &&
+{
+    typedef typename detail::FutureThenResult<T, F>::type Result;
+
+    if (mState == nullptr)
+        detail::ThrowFutureError(std::future_errc::no_state);
+
+    promise_nc<Result> promise;
+    future_nc<Result> result = promise.get_future();
+
+    // The state is kept alive by its promise until the continuation has run
+    future_nc consumed(release_state());
+    consumed.mState->set_continuation(
+        [function = std::forward<F>(function), promise = std::move(promise)](State& state) mutable noexcept {
+            try
+            {
+                if constexpr (std::is_void_v<T>)
+                {
+                    state.take();
+                    if constexpr (std::is_void_v<Result>)
+                    {
+                        function();
+                        promise.set_value();
+                    }
+                    else
+                    {
+                        promise.set_value(function());
+                    }
+                }
+                else if constexpr (std::is_void_v<Result>)
+                {
+                    function(state.take());
+                    promise.set_value();
+                }
+                else
+                {
+                    promise.set_value(function(state.take()));
+                }
+            }
+            catch (...)
+            {
+                promise.set_exception(std::current_exception());
+            }
+        });
+    return result;
+}
+
+template <typename T>
+inline typename future_nc<T>::awaiter future_nc<T>::operator co_await() && noexcept
+{
+#if BCH_SMART_PTR_DEBUG
+    assert(mState != nullptr);
+#endif
+
+    return awaiter(release_state());
+}
+
+template <typename T>
+future_nc<std::decay_t<T>> make_ready_future_nc(T&& value)
+{
+    promise_nc<std::decay_t<T>> promise;
+    future_nc<std::decay_t<T>> result = promise.get_future();
+    promise.set_value(std::forward<T>(value));
+    return result;
+}
+
+inline future_nc<void> make_ready_future_nc()
+{
+    promise_nc<void> promise;
+    future_nc<void> result = promise.get_future();
+    promise.set_value();
+    return result;
+}
+
+}   // namespace bch
+
+#include "bch/common/header_suffix.hpp"
+
+#endif  // BCH_FUTURE_NC
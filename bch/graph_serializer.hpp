@@ -0,0 +1,281 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#ifndef BCH_GRAPH_SERIALIZER
+#define BCH_GRAPH_SERIALIZER
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "bch/shared_ptr_nc.hpp"
+
+#include "bch/common/header_prefix.hpp"
+
+namespace bch {
+
+/* Tag type used to select the deserialize function of a type (see graph_reader). */
+template <typename T>
+struct graph_type
+{
+};
+
+/* Memory that holds a serialized graph: either a read only mapping of a file, or a
+copy of a buffer.
+Instances that are loaded without copying (graph_reader::read_trivial) share the
+ownership of the image, so the image stays mapped while they are used.
+*/
+class graph_image
+{
+public:
+    // Throws std::system_error if the file cannot be mapped
+    static shared_ptr_nc<const graph_image> map(const char* path);
+
+    // Throws std::bad_alloc if memory cannot be allocated
+    static shared_ptr_nc<const graph_image> copy(const void* data, std::size_t size);
+
+    ~graph_image();
+
+    const char* data() const noexcept {
+        return mData;
+    }
+
+    std::size_t size() const noexcept {
+        return mSize;
+    }
+
+private:
+    graph_image(char* data, std::size_t size, bool mapped) noexcept :
+        mData(data),
+        mSize(size),
+        mMapped(mapped)
+    { }
+
+    graph_image(const graph_image&) = delete;
+    graph_image(graph_image&&) = delete;
+    graph_image& operator=(const graph_image&) = delete;
+    graph_image& operator=(graph_image&&) = delete;
+
+    char*           mData;
+    std::size_t     mSize;
+    bool            mMapped;
+};
+
+/* Serialize a graph of shared_ptr_nc instances into a binary image.
+Shared instances are detected by their control block and address, and are only
+written once:
+the first reference to an instance writes its id followed by its data, later
+references only write the id. Loading the image recreates the sharing.
+
+The data of a T instance is written by a function that is found by argument
+dependent lookup:
+/code
+    void serialize(bch::graph_writer& writer, const Node& node)
+    {
+        writer.write_value(node.mValue);
+        writer.write(node.mChild);
+    }
+/endcode
+
+All pointers to an instance must be written with the same type. The graph must not
+have cycles (loading an image with a cycle throws std::runtime_error).
+*/
+class graph_writer
+{
+public:
+    graph_writer();
+
+    template <typename T>
+    void write(const shared_ptr_nc<T>& ptr);
+
+    /* Write a trivially copyable instance, so it can be loaded without a copy (see
+    graph_reader::read_trivial).
+    */
+    template <typename T>
+    void write_trivial(const shared_ptr_nc<T>& ptr);
+
+    template <typename T>
+    void write_value(const T& value);
+
+    void write_bytes(const void* data, std::size_t size);
+
+    const std::vector<char>& image() const noexcept {
+        return mImage;
+    }
+
+    // Throws std::system_error if the file cannot be written
+    void save(const char* path) const;
+
+private:
+    /* Write the reference to the instance at ptr. Returns true if this is the first
+    reference (the data of the instance must follow).
+    */
+    bool write_reference(const detail::ControlBlock* handle, const void* ptr);
+
+    // Pad the image so the next write starts at a multiple of alignment
+    void align(std::size_t alignment);
+
+    std::vector<char>                                                           mImage;
+    std::unordered_map<detail::InstanceKey, std::uint32_t, detail::InstanceKeyHash>   mIds;
+};
+
+/* Load a graph that was written by graph_writer.
+Instances are created by a function that is found by argument dependent lookup, and
+that reads the data written by the serialize function:
+/code
+    bch::shared_ptr_nc<Node> deserialize(bch::graph_reader& reader, bch::graph_type<Node>)
+    {
+        const int value = reader.read_value<int>();
+        return bch::make_shared<Node>(value, reader.read<Node>());
+    }
+/endcode
+Values must be read in the order they were written, and with the types they were
+written with. A corrupt image throws std::runtime_error.
+*/
+class graph_reader
+{
+public:
+    // Throws std::runtime_error if image does not hold a graph
+    explicit graph_reader(shared_ptr_nc<const graph_image> image);
+    ~graph_reader();
+
+    template <typename T>
+    shared_ptr_nc<T> read();
+
+    /* Read an instance that was written by write_trivial. The instance is not
+    copied: the pointer points into the image and shares its ownership.
+    */
+    template <typename T>
+    shared_ptr_nc<const T> read_trivial();
+
+    template <typename T>
+    T read_value();
+
+    void read_bytes(void* data, std::size_t size);
+
+private:
+    graph_reader(const graph_reader&) = delete;
+    graph_reader(graph_reader&&) = delete;
+    graph_reader& operator=(const graph_reader&) = delete;
+    graph_reader& operator=(graph_reader&&) = delete;
+
+    static constexpr std::uint32_t kNull = 0xFFFFFFFF;
+
+    // Instances that have been read. The reader holds a strong reference to each.
+    struct Node
+    {
+        detail::ControlBlock*   mHandle;
+        void*                   mPtr;
+    };
+
+    /* Read a reference. Returns kNull, the id of a known node, or mNodes.size() for
+    a new node (throws std::runtime_error for other values).
+    */
+    std::uint32_t read_reference();
+
+    // Skip the padding written by graph_writer::align and return the current position
+    const char* align(std::size_t alignment, std::size_t size);
+
+    /* Return a node that has been read. Throws std::runtime_error if the node is
+    still being read (the graph has a cycle).
+    */
+    const Node& node(std::uint32_t id) const;
+
+    // Remember the node for the id that was returned by read_reference
+    void add_node(std::size_t id, detail::ControlBlock* handle, const void* ptr) noexcept;
+
+    shared_ptr_nc<const graph_image>    mImage;
+    std::size_t                         mOffset{0};
+    std::vector<Node>                   mNodes;
+};
+
+// -----------------------------------------------------------------------------
+
+template <typename T>
+void graph_writer::write(const shared_ptr_nc<T>& ptr)
+{
+    if (write_reference(detail::SharedPtrAccess::handle(ptr), ptr.get()))
+        serialize(*this, *ptr);
+}
+
+template <typename T>
+void graph_writer::write_trivial(const shared_ptr_nc<T>& ptr)
+{
+    static_assert(std::is_trivially_copyable_v<T>, "write_trivial requires a trivially copyable type");
+    static_assert(alignof(T) <= alignof(std::max_align_t), "over-aligned types are not supported");
+
+    if (write_reference(detail::SharedPtrAccess::handle(ptr), ptr.get()))
+    {
+        align(alignof(T));
+        write_bytes(ptr.get(), sizeof(T));
+    }
+}
+
+template <typename T>
+inline void graph_writer::write_value(const T& value)
+{
+    static_assert(std::is_trivially_copyable_v<T>, "write_value requires a trivially copyable type");
+    write_bytes(&value, sizeof(T));
+}
+
+// -----------------------------------------------------------------------------
+
+template <typename T>
+shared_ptr_nc<T> graph_reader::read()
+{
+    const std::uint32_t id = read_reference();
+    if (id == kNull)
+        return shared_ptr_nc<T>();
+    if (id < mNodes.size())
+        return detail::SharedPtrAccess::make(node(id).mHandle, static_cast<T*>(node(id).mPtr), true);
+
+    // Reserve the id before the children of the instance are read
+    mNodes.push_back(Node{nullptr, nullptr});
+    shared_ptr_nc<T> result = deserialize(*this, graph_type<T>());
+    if (!result)
+        throw std::runtime_error("graph_reader: deserialize returned an empty pointer");
+
+    add_node(id, detail::SharedPtrAccess::handle(result), result.get());
+    return result;
+}
+
+template <typename T>
+shared_ptr_nc<const T> graph_reader::read_trivial()
+{
+    static_assert(std::is_trivially_copyable_v<T>, "read_trivial requires a trivially copyable type");
+
+    const std::uint32_t id = read_reference();
+    if (id == kNull)
+        return shared_ptr_nc<const T>();
+    if (id < mNodes.size())
+        return detail::SharedPtrAccess::make(node(id).mHandle, static_cast<const T*>(node(id).mPtr), true);
+
+    const T* const ptr = reinterpret_cast<const T*>(align(alignof(T), sizeof(T)));
+    mOffset += sizeof(T);
+
+    shared_ptr_nc<const T> result(mImage, ptr);
+    mNodes.push_back(Node{nullptr, nullptr});
+    add_node(id, detail::SharedPtrAccess::handle(result), ptr);
+    return result;
+}
+
+template <typename T>
+inline T graph_reader::read_value()
+{
+    static_assert(std::is_trivially_copyable_v<T>, "read_value requires a trivially copyable type");
+    T result;
+    read_bytes(&result, sizeof(T));
+    return result;
+}
+
+}   // namespace bch
+
+#include "bch/common/header_suffix.hpp"
+
+#endif  // BCH_GRAPH_SERIALIZER
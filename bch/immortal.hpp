@@ -0,0 +1,102 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#ifndef BCH_IMMORTAL
+#define BCH_IMMORTAL
+
+#pragma once
+
+#include <utility>
+
+#include "bch/shared_ptr_nc.hpp"
+
+#include "bch/common/header_prefix.hpp"
+
+namespace bch {
+
+/* Storage for an instance that is shared by everyone and never dies (interned
+constants, global singletons, empty sentinel instances).
+The instance and an immortal control block are stored inline, so no heap memory is
+used. Copying and destroying shared pointers to the instance does not write to the
+control block: the memory stays clean (no cache line invalidation, and pages are
+kept shared after fork).
+Since the reference counts never change, shared pointers to an immortal instance
+may be copied concurrently from multiple threads.
+
+The constructor can be evaluated at compile time (if T's constructor can), so the
+storage and pointers to it can be constant initialized:
+/code
+    constinit bch::immortal<Foo> sFoo(1, 2);
+    constinit bch::shared_ptr_nc<Foo> sFooPtr = sFoo.share();
+/endcode
+
+The destructor of T is never invoked.
+T cannot derive from enable_shared_from_this_inline.
+*/
+template <typename T>
+class immortal
+{
+public:
+    template <typename ... Args>
+    constexpr explicit immortal(Args&& ... args);
+
+    // The instance is never destroyed
+    constexpr ~immortal() {}
+
+    constexpr shared_ptr_nc<T> share() noexcept;
+    constexpr shared_ptr_nc<const T> share() const noexcept;
+
+    constexpr T* get() noexcept {
+        return &mValue;
+    }
+
+    constexpr const T* get() const noexcept {
+        return &mValue;
+    }
+
+private:
+    immortal(const immortal&) = delete;
+    immortal(immortal&&) = delete;
+    immortal& operator=(const immortal&) = delete;
+    immortal& operator=(immortal&&) = delete;
+
+    detail::ControlBlockImmortal    mControlBlock;
+    union {
+        T                           mValue;
+    };
+};
+
+template <typename T>
+template <typename ... Args>
+inline constexpr
+immortal<T>::immortal(Args&& ... args) :
+    mValue(std::forward<Args>(args)...)
+{
+    static_assert(!std::is_base_of_v<detail::SharedFromThisInlineBase, T>,
+        "enable_shared_from_this_inline requires instances created by make_shared");
+
+    detail::set_shared_from_this(&mValue, &mControlBlock);
+}
+
+template <typename T>
+inline constexpr
+shared_ptr_nc<T> immortal<T>::share() noexcept
+{
+    return detail::SharedPtrAccess::make<T>(&mControlBlock, &mValue, false);
+}
+
+template <typename T>
+inline constexpr
+shared_ptr_nc<const T> immortal<T>::share() const noexcept
+{
+    // The immortal control block is never written, so it can be shared from const storage
+    detail::ControlBlock* const handle = const_cast<detail::ControlBlockImmortal*>(&mControlBlock);
+    return detail::SharedPtrAccess::make<const T>(handle, &mValue, false);
+}
+
+}   // namespace bch
+
+#include "bch/common/header_suffix.hpp"
+
+#endif  // BCH_IMMORTAL
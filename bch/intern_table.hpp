@@ -0,0 +1,266 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#ifndef BCH_INTERN_TABLE
+#define BCH_INTERN_TABLE
+
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "bch/shared_ptr_nc.hpp"
+#include "bch/common/memory.hpp"
+
+#include "bch/common/header_prefix.hpp"
+
+namespace bch {
+
+namespace detail {
+
+class InternTableBase;
+
+/* Type independent part of the control block of an interned instance.
+The control block knows its table and the hash of its instance, so it can remove its
+entry from the table when the last strong reference is released.
+*/
+class ControlBlockInternedBase: public ControlBlock
+{
+public:
+    std::size_t hash() const noexcept {
+        return mHash;
+    }
+
+protected:
+    ControlBlockInternedBase(InternTableBase* table, std::size_t hash) noexcept :
+        mTable(table),
+        mHash(hash)
+    { }
+
+    // Remove the entry from the table (if the table still exists)
+    void remove_from_table() noexcept;
+
+private:
+    friend class InternTableBase;
+
+    InternTableBase*    mTable;
+    std::size_t         mHash;
+};
+
+/* Type independent part of intern_table: an open addressing (linear probing) hash
+table of control blocks. Each slot stores the hash of its instance, so probing and
+growing the table only read the instance for slots with an equal hash.
+*/
+class InternTableBase
+{
+public:
+    std::size_t size() const noexcept {
+        return mSize;
+    }
+
+    // Remove the slot of handle. Invoked by the control block when its strong count reaches 0.
+    void remove(const ControlBlockInternedBase* handle) noexcept;
+
+protected:
+    struct Slot
+    {
+        std::size_t                 mHash;
+        // nullptr for an empty slot
+        ControlBlockInternedBase*   mHandle;
+    };
+
+    InternTableBase() noexcept = default;
+
+    // Detaches the live entries (they no longer remove themselves from the table)
+    ~InternTableBase();
+
+    // Ensure that count entries fit in the table. Throws std::bad_alloc.
+    void reserve(std::size_t count);
+
+    // Add a slot for handle. The table must have room for the entry (see reserve).
+    void insert(ControlBlockInternedBase* handle) noexcept;
+
+    // Index of the first slot to probe for hash (the table must not be empty)
+    std::size_t home(std::size_t hash) const noexcept {
+        return hash & mMask;
+    }
+
+    std::size_t next(std::size_t index) const noexcept {
+        return (index + 1) & mMask;
+    }
+
+    Slot*           mSlots{nullptr};
+    std::size_t     mMask{0};
+    std::size_t     mSize{0};
+
+private:
+    InternTableBase(const InternTableBase&) = delete;
+    InternTableBase(InternTableBase&&) = delete;
+    InternTableBase& operator=(const InternTableBase&) = delete;
+    InternTableBase& operator=(InternTableBase&&) = delete;
+};
+
+/* Control block of an interned instance. The instance is stored after the control
+block (at instance_offset) in a single malloc allocation.
+*/
+template <typename T>
+class ControlBlockInterned: public ControlBlockInternedBase
+{
+public:
+    ControlBlockInterned(InternTableBase* table, std::size_t hash) noexcept :
+        ControlBlockInternedBase(table, hash)
+    { }
+
+    static constexpr std::size_t instance_offset() noexcept {
+        return InstancePairOffset(sizeof(ControlBlockInterned), alignof(T));
+    }
+
+    static T* instance(void* address) noexcept {
+        return reinterpret_cast<T*>(static_cast<char*>(address) + instance_offset());
+    }
+
+    T* get() noexcept {
+        return instance(this);
+    }
+
+protected:
+    virtual void on_zero_shared()
+    {
+        // The entry is removed first, so the table never refers to a destroyed instance
+        remove_from_table();
+        get()->~T();
+    }
+};
+
+}   // namespace detail
+
+/* Table that returns a single shared instance for values that compare equal
+(hash consing). Interned values can be compared by comparing pointers.
+The table does not own the instances: an entry is removed from the table when the
+strong reference count of its instance reaches 0, so the table never needs to be
+swept.
+The table may be destroyed before the instances it returned; the instances are then
+no longer interned.
+
+Values are looked up with Hash and KeyEqual, and may be given as any type that they
+support (for example a std::string_view for a table of std::string, with a
+transparent hash and equality). A new instance is constructed from the value.
+
+Not thread safe: the table and the pointers it returns must be used by one thread at
+a time.
+*/
+template <typename T, typename Hash = std::hash<T>, typename KeyEqual = std::equal_to<T>>
+class intern_table: private detail::InternTableBase
+{
+public:
+    intern_table() = default;
+
+    // Return the instance that is equal to value (creating it if it does not exist)
+    template <typename K>
+    shared_ptr_nc<const T> intern(K&& value);
+
+    // Return the instance that is equal to value (nullptr if it does not exist)
+    template <typename K>
+    shared_ptr_nc<const T> find(const K& value) const;
+
+    using detail::InternTableBase::size;
+
+private:
+    static_assert(alignof(T) <= alignof(std::max_align_t), "over-aligned types are not supported");
+    static_assert(!std::is_base_of_v<detail::SharedFromThisInlineBase, T>,
+        "enable_shared_from_this_inline requires instances created by make_shared");
+
+    typedef detail::ControlBlockInterned<T> ControlBlockType;
+
+    template <typename K>
+    static std::size_t hash(const K& value) {
+        return Hash()(value);
+    }
+
+    // Return the slot of the instance that is equal to value (nullptr if none)
+    template <typename K>
+    const Slot* lookup(const K& value, std::size_t valueHash) const;
+
+    static shared_ptr_nc<const T> share(const Slot& slot) noexcept {
+        ControlBlockType* const handle = static_cast<ControlBlockType*>(slot.mHandle);
+        return detail::SharedPtrAccess::make<const T>(handle, handle->get(), true);
+    }
+};
+
+// -----------------------------------------------------------------------------
+
+inline void detail::ControlBlockInternedBase::remove_from_table() noexcept
+{
+    if (mTable != nullptr)
+        mTable->remove(this);
+}
+
+template <typename T, typename Hash, typename KeyEqual>
+template <typename K>
+const typename intern_table<T, Hash, KeyEqual>::Slot*
+intern_table<T, Hash, KeyEqual>::lookup(const K& value, std::size_t valueHash) const
+{
+    if (mSize == 0)
+        return nullptr;
+
+    for (std::size_t index = home(valueHash); mSlots[index].mHandle != nullptr; index = next(index))
+    {
+        const Slot& slot = mSlots[index];
+        if ((slot.mHash == valueHash) && KeyEqual()(*static_cast<ControlBlockType*>(slot.mHandle)->get(), value))
+            return &slot;
+    }
+    return nullptr;
+}
+
+template <typename T, typename Hash, typename KeyEqual>
+template <typename K>
+shared_ptr_nc<const T> intern_table<T, Hash, KeyEqual>::find(const K& value) const
+{
+    const Slot* const slot = lookup(value, hash(value));
+    return (slot != nullptr) ? share(*slot) : shared_ptr_nc<const T>();
+}
+
+template <typename T, typename Hash, typename KeyEqual>
+template <typename K>
+shared_ptr_nc<const T> intern_table<T, Hash, KeyEqual>::intern(K&& value)
+{
+    const std::size_t valueHash = hash(value);
+    if (const Slot* const slot = lookup(value, valueHash))
+        return share(*slot);
+
+    reserve(mSize + 1);
+
+    void* const address = malloc(ControlBlockType::instance_offset() + sizeof(T));
+    if (address == nullptr)
+        throw std::bad_alloc();
+
+    /* The constructor of ControlBlockInterned is noexcept, so it is invoked after T
+    (only the memory is released if the constructor of T throws).
+    */
+    T* ptr = nullptr;
+    try
+    {
+        ptr = new (ControlBlockType::instance(address)) T(std::forward<K>(value));
+    }
+    catch (...)
+    {
+        free(address);
+        throw;
+    }
+
+    ControlBlockType* const handle = new (address) ControlBlockType(this, valueHash);
+    detail::set_shared_from_this<T>(ptr, handle);
+    insert(handle);
+    return detail::SharedPtrAccess::make<const T>(handle, ptr, false);
+}
+
+}   // namespace bch
+
+#include "bch/common/header_suffix.hpp"
+
+#endif  // BCH_INTERN_TABLE
@@ -0,0 +1,279 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#ifndef BCH_LRU_CACHE
+#define BCH_LRU_CACHE
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <functional>
+#include <unordered_map>
+#include <utility>
+
+#include "bch/shared_ptr_nc.hpp"
+#include "bch/common/memory.hpp"
+
+#include "bch/common/header_prefix.hpp"
+
+namespace bch {
+
+/* Least recently used cache of shared instances with a byte budget.
+Each value is created by make_shared together with its recency list links, so the
+list needs no separate allocation, and the cache knows the size of each entry from
+the allocation (entry_size). Values are handed out as shared_ptr_nc<T> that share the
+ownership of the entry.
+
+An entry whose value is still referenced outside the cache (use_count() > 1) is
+pinned: evicting it would not release memory, and the value would have to be loaded
+again later. Eviction therefore skips pinned entries and moves them to the most
+recently used end of the list. The cache can exceed its budget while pinned entries
+use more than the budget.
+
+Not thread safe: the cache must be used by one thread at a time.
+*/
+template <typename K, typename T, typename Hash = std::hash<K>, typename KeyEqual = std::equal_to<K>>
+class lru_cache
+{
+public:
+    explicit lru_cache(std::size_t byteBudget) noexcept :
+        mBudget(byteBudget)
+    { }
+
+    ~lru_cache();
+
+    // Return the value of key and mark it as most recently used (empty if none)
+    shared_ptr_nc<T> find(const K& key);
+
+    /* Create the value of key from args (replacing an existing value), and evict
+    entries that exceed the budget.
+    */
+    template <typename ... Args>
+    shared_ptr_nc<T> emplace(const K& key, Args&& ... args);
+
+    // Returns true if key was removed (the value is released if it is not pinned)
+    bool erase(const K& key);
+
+    void clear() noexcept;
+
+    // Evict unpinned entries until the cache is within its budget
+    void trim();
+
+    void set_budget(std::size_t byteBudget);
+
+    std::size_t budget() const noexcept {
+        return mBudget;
+    }
+
+    // Number of bytes used by the entries
+    std::size_t byte_size() const noexcept {
+        return mByteSize;
+    }
+
+    std::size_t size() const noexcept {
+        return mEntries.size();
+    }
+
+    // Number of bytes charged for an entry (the make_shared allocation of the entry)
+    static constexpr std::size_t entry_size() noexcept;
+
+private:
+    lru_cache(const lru_cache&) = delete;
+    lru_cache(lru_cache&&) = delete;
+    lru_cache& operator=(const lru_cache&) = delete;
+    lru_cache& operator=(lru_cache&&) = delete;
+
+    struct Entry
+    {
+        template <typename ... Args>
+        explicit Entry(Args&& ... args) :
+            mValue(std::forward<Args>(args)...)
+        { }
+
+        // Recency list (mPrevious is more recently used)
+        Entry*      mPrevious{nullptr};
+        Entry*      mNext{nullptr};
+        // The key is stored in the map node (which does not move)
+        const K*    mKey{nullptr};
+        T           mValue;
+    };
+
+    typedef std::unordered_map<K, shared_ptr_nc<Entry>, Hash, KeyEqual> EntryMap;
+
+    static shared_ptr_nc<T> share(const shared_ptr_nc<Entry>& entry) noexcept {
+        return shared_ptr_nc<T>(entry, &entry->mValue);
+    }
+
+    // The cache holds one reference; other references pin the entry
+    static bool pinned(const shared_ptr_nc<Entry>& entry) noexcept {
+        return (entry.use_count() > 1);
+    }
+
+    void link_front(Entry* entry) noexcept;
+    void unlink(Entry* entry) noexcept;
+
+    void remove(typename EntryMap::iterator it) noexcept;
+
+    EntryMap        mEntries;
+    // Most and least recently used entries
+    Entry*          mHead{nullptr};
+    Entry*          mTail{nullptr};
+    std::size_t     mBudget;
+    std::size_t     mByteSize{0};
+};
+
+// -----------------------------------------------------------------------------
+
+template <typename K, typename T, typename Hash, typename KeyEqual>
+constexpr std::size_t lru_cache<K, T, Hash, KeyEqual>::entry_size() noexcept
+{
+    return InstancePairOffset(sizeof(detail::ControlBlockDeleterInlineData<Entry>), alignof(Entry)) + sizeof(Entry);
+}
+
+template <typename K, typename T, typename Hash, typename KeyEqual>
+lru_cache<K, T, Hash, KeyEqual>::~lru_cache()
+{
+    clear();
+}
+
+template <typename K, typename T, typename Hash, typename KeyEqual>
+void lru_cache<K, T, Hash, KeyEqual>::link_front(Entry* entry) noexcept
+{
+    entry->mPrevious = nullptr;
+    entry->mNext = mHead;
+    if (mHead != nullptr)
+        mHead->mPrevious = entry;
+    else
+        mTail = entry;
+    mHead = entry;
+}
+
+template <typename K, typename T, typename Hash, typename KeyEqual>
+void lru_cache<K, T, Hash, KeyEqual>::unlink(Entry* entry) noexcept
+{
+    if (entry->mPrevious != nullptr)
+        entry->mPrevious->mNext = entry->mNext;
+    else
+        mHead = entry->mNext;
+
+    if (entry->mNext != nullptr)
+        entry->mNext->mPrevious = entry->mPrevious;
+    else
+        mTail = entry->mPrevious;
+
+    entry->mPrevious = nullptr;
+    entry->mNext = nullptr;
+}
+
+template <typename K, typename T, typename Hash, typename KeyEqual>
+void lru_cache<K, T, Hash, KeyEqual>::remove(typename EntryMap::iterator it) noexcept
+{
+    unlink(it->second.get());
+    mByteSize -= entry_size();
+    mEntries.erase(it);
+}
+
+template <typename K, typename T, typename Hash, typename KeyEqual>
+shared_ptr_nc<T> lru_cache<K, T, Hash, KeyEqual>::find(const K& key)
+{
+    const auto it = mEntries.find(key);
+    if (it == mEntries.end())
+        return shared_ptr_nc<T>();
+
+    Entry* const entry = it->second.get();
+    if (entry != mHead)
+    {
+        unlink(entry);
+        link_front(entry);
+    }
+    return share(it->second);
+}
+
+template <typename K, typename T, typename Hash, typename KeyEqual>
+template <typename ... Args>
+shared_ptr_nc<T> lru_cache<K, T, Hash, KeyEqual>::emplace(const K& key, Args&& ... args)
+{
+    shared_ptr_nc<Entry> entry = bch::make_shared<Entry>(std::forward<Args>(args)...);
+
+    const auto result = mEntries.try_emplace(key, entry);
+    if (!result.second)
+    {
+        unlink(result.first->second.get());
+        result.first->second = entry;
+    }
+    else
+    {
+        mByteSize += entry_size();
+    }
+
+    entry->mKey = &result.first->first;
+    link_front(entry.get());
+
+    // The new entry is pinned by the returned pointer, so it is not evicted
+    shared_ptr_nc<T> value = share(entry);
+    entry.reset();
+    trim();
+    return value;
+}
+
+template <typename K, typename T, typename Hash, typename KeyEqual>
+bool lru_cache<K, T, Hash, KeyEqual>::erase(const K& key)
+{
+    const auto it = mEntries.find(key);
+    if (it == mEntries.end())
+        return false;
+
+    remove(it);
+    return true;
+}
+
+template <typename K, typename T, typename Hash, typename KeyEqual>
+void lru_cache<K, T, Hash, KeyEqual>::clear() noexcept
+{
+    mHead = nullptr;
+    mTail = nullptr;
+    mByteSize = 0;
+    mEntries.clear();
+}
+
+template <typename K, typename T, typename Hash, typename KeyEqual>
+void lru_cache<K, T, Hash, KeyEqual>::trim()
+{
+    // Visit each entry at most once; pinned entries are moved to the front
+    std::size_t remaining = mEntries.size();
+    while ((mByteSize > mBudget) && (remaining != 0))
+    {
+        --remaining;
+        Entry* const entry = mTail;
+        const auto it = mEntries.find(*entry->mKey);
+
+#if BCH_SMART_PTR_DEBUG
+        assert(it->second.get() == entry);
+#endif
+
+        if (pinned(it->second))
+        {
+            unlink(entry);
+            link_front(entry);
+        }
+        else
+        {
+            remove(it);
+        }
+    }
+}
+
+template <typename K, typename T, typename Hash, typename KeyEqual>
+void lru_cache<K, T, Hash, KeyEqual>::set_budget(std::size_t byteBudget)
+{
+    mBudget = byteBudget;
+    trim();
+}
+
+}   // namespace bch
+
+#include "bch/common/header_suffix.hpp"
+
+#endif  // BCH_LRU_CACHE
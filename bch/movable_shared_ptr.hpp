@@ -0,0 +1,376 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#ifndef BCH_MOVABLE_SHARED_PTR
+#define BCH_MOVABLE_SHARED_PTR
+
+#pragma once
+
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "bch/shared_ptr_nc.hpp"
+
+#include "bch/common/header_prefix.hpp"
+
+namespace bch {
+
+template <typename T>
+class movable_heap;
+
+template <typename T>
+class movable_shared_ptr;
+
+namespace detail {
+
+class MovableHeapBase;
+
+/* Control block of an instance in a movable_heap.
+The control block is allocated separately from the instance and holds the only
+pointer to it. The pointer is updated when the heap moves the instance.
+*/
+class ControlBlockMovableBase: public ControlBlock
+{
+public:
+    void* object() const noexcept {
+        return mObject;
+    }
+
+protected:
+    ControlBlockMovableBase(MovableHeapBase* heap, void* object) noexcept :
+        mHeap(heap),
+        mObject(object)
+    { }
+
+    MovableHeapBase*    mHeap;
+    void*               mObject;
+
+private:
+    friend class MovableHeapBase;
+};
+
+template <typename T>
+class ControlBlockMovable: public ControlBlockMovableBase
+{
+public:
+    // Throws std::bad_alloc if the control block cannot be allocated
+    static ControlBlockMovable* Create(MovableHeapBase* heap, T* object);
+
+    T* get() const noexcept {
+        return static_cast<T*>(mObject);
+    }
+
+protected:
+    virtual void on_zero_shared();
+
+private:
+    ControlBlockMovable(MovableHeapBase* heap, T* object) noexcept :
+        ControlBlockMovableBase(heap, object)
+    { }
+};
+
+/* Type independent part of movable_heap.
+Instances are stored in slots in kPageSize pages (that are aligned to kPageSize). A
+slot holds a pointer to the control block of the instance followed by the instance.
+Pages are mapped and unmapped directly (not with malloc), so memory of empty pages is
+returned to the operating system.
+*/
+class MovableHeapBase
+{
+public:
+    static constexpr std::size_t kPageSize = 64 * 1024;
+
+    // Number of live instances
+    std::size_t size() const noexcept {
+        return mLiveCount;
+    }
+
+    // Number of mapped pages
+    std::size_t page_count() const noexcept {
+        return mPages.size();
+    }
+
+    /* Move the live instances into as few pages as possible, and unmap the pages
+    that become empty. Returns the number of unmapped pages.
+    Instances are moved from the least used pages into the free slots of the most
+    used pages.
+    */
+    std::size_t compact();
+
+    // Release the slot of an instance that has been destroyed
+    void release_slot(void* object) noexcept;
+
+protected:
+    // Move construct the instance at destination from source, and destroy source
+    typedef void (*MoveFunction)(void* destination, void* source);
+
+    /* Throws std::bad_alloc if a slot for an instance of objectSize does not fit
+    in a page.
+    */
+    MovableHeapBase(std::size_t objectSize, std::size_t objectAlignment, MoveFunction move);
+    ~MovableHeapBase();
+
+    /* Return the address of the instance in an unused slot.
+    Throws std::bad_alloc if a page cannot be mapped.
+    */
+    void* allocate_slot();
+
+    // Associate the slot of object with its control block
+    void set_owner(void* object, ControlBlockMovableBase* owner) noexcept;
+
+private:
+    MovableHeapBase(const MovableHeapBase&) = delete;
+    MovableHeapBase(MovableHeapBase&&) = delete;
+    MovableHeapBase& operator=(const MovableHeapBase&) = delete;
+    MovableHeapBase& operator=(MovableHeapBase&&) = delete;
+
+    struct Page;
+
+    Page* page(void* object) const noexcept;
+    char* slot(Page* page, std::uint32_t index) const noexcept;
+    std::uint32_t slot_index(Page* page, void* object) const noexcept;
+    void* page_allocate(Page* page) noexcept;
+    void page_release(Page* page, void* object) noexcept;
+
+    std::size_t             mSlotSize;
+    std::size_t             mObjectOffset;
+    std::uint32_t           mSlotsPerPage;
+    MoveFunction            mMove;
+    std::vector<Page*>      mPages;
+    // Page that is used for the next allocation (if it has a free slot)
+    Page*                   mAllocationPage{nullptr};
+    std::size_t             mLiveCount{0};
+};
+
+}   // namespace detail
+
+/* Storage for instances of T that can be moved to reduce fragmentation.
+A shared_ptr_nc stores the address of its instance, so the instance can never move.
+A movable_shared_ptr only stores its control block, and the control block holds the
+address of the instance. This makes dereferencing slower (an extra load), but
+allows compact to move the instances of a long lived heap into dense pages and
+return the empty pages to the operating system.
+
+T must be nothrow move constructible (or trivially relocatable).
+Pointers and references returned by movable_shared_ptr::get must not be used
+across a call to compact. The heap must outlive all pointers to its instances.
+*/
+template <typename T>
+class movable_heap: public detail::MovableHeapBase
+{
+public:
+    movable_heap();
+
+    // Throws std::bad_alloc if memory cannot be allocated
+    template <typename ... Args>
+    movable_shared_ptr<T> make_shared(Args&& ... args);
+
+private:
+    static_assert(is_trivially_relocatable_v<T> || std::is_nothrow_move_constructible_v<T>,
+        "movable_heap requires a trivially relocatable or a nothrow move constructible type");
+    static_assert(!std::is_base_of_v<detail::SharedFromThisInlineBase, T>,
+        "enable_shared_from_this_inline requires instances created by make_shared");
+    // compact moves the instance, which would leave a stale pointer in the base class
+    static_assert(std::is_null_pointer_v<decltype(detail::shared_from_this_base(std::declval<T*>()))>,
+        "movable_heap does not support enable_shared_from_this");
+
+    static void move(void* destination, void* source) {
+        relocate(static_cast<T*>(source), 1, static_cast<T*>(destination));
+    }
+};
+
+/* Shared pointer to an instance in a movable_heap.
+The pointer is the size of a single pointer (the control block).
+*/
+template <typename T>
+class movable_shared_ptr
+{
+public:
+    using element_type = T;
+
+    constexpr movable_shared_ptr() noexcept = default;
+    constexpr movable_shared_ptr(std::nullptr_t) noexcept {}
+
+    movable_shared_ptr(const movable_shared_ptr& ptr) noexcept;
+    movable_shared_ptr(movable_shared_ptr&& ptr) noexcept;
+    ~movable_shared_ptr();
+
+    movable_shared_ptr& operator=(const movable_shared_ptr& ptr);
+    movable_shared_ptr& operator=(movable_shared_ptr&& ptr) noexcept;
+
+    void swap(movable_shared_ptr& ptr) noexcept;
+    void reset();
+
+    // The address is only valid until the heap is compacted
+    T* get() const noexcept {
+        return (mHandle != nullptr) ? mHandle->get() : nullptr;
+    }
+
+    T& operator*() const noexcept {
+        return *mHandle->get();
+    }
+
+    T* operator->() const noexcept {
+        return mHandle->get();
+    }
+
+    explicit operator bool() const noexcept {
+        return (mHandle != nullptr);
+    }
+
+    long use_count() const noexcept {
+        return (mHandle != nullptr) ? static_cast<long>(mHandle->use_count()) : 0;
+    }
+
+    bool operator==(const movable_shared_ptr& ptr) const noexcept {
+        return (mHandle == ptr.mHandle);
+    }
+
+    bool operator!=(const movable_shared_ptr& ptr) const noexcept {
+        return (mHandle != ptr.mHandle);
+    }
+
+private:
+    friend class movable_heap<T>;
+
+    // Take over the strong reference of handle
+    explicit movable_shared_ptr(detail::ControlBlockMovable<T>* handle) noexcept :
+        mHandle(handle)
+    { }
+
+    detail::ControlBlockMovable<T>*     mHandle{nullptr};
+};
+
+template <typename T>
+struct is_trivially_relocatable<movable_shared_ptr<T>>: std::true_type {};
+
+// -----------------------------------------------------------------------------
+
+template <typename T>
+detail::ControlBlockMovable<T>* detail::ControlBlockMovable<T>::Create(MovableHeapBase* heap, T* object)
+{
+    void* memory = malloc(sizeof(ControlBlockMovable));
+    if (memory == nullptr)
+        throw std::bad_alloc();
+    return new (memory) ControlBlockMovable(heap, object);
+}
+
+template <typename T>
+void detail::ControlBlockMovable<T>::on_zero_shared()
+{
+    T* const object = get();
+    mObject = nullptr;
+    object->~T();
+    mHeap->release_slot(object);
+}
+
+// -----------------------------------------------------------------------------
+
+template <typename T>
+inline
+movable_heap<T>::movable_heap() :
+    MovableHeapBase(sizeof(T), alignof(T), &movable_heap::move)
+{
+}
+
+template <typename T>
+template <typename ... Args>
+movable_shared_ptr<T> movable_heap<T>::make_shared(Args&& ... args)
+{
+    typedef detail::ControlBlockMovable<T> ControlBlockType;
+
+    void* const address = allocate_slot();
+
+    /* Only the constructor for T and the allocation of the control block can throw
+    an exception. The slot is returned to the heap if either fails.
+    */
+    T* ptr = nullptr;
+    ControlBlockType* cbPtr = nullptr;
+    try
+    {
+        ptr = new (address) T(std::forward<Args>(args)...);
+    }
+    catch (...)
+    {
+        release_slot(address);
+        throw;
+    }
+
+    try
+    {
+        cbPtr = ControlBlockType::Create(this, ptr);
+    }
+    catch (...)
+    {
+        ptr->~T();
+        release_slot(address);
+        throw;
+    }
+
+    set_owner(address, cbPtr);
+    return movable_shared_ptr<T>(cbPtr);
+}
+
+// -----------------------------------------------------------------------------
+
+template <typename T>
+inline
+movable_shared_ptr<T>::movable_shared_ptr(const movable_shared_ptr& ptr) noexcept :
+    mHandle(ptr.mHandle)
+{
+    if (mHandle != nullptr)
+        mHandle->add_shared();
+}
+
+template <typename T>
+inline
+movable_shared_ptr<T>::movable_shared_ptr(movable_shared_ptr&& ptr) noexcept :
+    mHandle(ptr.mHandle)
+{
+    ptr.mHandle = nullptr;
+}
+
+template <typename T>
+inline
+movable_shared_ptr<T>::~movable_shared_ptr()
+{
+    if (mHandle != nullptr)
+        mHandle->release_shared();
+}
+
+template <typename T>
+inline movable_shared_ptr<T>&
+movable_shared_ptr<T>::operator=(const movable_shared_ptr& ptr)
+{
+    movable_shared_ptr(ptr).swap(*this);
+    return *this;
+}
+
+template <typename T>
+inline movable_shared_ptr<T>&
+movable_shared_ptr<T>::operator=(movable_shared_ptr&& ptr) noexcept
+{
+    movable_shared_ptr(std::move(ptr)).swap(*this);
+    return *this;
+}
+
+template <typename T>
+inline void movable_shared_ptr<T>::swap(movable_shared_ptr& ptr) noexcept
+{
+    std::swap(mHandle, ptr.mHandle);
+}
+
+template <typename T>
+inline void movable_shared_ptr<T>::reset()
+{
+    movable_shared_ptr().swap(*this);
+}
+
+}   // namespace bch
+
+#include "bch/common/header_suffix.hpp"
+
+#endif  // BCH_MOVABLE_SHARED_PTR
@@ -0,0 +1,419 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#ifndef BCH_OFFSET_SHARED_PTR
+#define BCH_OFFSET_SHARED_PTR
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "bch/common/memory.hpp"
+
+#include "bch/common/header_prefix.hpp"
+
+namespace bch {
+
+class shared_segment;
+
+template <typename T>
+class offset_shared_ptr;
+
+namespace detail {
+
+/* Control block of an instance in a shared_segment. The instance follows the control
+block.
+The control block follows the ControlBlock reference count rules, but has no vtable
+(the address of a vtable differs between processes): the type of the instance is
+known by the offset_shared_ptr that releases the last strong reference.
+All addresses are stored as offsets, so the control block is valid at any address.
+*/
+struct OffsetControlBlock
+{
+    static constexpr std::size_t kInstanceAlignment = 16;
+
+    std::uint32_t   mStrong{1};
+    std::uint32_t   mWeak{0};
+    // Size of the allocation (control block and instance)
+    std::uint64_t   mSize{0};
+    // Offset from the control block to the segment
+    std::int64_t    mSegment{0};
+
+    static constexpr std::size_t instance_offset() noexcept {
+        return InstancePairOffset(sizeof(OffsetControlBlock), kInstanceAlignment);
+    }
+
+    void* instance() noexcept {
+        return reinterpret_cast<char*>(this) + instance_offset();
+    }
+
+    shared_segment* segment() noexcept {
+        return reinterpret_cast<shared_segment*>(reinterpret_cast<char*>(this) + mSegment);
+    }
+
+    void add_shared() noexcept;
+
+    // Decrease the strong reference count and destroy the T instance when it reaches 0
+    template <typename T>
+    void release_shared();
+
+    // Return the memory to the segment if both reference counts are 0
+    void adjust() noexcept;
+};
+
+}   // namespace detail
+
+/* Allocator for memory that is shared between processes (a shm_open or memfd mapping).
+The segment header is stored at the start of the memory, and all addresses in the
+segment are stored as offsets. Each process can therefore map the memory at a
+different address.
+
+Allocations are 16 byte aligned and use size classes (16 byte steps up to 4 KiB, and
+powers of two above that). Released allocations are kept in a free list per size
+class.
+
+The allocator and the reference counts are not synchronized: one process (the
+producer) creates, copies and releases pointers, while other processes only read
+the instances (through offset_shared_ptr::get). The producer must not release
+instances while they are read.
+
+Usage:
+/code
+    // producer
+    bch::shared_segment* segment = bch::shared_segment::create(memory, size);
+    segment->set_root(segment->make_shared<Graph>(...));
+    // reader
+    bch::shared_segment* segment = bch::shared_segment::attach(memory, size);
+    const Graph* graph = segment->root<Graph>();
+/endcode
+*/
+class shared_segment
+{
+public:
+    static constexpr std::size_t kAlignment = 16;
+
+    /* Initialize a segment in memory. memory must be kAlignment aligned.
+    Throws std::bad_alloc if the memory is too small for the segment header.
+    */
+    static shared_segment* create(void* memory, std::size_t size);
+
+    /* Return the segment that was created in memory (possibly by another process
+    that mapped the memory at a different address). Returns nullptr if memory does
+    not hold a segment of the given size.
+    */
+    static shared_segment* attach(void* memory, std::size_t size) noexcept;
+
+    // Throws std::bad_alloc if the segment is full
+    void* allocate(std::size_t size);
+    void deallocate(void* ptr, std::size_t size) noexcept;
+
+    // Create an instance of T in the segment. Throws std::bad_alloc if the segment is full.
+    template <typename T, typename ... Args>
+    offset_shared_ptr<T> make_shared(Args&& ... args);
+
+    // Number of bytes that have not been allocated (excluding free lists)
+    std::size_t unused_size() const noexcept {
+        return static_cast<std::size_t>(mSize - mUsed);
+    }
+
+    /* The root is an instance that readers can find without knowing any offset.
+    The segment holds a strong reference to the root.
+    */
+    template <typename T>
+    void set_root(const offset_shared_ptr<T>& root);
+
+    template <typename T>
+    T* root() noexcept;
+
+    // Release the root. T must be the type that was passed to set_root.
+    template <typename T>
+    void reset_root();
+
+private:
+    static constexpr std::uint64_t kMagic = 0x6263685F7365676DULL;     // "bch_segm"
+    static constexpr std::size_t kSmallClassCount = 256;               // 16 byte steps up to 4 KiB
+    static constexpr std::size_t kClassCount = kSmallClassCount + 64;
+
+    shared_segment(std::size_t size) noexcept;
+
+    shared_segment(const shared_segment&) = delete;
+    shared_segment(shared_segment&&) = delete;
+    shared_segment& operator=(const shared_segment&) = delete;
+    shared_segment& operator=(shared_segment&&) = delete;
+
+    // Size class of an allocation of size bytes and the rounded size of the class
+    static std::size_t size_class(std::size_t size, std::size_t& classSize) noexcept;
+
+    char* base() noexcept {
+        return reinterpret_cast<char*>(this);
+    }
+
+    std::uint64_t   mMagic{kMagic};
+    std::uint64_t   mSize{0};
+    // Offset of the first unused byte
+    std::uint64_t   mUsed{0};
+    // Offset of the root control block (0 if there is no root)
+    std::uint64_t   mRoot{0};
+    // Offsets of the first free allocation of each size class (0 if empty)
+    std::uint64_t   mFreeLists[kClassCount];
+};
+
+/* Shared pointer to an instance in a shared_segment.
+The pointer stores the offset from itself to the control block of the instance, so
+instances in the segment can hold pointers to each other, and the pointers are valid
+in every process that maps the segment.
+Copying or moving the pointer recalculates the offset (the pointer is not trivially
+relocatable).
+
+The pointer always refers to the instance that was created by make_shared (no
+aliasing and no conversion to base classes): releasing the last reference destroys
+the instance as a T.
+*/
+template <typename T>
+class offset_shared_ptr
+{
+public:
+    using element_type = T;
+
+    constexpr offset_shared_ptr() noexcept = default;
+    constexpr offset_shared_ptr(std::nullptr_t) noexcept {}
+
+    offset_shared_ptr(const offset_shared_ptr& ptr) noexcept;
+    offset_shared_ptr(offset_shared_ptr&& ptr) noexcept;
+    ~offset_shared_ptr();
+
+    offset_shared_ptr& operator=(const offset_shared_ptr& ptr);
+    offset_shared_ptr& operator=(offset_shared_ptr&& ptr);
+
+    void reset();
+
+    T* get() const noexcept {
+        detail::OffsetControlBlock* const handle = this->handle();
+        return (handle != nullptr) ? static_cast<T*>(handle->instance()) : nullptr;
+    }
+
+    T& operator*() const noexcept {
+        return *get();
+    }
+
+    T* operator->() const noexcept {
+        return get();
+    }
+
+    explicit operator bool() const noexcept {
+        return (mOffset != 0);
+    }
+
+    long use_count() const noexcept {
+        detail::OffsetControlBlock* const handle = this->handle();
+        return (handle != nullptr) ? static_cast<long>(handle->mStrong) : 0;
+    }
+
+    bool operator==(const offset_shared_ptr& ptr) const noexcept {
+        return (handle() == ptr.handle());
+    }
+
+    bool operator!=(const offset_shared_ptr& ptr) const noexcept {
+        return (handle() != ptr.handle());
+    }
+
+private:
+    friend class shared_segment;
+
+    detail::OffsetControlBlock* handle() const noexcept {
+        if (mOffset == 0)
+            return nullptr;
+        return reinterpret_cast<detail::OffsetControlBlock*>(
+            const_cast<char*>(reinterpret_cast<const char*>(this)) + mOffset);
+    }
+
+    // Point to handle without changing the reference count
+    void set_handle(detail::OffsetControlBlock* handle) noexcept {
+        mOffset = (handle != nullptr) ? (reinterpret_cast<char*>(handle) - reinterpret_cast<char*>(this)) : 0;
+    }
+
+    // Offset from this to the control block (0 for an empty pointer)
+    std::ptrdiff_t  mOffset{0};
+};
+
+// -----------------------------------------------------------------------------
+
+inline void detail::OffsetControlBlock::add_shared() noexcept
+{
+#if BCH_SMART_PTR_DEBUG
+    assert(mStrong > 0);
+#endif
+
+    ++mStrong;
+}
+
+template <typename T>
+void detail::OffsetControlBlock::release_shared()
+{
+    if (--mStrong == 0)
+    {
+        // Keep the control block alive while the instance is destroyed (see ControlBlock::release_shared)
+        ++mWeak;
+        static_cast<T*>(instance())->~T();
+        --mWeak;
+
+        adjust();
+    }
+}
+
+inline void detail::OffsetControlBlock::adjust() noexcept
+{
+    if ((mStrong == 0) && (mWeak == 0))
+    {
+        const std::size_t size = static_cast<std::size_t>(mSize);
+        segment()->deallocate(this, size);
+    }
+}
+
+// -----------------------------------------------------------------------------
+
+template <typename T, typename ... Args>
+offset_shared_ptr<T> shared_segment::make_shared(Args&& ... args)
+{
+    static_assert(alignof(T) <= detail::OffsetControlBlock::kInstanceAlignment, "over-aligned types are not supported");
+
+    const std::size_t size = detail::OffsetControlBlock::instance_offset() + sizeof(T);
+    void* const memory = allocate(size);
+
+    /* OffsetControlBlock has no vtable and is initialized with plain stores, so it is
+    set up after T is constructed (nothing but the memory is released if T throws).
+    */
+    char* const address = static_cast<char*>(memory);
+    try
+    {
+        new (address + detail::OffsetControlBlock::instance_offset()) T(std::forward<Args>(args)...);
+    }
+    catch (...)
+    {
+        deallocate(memory, size);
+        throw;
+    }
+
+    detail::OffsetControlBlock* const handle = new (memory) detail::OffsetControlBlock();
+    handle->mSize = size;
+    handle->mSegment = base() - address;
+
+    offset_shared_ptr<T> result;
+    result.set_handle(handle);
+    return result;
+}
+
+template <typename T>
+void shared_segment::set_root(const offset_shared_ptr<T>& root)
+{
+#if BCH_SMART_PTR_DEBUG
+    assert(mRoot == 0);
+#endif
+
+    detail::OffsetControlBlock* const handle = root.handle();
+    if (handle == nullptr)
+        return;
+
+    handle->add_shared();
+    mRoot = static_cast<std::uint64_t>(reinterpret_cast<char*>(handle) - base());
+}
+
+template <typename T>
+T* shared_segment::root() noexcept
+{
+    if (mRoot == 0)
+        return nullptr;
+    return static_cast<T*>(reinterpret_cast<detail::OffsetControlBlock*>(base() + mRoot)->instance());
+}
+
+template <typename T>
+void shared_segment::reset_root()
+{
+    if (mRoot == 0)
+        return;
+
+    detail::OffsetControlBlock* const handle = reinterpret_cast<detail::OffsetControlBlock*>(base() + mRoot);
+    mRoot = 0;
+    handle->release_shared<T>();
+}
+
+// -----------------------------------------------------------------------------
+
+template <typename T>
+inline
+offset_shared_ptr<T>::offset_shared_ptr(const offset_shared_ptr& ptr) noexcept
+{
+    detail::OffsetControlBlock* const handle = ptr.handle();
+    set_handle(handle);
+    if (handle != nullptr)
+        handle->add_shared();
+}
+
+template <typename T>
+inline
+offset_shared_ptr<T>::offset_shared_ptr(offset_shared_ptr&& ptr) noexcept
+{
+    set_handle(ptr.handle());
+    ptr.mOffset = 0;
+}
+
+template <typename T>
+inline
+offset_shared_ptr<T>::~offset_shared_ptr()
+{
+    detail::OffsetControlBlock* const handle = this->handle();
+    if (handle != nullptr)
+        handle->release_shared<T>();
+}
+
+template <typename T>
+inline offset_shared_ptr<T>&
+offset_shared_ptr<T>::operator=(const offset_shared_ptr& ptr)
+{
+    detail::OffsetControlBlock* const previous = handle();
+    detail::OffsetControlBlock* const handle = ptr.handle();
+    if (handle != nullptr)
+        handle->add_shared();
+    set_handle(handle);
+
+    if (previous != nullptr)
+        previous->release_shared<T>();
+    return *this;
+}
+
+template <typename T>
+inline offset_shared_ptr<T>&
+offset_shared_ptr<T>::operator=(offset_shared_ptr&& ptr)
+{
+    if (this != &ptr)
+    {
+        detail::OffsetControlBlock* const previous = handle();
+        set_handle(ptr.handle());
+        ptr.mOffset = 0;
+
+        if (previous != nullptr)
+            previous->release_shared<T>();
+    }
+    return *this;
+}
+
+template <typename T>
+inline void offset_shared_ptr<T>::reset()
+{
+    detail::OffsetControlBlock* const previous = handle();
+    mOffset = 0;
+    if (previous != nullptr)
+        previous->release_shared<T>();
+}
+
+}   // namespace bch
+
+#include "bch/common/header_suffix.hpp"
+
+#endif  // BCH_OFFSET_SHARED_PTR
@@ -0,0 +1,447 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#ifndef BCH_PERSISTENT_MAP
+#define BCH_PERSISTENT_MAP
+
+#pragma once
+
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <utility>
+
+#include "bch/shared_ptr_nc.hpp"
+
+#include "bch/common/header_prefix.hpp"
+
+namespace bch {
+
+/* Persistent hash map (a hash array mapped trie).
+Copying a map is O(1): the copy shares all nodes with the original. Changing a map
+copies the nodes on the path from the root to the changed entry (O(log n) nodes) and
+shares the rest, so old versions of the map stay valid and unchanged.
+A node that is only referenced by this map (unique()) is changed in place instead of
+copied, so a sequence of changes to a map that has not been copied allocates only
+for new entries.
+
+Each branch node holds up to 32 children, selected by 5 bits of the hash. The
+children are stored in the node (capacities 2 to 32, grown by powers of two), so a
+node is a single make_shared allocation. Entries are leaf nodes; entries with equal
+hashes are chained.
+
+Usage:
+/code
+    bch::persistent_map<int, std::string> v1;
+    v1.set(1, "one");
+    bch::persistent_map<int, std::string> v2 = v1;     // O(1) snapshot
+    v2.set(2, "two");                                   // v1 is unchanged
+/endcode
+*/
+template <typename Key, typename Value, typename Hash = std::hash<Key>, typename KeyEqual = std::equal_to<Key>>
+class persistent_map
+{
+public:
+    using key_type = Key;
+    using mapped_type = Value;
+    using value_type = std::pair<const Key, Value>;
+
+    persistent_map() = default;
+
+    std::size_t size() const noexcept {
+        return mSize;
+    }
+
+    bool empty() const noexcept {
+        return (mSize == 0);
+    }
+
+    // Return the value of key (nullptr if the map does not contain key)
+    const Value* find(const Key& key) const;
+
+    bool contains(const Key& key) const {
+        return (find(key) != nullptr);
+    }
+
+    // Insert or assign the value of key. Returns true if key was inserted.
+    bool set(Key key, Value value);
+
+    // Returns true if key was removed
+    bool erase(const Key& key);
+
+    void clear() noexcept;
+
+    // Invoke function(const value_type&) for each entry (in hash order)
+    template <typename Function>
+    void for_each(Function&& function) const;
+
+private:
+    static constexpr unsigned int kBits = 5;
+    static constexpr std::size_t kMask = (1 << kBits) - 1;
+
+    // Header of leaves and branches. mCapacity is 0 for a leaf.
+    struct Node
+    {
+        std::uint32_t   mBitmap{0};
+        std::uint8_t    mCount{0};
+        std::uint8_t    mCapacity{0};
+    };
+
+    typedef shared_ptr_nc<Node> NodePtr;
+
+    struct Leaf: Node
+    {
+        Leaf(std::size_t hash, Key&& key, Value&& value) :
+            mHash(hash),
+            mValue(std::move(key), std::move(value))
+        { }
+
+        std::size_t     mHash;
+        value_type      mValue;
+        // Next entry with the same hash
+        NodePtr         mNext;
+    };
+
+    // mChildren points to the children that are stored after the node (see BranchStorage)
+    struct Branch: Node
+    {
+        NodePtr*        mChildren{nullptr};
+    };
+
+    template <std::uint8_t N>
+    struct BranchStorage: Branch
+    {
+        BranchStorage() noexcept
+        {
+            this->mChildren = mStorage;
+            this->mCapacity = N;
+        }
+
+        BranchStorage(const BranchStorage&) = delete;
+        BranchStorage& operator=(const BranchStorage&) = delete;
+
+        NodePtr         mStorage[N];
+    };
+
+    static const Leaf* leaf(const Node* node) noexcept {
+        return static_cast<const Leaf*>(node);
+    }
+
+    static Leaf* leaf(Node* node) noexcept {
+        return static_cast<Leaf*>(node);
+    }
+
+    static Branch* branch(Node* node) noexcept {
+        return static_cast<Branch*>(node);
+    }
+
+    static const Branch* branch(const Node* node) noexcept {
+        return static_cast<const Branch*>(node);
+    }
+
+    static std::size_t hash(const Key& key) {
+        return Hash()(key);
+    }
+
+    static bool equal(const Key& lhs, const Key& rhs) {
+        return KeyEqual()(lhs, rhs);
+    }
+
+    static std::uint32_t bit(std::size_t hash, unsigned int shift) noexcept {
+        return std::uint32_t(1) << ((hash >> shift) & kMask);
+    }
+
+    static unsigned int child_index(const Node* node, std::uint32_t bit) noexcept {
+        return static_cast<unsigned int>(std::popcount(node->mBitmap & (bit - 1)));
+    }
+
+    static NodePtr make_branch(unsigned int capacity);
+
+    // Copy a branch into a new branch with the given capacity (moving the children if move is true)
+    static NodePtr copy_branch(Branch* source, unsigned int capacity, bool move);
+
+    // Replace the node of slot by a copy unless slot is its only reference
+    static void make_unique(NodePtr& slot);
+
+    // Create the branches that separate two leaves with different hashes
+    static NodePtr split(const NodePtr& existing, std::size_t existingHash,
+                         const NodePtr& added, std::size_t addedHash, unsigned int shift);
+
+    /* Insert or assign in the subtree of slot. The node that holds slot must be
+    owned by this map (already made unique). Returns true if an entry was inserted.
+    */
+    static bool insert(NodePtr& slot, std::size_t hash, unsigned int shift, Key& key, Value& value);
+
+    // Remove key (which must be present) from the subtree of slot
+    static void remove(NodePtr& slot, std::size_t hash, unsigned int shift, const Key& key);
+
+    template <typename Function>
+    static void for_each(const Node* node, Function& function);
+
+    NodePtr         mRoot;
+    std::size_t     mSize{0};
+};
+
+// -----------------------------------------------------------------------------
+
+template <typename Key, typename Value, typename Hash, typename KeyEqual>
+const Value* persistent_map<Key, Value, Hash, KeyEqual>::find(const Key& key) const
+{
+    const std::size_t keyHash = hash(key);
+    const Node* node = mRoot.get();
+    unsigned int shift = 0;
+    while (node != nullptr)
+    {
+        if (node->mCapacity == 0)
+        {
+            for (const Leaf* entry = leaf(node); entry != nullptr; entry = leaf(entry->mNext.get()))
+            {
+                if ((entry->mHash == keyHash) && equal(entry->mValue.first, key))
+                    return &entry->mValue.second;
+            }
+            return nullptr;
+        }
+
+        const std::uint32_t keyBit = bit(keyHash, shift);
+        if ((node->mBitmap & keyBit) == 0)
+            return nullptr;
+        node = branch(node)->mChildren[child_index(node, keyBit)].get();
+        shift += kBits;
+    }
+    return nullptr;
+}
+
+template <typename Key, typename Value, typename Hash, typename KeyEqual>
+bool persistent_map<Key, Value, Hash, KeyEqual>::set(Key key, Value value)
+{
+    const bool inserted = insert(mRoot, hash(key), 0, key, value);
+    if (inserted)
+        ++mSize;
+    return inserted;
+}
+
+template <typename Key, typename Value, typename Hash, typename KeyEqual>
+bool persistent_map<Key, Value, Hash, KeyEqual>::erase(const Key& key)
+{
+    // Nothing is copied when the key is not present
+    if (find(key) == nullptr)
+        return false;
+
+    remove(mRoot, hash(key), 0, key);
+    --mSize;
+    return true;
+}
+
+template <typename Key, typename Value, typename Hash, typename KeyEqual>
+inline void persistent_map<Key, Value, Hash, KeyEqual>::clear() noexcept
+{
+    mRoot.reset();
+    mSize = 0;
+}
+
+template <typename Key, typename Value, typename Hash, typename KeyEqual>
+template <typename Function>
+inline void persistent_map<Key, Value, Hash, KeyEqual>::for_each(Function&& function) const
+{
+    if (mRoot)
+        for_each(mRoot.get(), function);
+}
+
+template <typename Key, typename Value, typename Hash, typename KeyEqual>
+template <typename Function>
+void persistent_map<Key, Value, Hash, KeyEqual>::for_each(const Node* node, Function& function)
+{
+    if (node->mCapacity == 0)
+    {
+        for (const Leaf* entry = leaf(node); entry != nullptr; entry = leaf(entry->mNext.get()))
+            function(entry->mValue);
+        return;
+    }
+
+    const Branch* const parent = branch(node);
+    for (unsigned int index = 0; index < parent->mCount; ++index)
+        for_each(parent->mChildren[index].get(), function);
+}
+
+template <typename Key, typename Value, typename Hash, typename KeyEqual>
+typename persistent_map<Key, Value, Hash, KeyEqual>::NodePtr
+persistent_map<Key, Value, Hash, KeyEqual>::make_branch(unsigned int capacity)
+{
+    switch (capacity)
+    {
+    case 2:
+        return bch::make_shared<BranchStorage<2>>();
+    case 4:
+        return bch::make_shared<BranchStorage<4>>();
+    case 8:
+        return bch::make_shared<BranchStorage<8>>();
+    case 16:
+        return bch::make_shared<BranchStorage<16>>();
+    default:
+#if BCH_SMART_PTR_DEBUG
+        assert(capacity == 32);
+#endif
+        return bch::make_shared<BranchStorage<32>>();
+    }
+}
+
+template <typename Key, typename Value, typename Hash, typename KeyEqual>
+typename persistent_map<Key, Value, Hash, KeyEqual>::NodePtr
+persistent_map<Key, Value, Hash, KeyEqual>::copy_branch(Branch* source, unsigned int capacity, bool move)
+{
+    NodePtr result = make_branch(capacity);
+    Branch* const destination = branch(result.get());
+    destination->mBitmap = source->mBitmap;
+    destination->mCount = source->mCount;
+    for (unsigned int index = 0; index < source->mCount; ++index)
+    {
+        if (move)
+            destination->mChildren[index] = std::move(source->mChildren[index]);
+        else
+            destination->mChildren[index] = source->mChildren[index];
+    }
+    return result;
+}
+
+template <typename Key, typename Value, typename Hash, typename KeyEqual>
+void persistent_map<Key, Value, Hash, KeyEqual>::make_unique(NodePtr& slot)
+{
+    if (slot.unique())
+        return;
+
+    if (slot->mCapacity == 0)
+        slot = bch::make_shared<Leaf>(*leaf(slot.get()));
+    else
+        slot = copy_branch(branch(slot.get()), slot->mCapacity, false);
+}
+
+template <typename Key, typename Value, typename Hash, typename KeyEqual>
+typename persistent_map<Key, Value, Hash, KeyEqual>::NodePtr
+persistent_map<Key, Value, Hash, KeyEqual>::split(const NodePtr& existing, std::size_t existingHash,
+                                                  const NodePtr& added, std::size_t addedHash, unsigned int shift)
+{
+    NodePtr result = make_branch(2);
+    Branch* const parent = branch(result.get());
+    const std::uint32_t existingBit = bit(existingHash, shift);
+    const std::uint32_t addedBit = bit(addedHash, shift);
+    if (existingBit == addedBit)
+    {
+        parent->mChildren[0] = split(existing, existingHash, added, addedHash, shift + kBits);
+        parent->mCount = 1;
+    }
+    else
+    {
+        const bool existingFirst = (existingBit < addedBit);
+        parent->mChildren[0] = existingFirst ? existing : added;
+        parent->mChildren[1] = existingFirst ? added : existing;
+        parent->mCount = 2;
+    }
+    parent->mBitmap = existingBit | addedBit;
+    return result;
+}
+
+template <typename Key, typename Value, typename Hash, typename KeyEqual>
+bool persistent_map<Key, Value, Hash, KeyEqual>::insert(NodePtr& slot, std::size_t hash, unsigned int shift,
+                                                        Key& key, Value& value)
+{
+    if (!slot)
+    {
+        slot = bch::make_shared<Leaf>(hash, std::move(key), std::move(value));
+        return true;
+    }
+
+    if (slot->mCapacity == 0)
+    {
+        const std::size_t existingHash = leaf(slot.get())->mHash;
+        if (existingHash != hash)
+        {
+            NodePtr added = bch::make_shared<Leaf>(hash, std::move(key), std::move(value));
+            slot = split(slot, existingHash, added, hash, shift);
+            return true;
+        }
+
+        make_unique(slot);
+        Leaf* const entry = leaf(slot.get());
+        if (equal(entry->mValue.first, key))
+        {
+            entry->mValue.second = std::move(value);
+            return false;
+        }
+        return insert(entry->mNext, hash, shift, key, value);
+    }
+
+    make_unique(slot);
+    Branch* parent = branch(slot.get());
+    const std::uint32_t keyBit = bit(hash, shift);
+    const unsigned int index = child_index(parent, keyBit);
+    if ((parent->mBitmap & keyBit) != 0)
+        return insert(parent->mChildren[index], hash, shift + kBits, key, value);
+
+    NodePtr added = bch::make_shared<Leaf>(hash, std::move(key), std::move(value));
+    if (parent->mCount == parent->mCapacity)
+    {
+        // The branch is owned by this map, so the children are moved to the larger branch
+        slot = copy_branch(parent, parent->mCapacity * 2, true);
+        parent = branch(slot.get());
+    }
+
+    for (unsigned int position = parent->mCount; position > index; --position)
+        parent->mChildren[position] = std::move(parent->mChildren[position - 1]);
+    parent->mChildren[index] = std::move(added);
+    parent->mBitmap |= keyBit;
+    ++parent->mCount;
+    return true;
+}
+
+template <typename Key, typename Value, typename Hash, typename KeyEqual>
+void persistent_map<Key, Value, Hash, KeyEqual>::remove(NodePtr& slot, std::size_t hash, unsigned int shift,
+                                                        const Key& key)
+{
+    if (slot->mCapacity == 0)
+    {
+        if (equal(leaf(slot.get())->mValue.first, key))
+        {
+            NodePtr next = leaf(slot.get())->mNext;
+            slot = std::move(next);
+            return;
+        }
+
+        make_unique(slot);
+        remove(leaf(slot.get())->mNext, hash, shift, key);
+        return;
+    }
+
+    make_unique(slot);
+    Branch* const parent = branch(slot.get());
+    const std::uint32_t keyBit = bit(hash, shift);
+    const unsigned int index = child_index(parent, keyBit);
+    remove(parent->mChildren[index], hash, shift + kBits, key);
+
+    if (!parent->mChildren[index])
+    {
+        for (unsigned int position = index + 1; position < parent->mCount; ++position)
+            parent->mChildren[position - 1] = std::move(parent->mChildren[position]);
+        parent->mBitmap &= ~keyBit;
+        --parent->mCount;
+    }
+
+    // A branch with a single leaf is replaced by the leaf
+    if (parent->mCount == 0)
+    {
+        slot.reset();
+    }
+    else if ((parent->mCount == 1) && (parent->mChildren[0]->mCapacity == 0))
+    {
+        NodePtr child = std::move(parent->mChildren[0]);
+        slot = std::move(child);
+    }
+}
+
+}   // namespace bch
+
+#include "bch/common/header_suffix.hpp"
+
+#endif  // BCH_PERSISTENT_MAP
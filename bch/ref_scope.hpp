@@ -0,0 +1,313 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#ifndef BCH_REF_SCOPE
+#define BCH_REF_SCOPE
+
+#pragma once
+
+#include <deque>
+
+#include "bch/shared_ptr_nc.hpp"
+
+#include "bch/common/header_prefix.hpp"
+
+namespace bch {
+
+namespace detail {
+
+/* Reference count data for a single control block in a ref_scope.
+mDelta is the number of live scoped_ptr_nc instances for the control block.
+*/
+struct RefScopeEntry
+{
+    ControlBlock*   mHandle{nullptr};
+    std::int32_t    mDelta{0};
+};
+
+}   // namespace detail
+
+template <typename T>
+class scoped_ptr_nc;
+
+/* Deferred reference counting within a scope.
+Copying a shared_ptr_nc changes the strong reference count of the control block
+(a read-modify-write of shared memory). Loops that copy the same small set of
+pointers into temporaries perform an increment/decrement pair per iteration.
+
+A ref_scope holds a single strong reference for each control block that is shared
+through the scope. Copies of a scoped_ptr_nc record the change in a local delta
+(which lives on the stack with the scope), and the control block is only updated
+twice: when the control block is first shared through the scope, and when the scope
+ends.
+
+A scoped_ptr_nc must not outlive the ref_scope that created it. Use
+scoped_ptr_nc::to_shared for pointers that escape the scope; this creates a regular
+shared_ptr_nc with a real reference count.
+
+Usage:
+/code
+    bch::ref_scope scope;
+    bch::scoped_ptr_nc<Foo> foo = scope.share(fooPtr);
+    for (...)
+    {
+        bch::scoped_ptr_nc<Foo> temp = foo;     // no control block access
+        ...
+    }
+/endcode
+
+The scope has inline storage for kInlineCapacity control blocks. Additional control
+blocks are stored in heap allocated memory.
+*/
+class ref_scope
+{
+public:
+    static constexpr std::size_t kInlineCapacity = 8;
+
+    ref_scope() noexcept = default;
+    ~ref_scope();
+
+    /* Return a scoped pointer for ptr. The first time a control block is shared
+    through the scope, the scope takes a strong reference to it.
+    */
+    template <typename T>
+    scoped_ptr_nc<T> share(const shared_ptr_nc<T>& ptr);
+
+private:
+    ref_scope(const ref_scope&) = delete;
+    ref_scope(ref_scope&&) = delete;
+    ref_scope& operator=(const ref_scope&) = delete;
+    ref_scope& operator=(ref_scope&&) = delete;
+
+    detail::RefScopeEntry* find_or_add(detail::ControlBlock* handle);
+
+    detail::RefScopeEntry               mEntries[kInlineCapacity];
+    std::size_t                         mCount{0};
+    // Entries beyond kInlineCapacity. std::deque does not move elements on growth.
+    std::deque<detail::RefScopeEntry>   mOverflow;
+};
+
+/* Pointer to an instance that is held by a ref_scope.
+Copying and destroying a scoped_ptr_nc only changes the local delta of the scope.
+*/
+template <typename T>
+class scoped_ptr_nc
+{
+public:
+    constexpr scoped_ptr_nc() noexcept = default;
+    constexpr scoped_ptr_nc(std::nullptr_t) noexcept;
+
+    scoped_ptr_nc(const scoped_ptr_nc& ptr) noexcept;
+    template <typename U>
+    scoped_ptr_nc(const scoped_ptr_nc<U>& ptr) noexcept;
+
+    scoped_ptr_nc(scoped_ptr_nc&& ptr) noexcept;
+
+    ~scoped_ptr_nc();
+
+    scoped_ptr_nc& operator=(const scoped_ptr_nc& ptr) noexcept;
+    scoped_ptr_nc& operator=(scoped_ptr_nc&& ptr) noexcept;
+
+    /* Create a shared pointer with a real strong reference. Used for pointers that
+    escape the scope.
+    */
+    shared_ptr_nc<T> to_shared() const noexcept;
+
+    T* get() const noexcept {
+        return mPtr;
+    }
+
+    T& operator*() const noexcept {
+        return *mPtr;
+    }
+
+    T* operator->() const noexcept {
+        return mPtr;
+    }
+
+    explicit operator bool() const noexcept {
+        return (mPtr != nullptr);
+    }
+
+private:
+    friend class ref_scope;
+
+    template <typename U>
+    friend class scoped_ptr_nc;
+
+    scoped_ptr_nc(detail::RefScopeEntry* entry, T* ptr) noexcept;
+
+    T*                          mPtr{nullptr};
+    detail::RefScopeEntry*      mEntry{nullptr};
+};
+
+template <typename T>
+struct is_trivially_relocatable<scoped_ptr_nc<T>>: std::true_type {};
+
+// -----------------------------------------------------------------------------
+
+inline
+ref_scope::~ref_scope()
+{
+    /* Apply the deltas. All scoped pointers must have been destroyed, so the only
+    remaining reference is the one held by the scope.
+    */
+    for (std::size_t index = 0; index < mCount; ++index)
+    {
+#if BCH_SMART_PTR_DEBUG
+        assert(mEntries[index].mDelta == 0);
+#endif
+        mEntries[index].mHandle->release_shared();
+    }
+
+    for (detail::RefScopeEntry& entry: mOverflow)
+    {
+#if BCH_SMART_PTR_DEBUG
+        assert(entry.mDelta == 0);
+#endif
+        entry.mHandle->release_shared();
+    }
+}
+
+template <typename T>
+scoped_ptr_nc<T> ref_scope::share(const shared_ptr_nc<T>& ptr)
+{
+    detail::ControlBlock* const handle = detail::SharedPtrAccess::handle(ptr);
+    if (handle == nullptr)
+        return scoped_ptr_nc<T>();
+
+    return scoped_ptr_nc<T>(find_or_add(handle), ptr.get());
+}
+
+inline detail::RefScopeEntry* ref_scope::find_or_add(detail::ControlBlock* handle)
+{
+    for (std::size_t index = 0; index < mCount; ++index)
+    {
+        if (mEntries[index].mHandle == handle)
+            return &mEntries[index];
+    }
+
+    for (detail::RefScopeEntry& entry: mOverflow)
+    {
+        if (entry.mHandle == handle)
+            return &entry;
+    }
+
+    detail::RefScopeEntry* entry = nullptr;
+    if (mCount < kInlineCapacity)
+    {
+        entry = &mEntries[mCount++];
+    }
+    else
+    {
+        mOverflow.emplace_back();
+        entry = &mOverflow.back();
+    }
+
+    handle->add_shared();
+    entry->mHandle = handle;
+    return entry;
+}
+
+// -----------------------------------------------------------------------------
+
+template <typename T>
+inline constexpr
+scoped_ptr_nc<T>::scoped_ptr_nc(std::nullptr_t) noexcept
+{
+}
+
+template <typename T>
+inline
+scoped_ptr_nc<T>::scoped_ptr_nc(detail::RefScopeEntry* entry, T* ptr) noexcept :
+    mPtr(ptr),
+    mEntry(entry)
+{
+    ++mEntry->mDelta;
+}
+
+template <typename T>
+inline
+scoped_ptr_nc<T>::scoped_ptr_nc(const scoped_ptr_nc& ptr) noexcept :
+    mPtr(ptr.mPtr),
+    mEntry(ptr.mEntry)
+{
+    if (mEntry != nullptr)
+        ++mEntry->mDelta;
+}
+
+template <typename T>
+template <typename U>
+inline
+scoped_ptr_nc<T>::scoped_ptr_nc(const scoped_ptr_nc<U>& ptr) noexcept :
+    mPtr(static_cast<T*>(ptr.mPtr)),
+    mEntry(ptr.mEntry)
+{
+    if (mEntry != nullptr)
+        ++mEntry->mDelta;
+}
+
+template <typename T>
+inline
+scoped_ptr_nc<T>::scoped_ptr_nc(scoped_ptr_nc&& ptr) noexcept :
+    mPtr(ptr.mPtr),
+    mEntry(ptr.mEntry)
+{
+    ptr.mPtr = nullptr;
+    ptr.mEntry = nullptr;
+}
+
+template <typename T>
+inline
+scoped_ptr_nc<T>::~scoped_ptr_nc()
+{
+    if (mEntry != nullptr)
+        --mEntry->mDelta;
+}
+
+template <typename T>
+scoped_ptr_nc<T>&
+scoped_ptr_nc<T>::operator=(const scoped_ptr_nc& ptr) noexcept
+{
+    if (ptr.mEntry != nullptr)
+        ++ptr.mEntry->mDelta;
+    if (mEntry != nullptr)
+        --mEntry->mDelta;
+
+    mPtr = ptr.mPtr;
+    mEntry = ptr.mEntry;
+    return *this;
+}
+
+template <typename T>
+scoped_ptr_nc<T>&
+scoped_ptr_nc<T>::operator=(scoped_ptr_nc&& ptr) noexcept
+{
+    if (this != &ptr)
+    {
+        if (mEntry != nullptr)
+            --mEntry->mDelta;
+
+        mPtr = ptr.mPtr;
+        mEntry = ptr.mEntry;
+        ptr.mPtr = nullptr;
+        ptr.mEntry = nullptr;
+    }
+    return *this;
+}
+
+template <typename T>
+shared_ptr_nc<T> scoped_ptr_nc<T>::to_shared() const noexcept
+{
+    if (mEntry == nullptr)
+        return shared_ptr_nc<T>();
+
+    return detail::SharedPtrAccess::make(mEntry->mHandle, mPtr, true);
+}
+
+}   // namespace bch
+
+#include "bch/common/header_suffix.hpp"
+
+#endif  // BCH_REF_SCOPE
@@ -0,0 +1,406 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#ifndef BCH_RELOCATABLE_VECTOR
+#define BCH_RELOCATABLE_VECTOR
+
+#pragma once
+
+#include <cassert>
+#include <cstdlib>
+#include <initializer_list>
+#include <new>
+#include <utility>
+
+#include "bch/common/relocation.hpp"
+
+#include "bch/common/header_prefix.hpp"
+
+namespace bch {
+
+/* Vector that moves its elements with relocate (see relocation.hpp).
+std::vector moves elements one at a time on growth and erase (a move construction
+and a destruction per element). For shared_ptr_nc this is a read and a write of two
+words plus a null check on destruction per element. Trivially relocatable types are
+moved with a single memcpy.
+
+The element type must be trivially relocatable or nothrow move constructible.
+Memory is allocated with malloc; allocation failure throws std::bad_alloc.
+*/
+template <typename T>
+class relocatable_vector
+{
+public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using reference = T&;
+    using const_reference = const T&;
+    using iterator = T*;
+    using const_iterator = const T*;
+
+    relocatable_vector() noexcept = default;
+    relocatable_vector(std::initializer_list<T> values);
+    relocatable_vector(const relocatable_vector& other);
+    relocatable_vector(relocatable_vector&& other) noexcept;
+    ~relocatable_vector();
+
+    relocatable_vector& operator=(const relocatable_vector& other);
+    relocatable_vector& operator=(relocatable_vector&& other) noexcept;
+
+    void swap(relocatable_vector& other) noexcept;
+
+    void reserve(size_type capacity);
+    void clear() noexcept;
+
+    void push_back(const T& value);
+    void push_back(T&& value);
+
+    template <typename ... Args>
+    T& emplace_back(Args&& ... args);
+
+    void pop_back() noexcept;
+
+    /* Erase the element at position. The elements after position are relocated
+    (not move assigned) to close the gap.
+    */
+    iterator erase(const_iterator position) noexcept;
+    iterator erase(const_iterator first, const_iterator last) noexcept;
+
+    /* Erase the element at position by relocating the last element into its place.
+    Does not preserve the order of the elements.
+    */
+    iterator erase_unordered(const_iterator position) noexcept;
+
+    size_type size() const noexcept {
+        return mSize;
+    }
+
+    size_type capacity() const noexcept {
+        return mCapacity;
+    }
+
+    bool empty() const noexcept {
+        return (mSize == 0);
+    }
+
+    T* data() noexcept {
+        return mData;
+    }
+
+    const T* data() const noexcept {
+        return mData;
+    }
+
+    T& operator[](size_type index) noexcept {
+        assert(index < mSize);
+        return mData[index];
+    }
+
+    const T& operator[](size_type index) const noexcept {
+        assert(index < mSize);
+        return mData[index];
+    }
+
+    T& front() noexcept {
+        assert(mSize != 0);
+        return mData[0];
+    }
+
+    const T& front() const noexcept {
+        assert(mSize != 0);
+        return mData[0];
+    }
+
+    T& back() noexcept {
+        assert(mSize != 0);
+        return mData[mSize - 1];
+    }
+
+    const T& back() const noexcept {
+        assert(mSize != 0);
+        return mData[mSize - 1];
+    }
+
+    iterator begin() noexcept {
+        return mData;
+    }
+
+    iterator end() noexcept {
+        return mData + mSize;
+    }
+
+    const_iterator begin() const noexcept {
+        return mData;
+    }
+
+    const_iterator end() const noexcept {
+        return mData + mSize;
+    }
+
+private:
+    static_assert(is_trivially_relocatable_v<T> || std::is_nothrow_move_constructible_v<T>,
+        "relocatable_vector requires a trivially relocatable or a nothrow move constructible type");
+    static_assert(alignof(T) <= alignof(std::max_align_t), "over-aligned types are not supported");
+
+    static T* allocate(size_type capacity);
+
+    size_type grown_capacity() const noexcept;
+
+    // Allocate a larger block and relocate the elements (called when the vector is full)
+    template <typename ... Args>
+    T& grow_and_emplace_back(Args&& ... args);
+
+    T*          mData{nullptr};
+    size_type   mSize{0};
+    size_type   mCapacity{0};
+};
+
+template <typename T>
+struct is_trivially_relocatable<relocatable_vector<T>>: std::true_type {};
+
+// -----------------------------------------------------------------------------
+
+template <typename T>
+inline
+relocatable_vector<T>::relocatable_vector(std::initializer_list<T> values) :
+    // Delegating makes the vector complete, so the destructor runs if a copy throws
+    relocatable_vector()
+{
+    reserve(values.size());
+    for (const T& value: values)
+        emplace_back(value);
+}
+
+template <typename T>
+inline
+relocatable_vector<T>::relocatable_vector(const relocatable_vector& other) :
+    relocatable_vector()
+{
+    reserve(other.mSize);
+    if constexpr (std::is_trivially_copyable_v<T>)
+    {
+        if (other.mSize != 0)
+            memcpy(static_cast<void*>(mData), static_cast<const void*>(other.mData), other.mSize * sizeof(T));
+        mSize = other.mSize;
+    }
+    else
+    {
+        for (const T& value: other)
+            emplace_back(value);
+    }
+}
+
+template <typename T>
+inline
+relocatable_vector<T>::relocatable_vector(relocatable_vector&& other) noexcept :
+    mData(other.mData),
+    mSize(other.mSize),
+    mCapacity(other.mCapacity)
+{
+    other.mData = nullptr;
+    other.mSize = 0;
+    other.mCapacity = 0;
+}
+
+template <typename T>
+inline
+relocatable_vector<T>::~relocatable_vector()
+{
+    clear();
+    free(mData);
+}
+
+template <typename T>
+inline relocatable_vector<T>&
+relocatable_vector<T>::operator=(const relocatable_vector& other)
+{
+    if (this != &other)
+    {
+        relocatable_vector copy(other);
+        swap(copy);
+    }
+    return *this;
+}
+
+template <typename T>
+inline relocatable_vector<T>&
+relocatable_vector<T>::operator=(relocatable_vector&& other) noexcept
+{
+    relocatable_vector temp(std::move(other));
+    swap(temp);
+    return *this;
+}
+
+template <typename T>
+inline void relocatable_vector<T>::swap(relocatable_vector& other) noexcept
+{
+    std::swap(mData, other.mData);
+    std::swap(mSize, other.mSize);
+    std::swap(mCapacity, other.mCapacity);
+}
+
+template <typename T>
+inline T* relocatable_vector<T>::allocate(size_type capacity)
+{
+    if (capacity > (static_cast<size_type>(-1) / sizeof(T)))
+        throw std::bad_alloc();
+
+    void* memory = malloc(capacity * sizeof(T));
+    if (memory == nullptr)
+        throw std::bad_alloc();
+    return static_cast<T*>(memory);
+}
+
+template <typename T>
+inline void relocatable_vector<T>::reserve(size_type capacity)
+{
+    if (capacity <= mCapacity)
+        return;
+
+    T* data = allocate(capacity);
+    relocate(mData, mSize, data);
+    free(mData);
+    mData = data;
+    mCapacity = capacity;
+}
+
+template <typename T>
+inline void relocatable_vector<T>::clear() noexcept
+{
+    if constexpr (!std::is_trivially_destructible_v<T>)
+    {
+        for (size_type index = 0; index < mSize; ++index)
+            mData[index].~T();
+    }
+    mSize = 0;
+}
+
+template <typename T>
+inline void relocatable_vector<T>::push_back(const T& value)
+{
+    emplace_back(value);
+}
+
+template <typename T>
+inline void relocatable_vector<T>::push_back(T&& value)
+{
+    emplace_back(std::move(value));
+}
+
+template <typename T>
+template <typename ... Args>
+inline T& relocatable_vector<T>::emplace_back(Args&& ... args)
+{
+    if (mSize == mCapacity)
+        return grow_and_emplace_back(std::forward<Args>(args)...);
+
+    T* result = new (mData + mSize) T(std::forward<Args>(args)...);
+    ++mSize;
+    return *result;
+}
+
+template <typename T>
+inline typename relocatable_vector<T>::size_type
+relocatable_vector<T>::grown_capacity() const noexcept
+{
+    return (mCapacity == 0) ? 4 : (mCapacity * 2);
+}
+
+template <typename T>
+template <typename ... Args>
+T& relocatable_vector<T>::grow_and_emplace_back(Args&& ... args)
+{
+    const size_type capacity = grown_capacity();
+    T* data = allocate(capacity);
+
+    /* Construct the new element before relocating the existing elements: args may
+    refer to an element in the vector, and a throwing constructor leaves the vector
+    unchanged.
+    */
+    T* result = nullptr;
+    try
+    {
+        result = new (data + mSize) T(std::forward<Args>(args)...);
+    }
+    catch (...)
+    {
+        free(data);
+        throw;
+    }
+
+    relocate(mData, mSize, data);
+    free(mData);
+    mData = data;
+    mCapacity = capacity;
+    ++mSize;
+    return *result;
+}
+
+template <typename T>
+inline void relocatable_vector<T>::pop_back() noexcept
+{
+    assert(mSize != 0);
+    --mSize;
+    mData[mSize].~T();
+}
+
+template <typename T>
+inline typename relocatable_vector<T>::iterator
+relocatable_vector<T>::erase(const_iterator position) noexcept
+{
+    return erase(position, position + 1);
+}
+
+template <typename T>
+typename relocatable_vector<T>::iterator
+relocatable_vector<T>::erase(const_iterator first, const_iterator last) noexcept
+{
+    assert((begin() <= first) && (first <= last) && (last <= end()));
+
+    T* const destination = const_cast<T*>(first);
+    T* const source = const_cast<T*>(last);
+    const size_type count = static_cast<size_type>(source - destination);
+    if (count == 0)
+        return destination;
+
+    for (T* element = destination; element != source; ++element)
+        element->~T();
+
+    const size_type tail = static_cast<size_type>(end() - source);
+    if constexpr (is_trivially_relocatable_v<T>)
+    {
+        // The ranges may overlap
+        if (tail != 0)
+            memmove(static_cast<void*>(destination), static_cast<const void*>(source), tail * sizeof(T));
+    }
+    else
+    {
+        // Relocating element by element in increasing order is safe for overlapping ranges
+        for (size_type index = 0; index < tail; ++index)
+            relocate(source + index, 1, destination + index);
+    }
+
+    mSize -= count;
+    return destination;
+}
+
+template <typename T>
+inline typename relocatable_vector<T>::iterator
+relocatable_vector<T>::erase_unordered(const_iterator position) noexcept
+{
+    assert((begin() <= position) && (position < end()));
+
+    T* const element = const_cast<T*>(position);
+    element->~T();
+    --mSize;
+    if (element != mData + mSize)
+        relocate(mData + mSize, 1, element);
+    return element;
+}
+
+}   // namespace bch
+
+#include "bch/common/header_suffix.hpp"
+
+#endif  // BCH_RELOCATABLE_VECTOR
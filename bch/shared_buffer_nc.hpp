@@ -0,0 +1,299 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#ifndef BCH_SHARED_BUFFER_NC
+#define BCH_SHARED_BUFFER_NC
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <utility>
+
+#include <sys/uio.h>
+
+#include "bch/relocatable_vector.hpp"
+#include "bch/shared_ptr_nc.hpp"
+#include "bch/common/memory.hpp"
+#include "bch/common/relocation.hpp"
+
+#include "bch/common/header_prefix.hpp"
+
+namespace bch {
+namespace detail {
+
+/* Control block of a shared_buffer_nc. The bytes are stored after the control block
+(at data_offset) in a single malloc allocation.
+*/
+class ControlBlockBuffer: public ControlBlock
+{
+public:
+    ControlBlockBuffer() noexcept = default;
+
+    static constexpr std::size_t data_offset() noexcept {
+        return InstancePairOffset(sizeof(ControlBlockBuffer), alignof(std::max_align_t));
+    }
+
+    std::byte* data() noexcept {
+        return reinterpret_cast<std::byte*>(this) + data_offset();
+    }
+
+protected:
+    virtual void on_zero_shared()
+    {
+        // The bytes do not need to be destroyed; the memory is released by on_zero_weak
+    }
+};
+
+}   // namespace detail
+
+/* Reference counted view of bytes.
+allocate creates the bytes and their control block in a single allocation. Copies
+and slices share the bytes: creating a slice increments the (non atomic) reference
+count and does not allocate or copy. The bytes are released when the last view is
+released.
+The bytes are mutable through every view: a writer must not change bytes that have
+been handed to other views.
+
+Not thread safe: views of the same bytes must be used by one thread at a time.
+*/
+class shared_buffer_nc
+{
+public:
+    shared_buffer_nc() noexcept = default;
+
+    // Allocate size uninitialized bytes. Throws std::bad_alloc.
+    static shared_buffer_nc allocate(std::size_t size);
+
+    // Allocate a copy of size bytes at data. Throws std::bad_alloc.
+    static shared_buffer_nc copy(const void* data, std::size_t size);
+
+    shared_buffer_nc(const shared_buffer_nc& other) noexcept;
+    shared_buffer_nc(shared_buffer_nc&& other) noexcept;
+    ~shared_buffer_nc();
+
+    shared_buffer_nc& operator=(const shared_buffer_nc& other) noexcept;
+    shared_buffer_nc& operator=(shared_buffer_nc&& other) noexcept;
+
+    std::byte* data() const noexcept {
+        return mData;
+    }
+
+    std::size_t size() const noexcept {
+        return mSize;
+    }
+
+    bool empty() const noexcept {
+        return (mSize == 0);
+    }
+
+    std::byte* begin() const noexcept {
+        return mData;
+    }
+
+    std::byte* end() const noexcept {
+        return mData + mSize;
+    }
+
+    std::byte& operator[](std::size_t index) const noexcept {
+#if BCH_SMART_PTR_DEBUG
+        assert(index < mSize);
+#endif
+        return mData[index];
+    }
+
+    // Return a view of count bytes from offset that shares the bytes of this view
+    shared_buffer_nc slice(std::size_t offset, std::size_t count) const noexcept;
+
+    // Remove count bytes from the front or the back of this view
+    void remove_prefix(std::size_t count) noexcept;
+    void remove_suffix(std::size_t count) noexcept;
+
+    void reset() noexcept;
+
+    void swap(shared_buffer_nc& other) noexcept;
+
+    // Number of views that share the bytes
+    long use_count() const noexcept {
+        return (mHandle != nullptr) ? static_cast<long>(mHandle->use_count()) : 0;
+    }
+
+    iovec to_iovec() const noexcept {
+        return iovec{mData, mSize};
+    }
+
+private:
+    shared_buffer_nc(detail::ControlBlock* handle, std::byte* data, std::size_t size) noexcept :
+        mHandle(handle),
+        mData(data),
+        mSize(size)
+    { }
+
+    detail::ControlBlock*   mHandle{nullptr};
+    std::byte*              mData{nullptr};
+    std::size_t             mSize{0};
+};
+
+template <>
+struct is_trivially_relocatable<shared_buffer_nc>: std::true_type {};
+
+/* Sequence of buffers that is read or written as one range of bytes (scatter/gather).
+Appending, splitting and consuming bytes slices the buffers and never copies bytes.
+The buffers map to the iovec array of readv and writev:
+/code
+    bch::buffer_chain chain;
+    chain.append(header);
+    chain.append(body.slice(0, length));
+    iovec vectors[16];
+    const ssize_t written = writev(fd, vectors, chain.to_iovec(vectors, 16));
+    chain.consume(written);
+/endcode
+*/
+class buffer_chain
+{
+public:
+    buffer_chain() noexcept = default;
+
+    // Append buffer (empty buffers are ignored). Throws std::bad_alloc.
+    void append(shared_buffer_nc buffer);
+
+    // Append the buffers of other. Throws std::bad_alloc.
+    void append(const buffer_chain& other);
+
+    // Remove count bytes from the front (for example the bytes written by writev)
+    void consume(std::size_t count) noexcept;
+
+    /* Remove count bytes from the front and return them as a chain (for example the
+    bytes received by readv). Throws std::bad_alloc.
+    */
+    buffer_chain split(std::size_t count);
+
+    /* Store up to maxCount iovec entries for the front buffers in vectors. Returns
+    the number of entries.
+    */
+    int to_iovec(iovec* vectors, std::size_t maxCount) const noexcept;
+
+    // Copy the bytes of the chain to destination (which holds at least size() bytes)
+    void copy_to(void* destination) const noexcept;
+
+    void clear() noexcept;
+
+    // Number of bytes
+    std::size_t size() const noexcept {
+        return mSize;
+    }
+
+    bool empty() const noexcept {
+        return (mSize == 0);
+    }
+
+    std::size_t buffer_count() const noexcept {
+        return mBuffers.size() - mFront;
+    }
+
+    const shared_buffer_nc& buffer(std::size_t index) const noexcept {
+        return mBuffers[mFront + index];
+    }
+
+private:
+    // The buffers before mFront have been consumed (they are removed in bulk)
+    relocatable_vector<shared_buffer_nc>    mBuffers;
+    std::size_t                             mFront{0};
+    std::size_t                             mSize{0};
+};
+
+template <>
+struct is_trivially_relocatable<buffer_chain>: std::true_type {};
+
+// -----------------------------------------------------------------------------
+
+inline
+shared_buffer_nc::shared_buffer_nc(const shared_buffer_nc& other) noexcept :
+    mHandle(other.mHandle),
+    mData(other.mData),
+    mSize(other.mSize)
+{
+    if (mHandle != nullptr)
+        mHandle->add_shared();
+}
+
+inline
+shared_buffer_nc::shared_buffer_nc(shared_buffer_nc&& other) noexcept :
+    mHandle(other.mHandle),
+    mData(other.mData),
+    mSize(other.mSize)
+{
+    other.mHandle = nullptr;
+    other.mData = nullptr;
+    other.mSize = 0;
+}
+
+inline
+shared_buffer_nc::~shared_buffer_nc()
+{
+    if (mHandle != nullptr)
+        mHandle->release_shared();
+}
+
+inline shared_buffer_nc& shared_buffer_nc::operator=(const shared_buffer_nc& other) noexcept
+{
+    shared_buffer_nc(other).swap(*this);
+    return *this;
+}
+
+inline shared_buffer_nc& shared_buffer_nc::operator=(shared_buffer_nc&& other) noexcept
+{
+    shared_buffer_nc(std::move(other)).swap(*this);
+    return *this;
+}
+
+inline void shared_buffer_nc::swap(shared_buffer_nc& other) noexcept
+{
+    std::swap(mHandle, other.mHandle);
+    std::swap(mData, other.mData);
+    std::swap(mSize, other.mSize);
+}
+
+inline void shared_buffer_nc::reset() noexcept
+{
+    shared_buffer_nc().swap(*this);
+}
+
+inline shared_buffer_nc shared_buffer_nc::slice(std::size_t offset, std::size_t count) const noexcept
+{
+#if BCH_SMART_PTR_DEBUG
+    assert((offset <= mSize) && (count <= mSize - offset));
+#endif
+
+    if (count == 0)
+        return shared_buffer_nc();
+
+    mHandle->add_shared();
+    return shared_buffer_nc(mHandle, mData + offset, count);
+}
+
+inline void shared_buffer_nc::remove_prefix(std::size_t count) noexcept
+{
+#if BCH_SMART_PTR_DEBUG
+    assert(count <= mSize);
+#endif
+
+    mData += count;
+    mSize -= count;
+}
+
+inline void shared_buffer_nc::remove_suffix(std::size_t count) noexcept
+{
+#if BCH_SMART_PTR_DEBUG
+    assert(count <= mSize);
+#endif
+
+    mSize -= count;
+}
+
+}   // namespace bch
+
+#include "bch/common/header_suffix.hpp"
+
+#endif  // BCH_SHARED_BUFFER_NC
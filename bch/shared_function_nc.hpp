@@ -0,0 +1,213 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#ifndef BCH_SHARED_FUNCTION_NC
+#define BCH_SHARED_FUNCTION_NC
+
+#pragma once
+
+#include <cassert>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "bch/shared_ptr_nc.hpp"
+#include "bch/common/memory.hpp"
+#include "bch/common/relocation.hpp"
+
+#include "bch/common/header_prefix.hpp"
+
+namespace bch {
+namespace detail {
+
+/* Control block of a shared_function_nc. The callable is stored after the control
+block (at function_offset) in a single malloc allocation.
+*/
+template <typename F, typename R, typename ... Args>
+class ControlBlockFunction: public ControlBlock
+{
+public:
+    ControlBlockFunction() noexcept = default;
+
+    static constexpr std::size_t function_offset() noexcept {
+        return InstancePairOffset(sizeof(ControlBlockFunction), alignof(F));
+    }
+
+    static F* function(void* address) noexcept {
+        return reinterpret_cast<F*>(static_cast<char*>(address) + function_offset());
+    }
+
+    // Invoker of shared_function_nc
+    static R invoke(ControlBlock* handle, Args&& ... args)
+    {
+        if constexpr (std::is_void_v<R>)
+            std::invoke(*function(handle), std::forward<Args>(args)...);
+        else
+            return std::invoke(*function(handle), std::forward<Args>(args)...);
+    }
+
+protected:
+    virtual void on_zero_shared()
+    {
+        function(this)->~F();
+    }
+};
+
+}   // namespace detail
+
+template <typename Signature>
+class shared_function_nc;
+
+/* Shared, type erased callable (a reference counted std::function).
+The callable is stored in the same allocation as its control block, so creating a
+shared_function_nc is a single allocation, a copy increments the (non atomic)
+reference count, and a call is a single indirect call: the invoker is stored in
+the shared_function_nc next to the control block pointer.
+Copies share the callable (a call through any copy may change its state).
+
+Invoking an empty shared_function_nc is undefined.
+Not thread safe: copies must be used by one thread at a time.
+*/
+template <typename R, typename ... Args>
+class shared_function_nc<R(Args...)>
+{
+public:
+    using result_type = R;
+
+    shared_function_nc() noexcept = default;
+
+    shared_function_nc(std::nullptr_t) noexcept
+    { }
+
+    // Create a shared_function_nc that owns a copy of function. Throws std::bad_alloc.
+    template <typename F, typename = std::enable_if_t<
+        !std::is_same_v<std::decay_t<F>, shared_function_nc> &&
+        std::is_invocable_r_v<R, std::decay_t<F>&, Args...>>>
+    shared_function_nc(F&& function);
+
+    shared_function_nc(const shared_function_nc& other) noexcept;
+    shared_function_nc(shared_function_nc&& other) noexcept;
+    ~shared_function_nc();
+
+    shared_function_nc& operator=(const shared_function_nc& other) noexcept;
+    shared_function_nc& operator=(shared_function_nc&& other) noexcept;
+
+    R operator()(Args ... args) const {
+#if BCH_SMART_PTR_DEBUG
+        assert(mHandle != nullptr);
+#endif
+        return mInvoke(mHandle, std::forward<Args>(args)...);
+    }
+
+    explicit operator bool() const noexcept {
+        return (mHandle != nullptr);
+    }
+
+    void reset() noexcept;
+
+    void swap(shared_function_nc& other) noexcept {
+        std::swap(mHandle, other.mHandle);
+        std::swap(mInvoke, other.mInvoke);
+    }
+
+    long use_count() const noexcept {
+        return (mHandle != nullptr) ? static_cast<long>(mHandle->use_count()) : 0;
+    }
+
+private:
+    typedef R (*Invoker)(detail::ControlBlock* handle, Args&& ... args);
+
+    detail::ControlBlock*   mHandle{nullptr};
+    Invoker                 mInvoke{nullptr};
+};
+
+template <typename Signature>
+struct is_trivially_relocatable<shared_function_nc<Signature>>: std::true_type {};
+
+// -----------------------------------------------------------------------------
+
+template <typename R, typename ... Args>
+template <typename F, typename>
+shared_function_nc<R(Args...)>::shared_function_nc(F&& function)
+{
+    typedef std::decay_t<F> Function;
+    typedef detail::ControlBlockFunction<Function, R, Args...> ControlBlockType;
+    static_assert(alignof(Function) <= alignof(std::max_align_t), "over-aligned callables are not supported");
+
+    void* const address = malloc(ControlBlockType::function_offset() + sizeof(Function));
+    if (address == nullptr)
+        throw std::bad_alloc();
+
+    // The callable is constructed first: the ControlBlockFunction constructor is noexcept
+    try
+    {
+        new (ControlBlockType::function(address)) Function(std::forward<F>(function));
+    }
+    catch (...)
+    {
+        free(address);
+        throw;
+    }
+
+    mHandle = new (address) ControlBlockType();
+    mInvoke = &ControlBlockType::invoke;
+}
+
+template <typename R, typename ... Args>
+inline
+shared_function_nc<R(Args...)>::shared_function_nc(const shared_function_nc& other) noexcept :
+    mHandle(other.mHandle),
+    mInvoke(other.mInvoke)
+{
+    if (mHandle != nullptr)
+        mHandle->add_shared();
+}
+
+template <typename R, typename ... Args>
+inline
+shared_function_nc<R(Args...)>::shared_function_nc(shared_function_nc&& other) noexcept :
+    mHandle(other.mHandle),
+    mInvoke(other.mInvoke)
+{
+    other.mHandle = nullptr;
+    other.mInvoke = nullptr;
+}
+
+template <typename R, typename ... Args>
+inline
+shared_function_nc<R(Args...)>::~shared_function_nc()
+{
+    if (mHandle != nullptr)
+        mHandle->release_shared();
+}
+
+template <typename R, typename ... Args>
+inline shared_function_nc<R(Args...)>&
+shared_function_nc<R(Args...)>::operator=(const shared_function_nc& other) noexcept
+{
+    shared_function_nc(other).swap(*this);
+    return *this;
+}
+
+template <typename R, typename ... Args>
+inline shared_function_nc<R(Args...)>&
+shared_function_nc<R(Args...)>::operator=(shared_function_nc&& other) noexcept
+{
+    shared_function_nc(std::move(other)).swap(*this);
+    return *this;
+}
+
+template <typename R, typename ... Args>
+inline void shared_function_nc<R(Args...)>::reset() noexcept
+{
+    shared_function_nc().swap(*this);
+}
+
+}   // namespace bch
+
+#include "bch/common/header_suffix.hpp"
+
+#endif  // BCH_SHARED_FUNCTION_NC
@@ -8,6 +8,7 @@ Copyright: Jesper Storm Bache (bache.name)
 #pragma once
 
 #include "bch/shared_ptr_nc/prefix.hpp"
+#include "bch/common/relocation.hpp"
 
 #include "bch/common/header_prefix.hpp"
 
@@ -25,6 +26,13 @@ has been released.
 template <typename T, typename ... Args>
 shared_ptr_nc<T> make_shared(Args&&...);
 
+/* Variation of make_shared that stores the reference counts out of line (in a
+separately allocated table). The memory of the instance is not written after
+construction.
+*/
+template <typename T, typename ... Args>
+shared_ptr_nc<T> make_shared_out_of_line(Args&&...);
+
 template<typename T, typename U>
 shared_ptr_nc<T> static_pointer_cast(const shared_ptr_nc<U>& ptr);
 
@@ -34,6 +42,16 @@ shared_ptr_nc<T> dynamic_pointer_cast(const shared_ptr_nc<U>& ptr);
 template<typename T, typename U>
 shared_ptr_nc<T> const_pointer_cast(const shared_ptr_nc<const U>& ptr);
 
+/* Variation of dynamic_pointer_cast that first compares T with the concrete type
+recorded in the control block (make_shared and the shared_ptr_nc constructors record
+the type). A cast to the concrete type costs a virtual call and a compare, and a
+failed cast to a final type compares the dynamic type (typeid). Other casts use
+dynamic_cast.
+Returns an empty pointer if the cast fails.
+*/
+template<typename T, typename U>
+shared_ptr_nc<T> fast_pointer_cast(const shared_ptr_nc<U>& ptr);
+
 /* non concurrent implementation of a shared_ptr
 */
 template <typename T>
@@ -50,18 +68,23 @@ public:
     template <typename U> shared_ptr_nc(shared_ptr_nc<U>&& ptr) noexcept;
     shared_ptr_nc(shared_ptr_nc&& ptr) noexcept;
 
-    ~shared_ptr_nc();
+    /* Aliasing constructor: share ownership with owner, but point to ptr (typically
+    a member of the instance owned by owner, or memory owned by it).
+    */
+    template <typename U> shared_ptr_nc(const shared_ptr_nc<U>& owner, T* ptr) noexcept;
+
+    constexpr ~shared_ptr_nc();
 
     shared_ptr_nc& operator=(const shared_ptr_nc& ptr) noexcept;
     template <typename U>
     shared_ptr_nc& operator=(const shared_ptr_nc<U>& ptr) noexcept;
 
-    shared_ptr_nc& operator=(shared_ptr_nc<T>&& ptr);
+    shared_ptr_nc& operator=(shared_ptr_nc<T>&& ptr) noexcept;
     template <typename U>
-    shared_ptr_nc<T>& operator=(shared_ptr_nc<U>&& ptr);
+    shared_ptr_nc<T>& operator=(shared_ptr_nc<U>&& ptr) noexcept;
 
     void swap(shared_ptr_nc& r) noexcept;
-    void reset();
+    void reset() noexcept;
     template <typename U>
     void reset(U* ptr);
 
@@ -86,7 +109,7 @@ public:
 #endif
 
 private:
-    explicit shared_ptr_nc(detail::ControlBlock* handle, T* ptr, bool increaseRefCount) noexcept;
+    constexpr explicit shared_ptr_nc(detail::ControlBlock* handle, T* ptr, bool increaseRefCount) noexcept;
 
     template <typename U>
     friend class weak_ptr;
@@ -106,9 +129,20 @@ private:
     template <typename U, typename V>
     friend shared_ptr_nc<U> const_pointer_cast(const shared_ptr_nc<const V>&);
 
+    template <typename U, typename V>
+    friend shared_ptr_nc<U> fast_pointer_cast(const shared_ptr_nc<V>&);
+
     template <typename U>
     friend class enable_shared_from_this;
 
+    template <typename U>
+    friend class enable_shared_from_this_inline;
+
+    template <typename U>
+    friend class borrowed_ptr;
+
+    friend struct detail::SharedPtrAccess;
+
     T*                      mPtr{nullptr};
     detail::ControlBlock*   mHandle{nullptr};
 };
@@ -126,6 +160,7 @@ public:
     template <typename U>
     weak_ptr(const weak_ptr<U>& ptr) noexcept;
 
+    weak_ptr(weak_ptr<T>&& ptr) noexcept;
     template <typename U>
     weak_ptr(weak_ptr<U>&& ptr) noexcept;
 
@@ -136,21 +171,21 @@ public:
     template <typename U>
     weak_ptr& operator=(const weak_ptr<U>& ptr) noexcept;
 
-    weak_ptr& operator=(weak_ptr<T>&& ptr);
+    weak_ptr& operator=(weak_ptr<T>&& ptr) noexcept;
     template <typename U>
-    weak_ptr& operator=(weak_ptr<U>&& ptr);
+    weak_ptr& operator=(weak_ptr<U>&& ptr) noexcept;
 
-    weak_ptr& operator=(const shared_ptr_nc<T>& ptr);
+    weak_ptr& operator=(const shared_ptr_nc<T>& ptr) noexcept;
 
     /* Create a shared_ptr_nc from the weak pointer. This method will return a
     shared_pointer containing a null pointer if the referenced instance has been
     delete (or if the weak_pointer originally was created from a null shared pointer).
     */
-    shared_ptr_nc<T> lock() const;
+    shared_ptr_nc<T> lock() const noexcept;
 
-    bool expired() const;
+    bool expired() const noexcept;
 
-    void reset() const;
+    void reset() const noexcept;
 
 #if BCH_SMART_PTR_UNITTEST
     std::uint32_t strong_count() const;
@@ -158,12 +193,86 @@ public:
 #endif
 
 private:
+    template <typename U>
+    friend class weak_ptr;
+
     void Assign(T* ptr, detail::ControlBlock* handle) noexcept;
 
     mutable T*                      mPtr{nullptr};
     mutable detail::ControlBlock*   mHandle{nullptr};
 };
 
+/* Non owning pointer to an instance that is managed by a shared_ptr_nc.
+borrowed_ptr is intended as a parameter type for methods that do not need to retain
+the instance past the function scope. Passing a shared_ptr_nc by value changes the
+reference count twice. Constructing, copying and destroying a borrowed_ptr does not
+change the reference count (in release builds the type is trivially copyable).
+If the callee needs to retain the instance, then it can use to_shared to create an
+owning pointer.
+
+The caller must ensure that the instance is alive while the borrowed_ptr is used.
+In debug builds (BCH_SMART_PTR_DEBUG) the borrowed_ptr holds a weak reference to the
+control block, and dereferencing validates that the instance is still alive.
+*/
+template <typename T>
+class borrowed_ptr
+{
+public:
+    constexpr borrowed_ptr() noexcept = default;
+    constexpr borrowed_ptr(std::nullptr_t) noexcept;
+
+    template <typename U>
+    borrowed_ptr(const shared_ptr_nc<U>& ptr) noexcept;
+    template <typename U>
+    borrowed_ptr(const borrowed_ptr<U>& ptr) noexcept;
+
+#if BCH_SMART_PTR_DEBUG
+    borrowed_ptr(const borrowed_ptr& ptr) noexcept;
+    ~borrowed_ptr();
+    borrowed_ptr& operator=(const borrowed_ptr& ptr) noexcept;
+#else
+    borrowed_ptr(const borrowed_ptr& ptr) noexcept = default;
+    ~borrowed_ptr() = default;
+    borrowed_ptr& operator=(const borrowed_ptr& ptr) noexcept = default;
+#endif
+
+    /* Create a shared pointer that shares ownership of the instance.
+    Returns a null pointer if the borrowed_ptr is null.
+    */
+    shared_ptr_nc<T> to_shared() const noexcept;
+
+    T* get() const noexcept;
+    T& operator*() const noexcept;
+    T* operator->() const noexcept;
+
+    explicit operator bool() const noexcept {
+        return (mPtr != nullptr);
+    }
+
+private:
+    template <typename U>
+    friend class borrowed_ptr;
+
+#if BCH_SMART_PTR_DEBUG
+    void validate() const noexcept;
+#endif
+
+    T*                      mPtr{nullptr};
+    detail::ControlBlock*   mHandle{nullptr};
+};
+
+/* The smart pointers do not store pointers to themselves, so they can be relocated
+with memcpy (see relocatable_vector).
+*/
+template <typename T>
+struct is_trivially_relocatable<shared_ptr_nc<T>>: std::true_type {};
+
+template <typename T>
+struct is_trivially_relocatable<weak_ptr<T>>: std::true_type {};
+
+template <typename T>
+struct is_trivially_relocatable<borrowed_ptr<T>>: std::true_type {};
+
 template <typename T>
 class enable_shared_from_this {
 public:
@@ -172,11 +281,29 @@ public:
 
 private:
     template <typename U>
-    friend void detail::set_shared_from_this(U* ptr, detail::ControlBlock* cb);
+    friend constexpr void detail::set_shared_from_this(U* ptr, detail::ControlBlock* cb);
 
     mutable detail::ControlBlock*   _shared_from_this_data{nullptr};
 };
 
+/* Variation of enable_shared_from_this that does not store a pointer to the control
+block in the instance. The control block is instead calculated from the address of
+the instance.
+This removes the pointer from the instance and ensures that the instance memory is
+never written by the smart pointer implementation.
+The instance must be created with make_shared<T> where T is the exact type of the
+instance. Creating a shared_ptr_nc from a raw pointer to such a type fails to compile.
+T cannot be over-aligned (alignof(T) <= alignof(std::max_align_t)).
+shared_from_this returns an empty pointer while the instance is constructed (from the
+constructor of T and the functions it calls) and while it is destroyed.
+*/
+template <typename T>
+class enable_shared_from_this_inline: private detail::SharedFromThisInlineBase {
+public:
+    shared_ptr_nc<T> shared_from_this();
+    shared_ptr_nc<const T> shared_from_this() const;
+};
+
 }   // namespace bch
 
 #include "bch/common/header_suffix.hpp"
@@ -0,0 +1,86 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#include "bch/compact_shared_ptr.hpp"
+
+#include <cstdlib>
+#include <mutex>
+#include <new>
+
+namespace {
+// Protects the region table
+std::mutex sRegionTableMutex;
+}   // namespace
+
+namespace bch {
+namespace detail {
+
+CompactRegionBase* CompactRegionBase::sRegions[CompactRegionBase::kMaxRegionCount];
+
+CompactRegionBase::CompactRegionBase(std::size_t slotSize, std::uint32_t capacity) :
+    mSlotSize(slotSize),
+    mCapacity(capacity)
+{
+    if ((capacity == 0) || (capacity == kNoSlot))
+        throw std::bad_alloc();
+
+    mSlots = static_cast<char*>(malloc(slotSize * capacity));
+    if (mSlots == nullptr)
+        throw std::bad_alloc();
+
+    std::lock_guard<std::mutex> lock(sRegionTableMutex);
+    for (std::uint32_t id = kNoRegion + 1; id < kMaxRegionCount; ++id)
+    {
+        if (sRegions[id] == nullptr)
+        {
+            sRegions[id] = this;
+            mId = id;
+            return;
+        }
+    }
+
+    free(mSlots);
+    throw std::bad_alloc();
+}
+
+CompactRegionBase::~CompactRegionBase()
+{
+    {
+        std::lock_guard<std::mutex> lock(sRegionTableMutex);
+        sRegions[mId] = nullptr;
+    }
+    free(mSlots);
+}
+
+std::uint32_t CompactRegionBase::allocate_slot()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    std::uint32_t index = mFreeList;
+    if (index != kNoSlot)
+    {
+        mFreeList = *static_cast<std::uint32_t*>(slot(index));
+    }
+    else
+    {
+        if (mUsedCount == mCapacity)
+            throw std::bad_alloc();
+        index = mUsedCount++;
+    }
+
+    ++mLiveCount;
+    return index;
+}
+
+void CompactRegionBase::release_slot(std::uint32_t index) noexcept
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    *static_cast<std::uint32_t*>(slot(index)) = mFreeList;
+    mFreeList = index;
+    --mLiveCount;
+}
+
+}   // namespace detail
+}   // namespace bch
@@ -0,0 +1,51 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#include "bch/deep_clone.hpp"
+
+namespace bch {
+
+clone_context::~clone_context()
+{
+    for (const auto& entry: mClones)
+    {
+        // Clones are also mapped to themselves; only the original entry holds references
+        if (entry.first.mHandle != entry.second.mHandle)
+        {
+            const_cast<detail::ControlBlock*>(entry.first.mHandle)->release_shared();
+            entry.second.mHandle->release_shared();
+        }
+    }
+}
+
+const clone_context::Clone* clone_context::find(const detail::ControlBlock* handle, const void* ptr) const noexcept
+{
+    if (handle == nullptr)
+        return nullptr;
+
+    const auto it = mClones.find(detail::InstanceKey{handle, ptr});
+    return (it != mClones.end()) ? &it->second : nullptr;
+}
+
+void clone_context::add(detail::ControlBlock* original, const void* originalPtr, detail::ControlBlock* clone, void* ptr)
+{
+    const Clone entry{clone, ptr};
+    const detail::InstanceKey originalKey{original, originalPtr};
+    mClones.emplace(originalKey, entry);
+    try
+    {
+        mClones.emplace(detail::InstanceKey{clone, ptr}, entry);
+    }
+    catch (...)
+    {
+        mClones.erase(originalKey);
+        throw;
+    }
+
+    original->add_shared();
+    clone->add_shared();
+    ++mCloneCount;
+}
+
+}   // namespace bch
@@ -0,0 +1,114 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#include "bch/expiry_listener.hpp"
+
+#include <cassert>
+#include <mutex>
+#include <unordered_map>
+
+namespace {
+
+// Protects the listener table and the listener lists
+std::mutex sExpiryMutex;
+
+typedef std::unordered_map<const bch::detail::ControlBlock*, bch::expiry_listener*> ListenerTable;
+
+// Head of the list of listeners of each control block with kExpiryFlag set
+ListenerTable& Listeners()
+{
+    static ListenerTable sListeners;
+    return sListeners;
+}
+
+}   // namespace
+
+namespace bch {
+
+expiry_listener::~expiry_listener()
+{
+    cancel();
+}
+
+void expiry_listener::listen(detail::ControlBlock* handle)
+{
+#if BCH_SMART_PTR_DEBUG
+    assert(handle != nullptr);
+#endif
+
+    cancel();
+    if (handle->is_immortal())
+        return;
+
+    std::lock_guard<std::mutex> lock(sExpiryMutex);
+    const auto result = Listeners().emplace(handle, this);
+    if (result.second)
+    {
+        handle->set_expiry_flag();
+    }
+    else
+    {
+        mNext = result.first->second;
+        mNext->mPrevious = this;
+        result.first->second = this;
+    }
+    mHandle = handle;
+}
+
+void expiry_listener::cancel() noexcept
+{
+    if (mHandle == nullptr)
+        return;
+
+    std::lock_guard<std::mutex> lock(sExpiryMutex);
+    unlink();
+}
+
+void expiry_listener::unlink() noexcept
+{
+    if (mPrevious != nullptr)
+    {
+        mPrevious->mNext = mNext;
+    }
+    else if (mNext != nullptr)
+    {
+        Listeners().find(mHandle)->second = mNext;
+    }
+    else
+    {
+        Listeners().erase(mHandle);
+        mHandle->clear_expiry_flag();
+    }
+
+    if (mNext != nullptr)
+        mNext->mPrevious = mPrevious;
+
+    mHandle = nullptr;
+    mPrevious = nullptr;
+    mNext = nullptr;
+}
+
+void detail::NotifyExpiry(ControlBlock* handle) noexcept
+{
+    /* Listeners are removed one at a time, and notified without the lock, so a
+    callback can register or cancel other listeners (including other listeners of
+    the same control block).
+    */
+    for (;;)
+    {
+        expiry_listener* listener = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(sExpiryMutex);
+            const auto it = Listeners().find(handle);
+            if (it == Listeners().end())
+                return;
+
+            listener = it->second;
+            listener->unlink();
+        }
+        listener->on_expired();
+    }
+}
+
+}   // namespace bch
@@ -0,0 +1,21 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#include "bch/future_nc.hpp"
+
+namespace bch {
+namespace detail {
+
+std::exception_ptr BrokenPromiseException()
+{
+    return std::make_exception_ptr(std::future_error(std::future_errc::broken_promise));
+}
+
+void ThrowFutureError(std::future_errc error)
+{
+    throw std::future_error(error);
+}
+
+}   // namespace detail
+}   // namespace bch
@@ -0,0 +1,204 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#include "bch/graph_serializer.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// "bchg" followed by the format version
+const std::uint32_t kMagic = 0x67686362;
+const std::uint32_t kVersion = 1;
+const std::uint32_t kNullReference = 0xFFFFFFFF;
+
+}   // namespace
+
+namespace bch {
+
+// -----------------------------------------------------------------------------
+
+shared_ptr_nc<const graph_image> graph_image::map(const char* path)
+{
+    const int file = open(path, O_RDONLY);
+    if (file < 0)
+        throw std::system_error(errno, std::generic_category(), path);
+
+    struct stat info;
+    if (fstat(file, &info) != 0)
+    {
+        const int error = errno;
+        close(file);
+        throw std::system_error(error, std::generic_category(), path);
+    }
+
+    const std::size_t size = static_cast<std::size_t>(info.st_size);
+    void* memory = nullptr;
+    if (size != 0)
+    {
+        memory = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+        if (memory == MAP_FAILED)
+        {
+            const int error = errno;
+            close(file);
+            throw std::system_error(error, std::generic_category(), path);
+        }
+    }
+    close(file);
+
+    try
+    {
+        return shared_ptr_nc<const graph_image>(new graph_image(static_cast<char*>(memory), size, true));
+    }
+    catch (...)
+    {
+        if (memory != nullptr)
+            munmap(memory, size);
+        throw;
+    }
+}
+
+shared_ptr_nc<const graph_image> graph_image::copy(const void* data, std::size_t size)
+{
+    char* const memory = static_cast<char*>(malloc((size != 0) ? size : 1));
+    if (memory == nullptr)
+        throw std::bad_alloc();
+    memcpy(memory, data, size);
+
+    try
+    {
+        return shared_ptr_nc<const graph_image>(new graph_image(memory, size, false));
+    }
+    catch (...)
+    {
+        free(memory);
+        throw;
+    }
+}
+
+graph_image::~graph_image()
+{
+    if (!mMapped)
+        free(mData);
+    else if (mData != nullptr)
+        munmap(mData, mSize);
+}
+
+// -----------------------------------------------------------------------------
+
+graph_writer::graph_writer()
+{
+    write_value(kMagic);
+    write_value(kVersion);
+}
+
+void graph_writer::write_bytes(const void* data, std::size_t size)
+{
+    const char* const bytes = static_cast<const char*>(data);
+    mImage.insert(mImage.end(), bytes, bytes + size);
+}
+
+void graph_writer::align(std::size_t alignment)
+{
+    const std::size_t padding = (alignment - (mImage.size() & (alignment - 1))) & (alignment - 1);
+    mImage.insert(mImage.end(), padding, 0);
+}
+
+bool graph_writer::write_reference(const detail::ControlBlock* handle, const void* ptr)
+{
+    if (handle == nullptr)
+    {
+        write_value(kNullReference);
+        return false;
+    }
+
+    const std::uint32_t newId = static_cast<std::uint32_t>(mIds.size());
+    const auto result = mIds.emplace(detail::InstanceKey{handle, ptr}, newId);
+    write_value(result.first->second);
+    return result.second;
+}
+
+void graph_writer::save(const char* path) const
+{
+    FILE* const file = fopen(path, "wb");
+    if (file == nullptr)
+        throw std::system_error(errno, std::generic_category(), path);
+
+    const bool written = (fwrite(mImage.data(), 1, mImage.size(), file) == mImage.size());
+    const int error = errno;
+    if ((fclose(file) != 0) || !written)
+        throw std::system_error(written ? errno : error, std::generic_category(), path);
+}
+
+// -----------------------------------------------------------------------------
+
+graph_reader::graph_reader(shared_ptr_nc<const graph_image> image) :
+    mImage(std::move(image))
+{
+    if (!mImage)
+        throw std::runtime_error("graph_reader: no image");
+
+    if ((read_value<std::uint32_t>() != kMagic) || (read_value<std::uint32_t>() != kVersion))
+        throw std::runtime_error("graph_reader: unsupported image");
+}
+
+graph_reader::~graph_reader()
+{
+    for (const Node& node: mNodes)
+    {
+        if (node.mHandle != nullptr)
+            node.mHandle->release_shared();
+    }
+}
+
+void graph_reader::read_bytes(void* data, std::size_t size)
+{
+    if (size > mImage->size() - mOffset)
+        throw std::runtime_error("graph_reader: truncated image");
+
+    memcpy(data, mImage->data() + mOffset, size);
+    mOffset += size;
+}
+
+std::uint32_t graph_reader::read_reference()
+{
+    const std::uint32_t id = read_value<std::uint32_t>();
+    if ((id != kNull) && (id > mNodes.size()))
+        throw std::runtime_error("graph_reader: invalid reference");
+    return id;
+}
+
+const char* graph_reader::align(std::size_t alignment, std::size_t size)
+{
+    const std::size_t padding = (alignment - (mOffset & (alignment - 1))) & (alignment - 1);
+    if ((padding > mImage->size() - mOffset) || (size > mImage->size() - mOffset - padding))
+        throw std::runtime_error("graph_reader: truncated image");
+
+    mOffset += padding;
+    return mImage->data() + mOffset;
+}
+
+const graph_reader::Node& graph_reader::node(std::uint32_t id) const
+{
+    const Node& result = mNodes[id];
+    if (result.mHandle == nullptr)
+        throw std::runtime_error("graph_reader: the graph has a cycle");
+    return result;
+}
+
+void graph_reader::add_node(std::size_t id, detail::ControlBlock* handle, const void* ptr) noexcept
+{
+    handle->add_shared();
+    mNodes[id].mHandle = handle;
+    mNodes[id].mPtr = const_cast<void*>(ptr);
+}
+
+}   // namespace bch
@@ -0,0 +1,107 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#include "bch/intern_table.hpp"
+
+#include <cstdlib>
+#include <new>
+
+namespace bch {
+namespace detail {
+
+namespace {
+
+const std::size_t kMinimumCapacity = 16;
+
+}   // namespace
+
+InternTableBase::~InternTableBase()
+{
+    if (mSlots == nullptr)
+        return;
+
+    for (std::size_t index = 0; index <= mMask; ++index)
+    {
+        if (mSlots[index].mHandle != nullptr)
+            mSlots[index].mHandle->mTable = nullptr;
+    }
+    free(mSlots);
+}
+
+void InternTableBase::reserve(std::size_t count)
+{
+    // The load factor is kept at or below 3/4, so probe sequences stay short
+    const std::size_t capacity = (mSlots != nullptr) ? mMask + 1 : 0;
+    if (count * 4 <= capacity * 3)
+        return;
+
+    std::size_t newCapacity = (capacity != 0) ? capacity * 2 : kMinimumCapacity;
+    while (count * 4 > newCapacity * 3)
+        newCapacity *= 2;
+
+    Slot* const slots = static_cast<Slot*>(calloc(newCapacity, sizeof(Slot)));
+    if (slots == nullptr)
+        throw std::bad_alloc();
+
+    Slot* const previous = mSlots;
+    mSlots = slots;
+    mMask = newCapacity - 1;
+    for (std::size_t index = 0; index < capacity; ++index)
+    {
+        if (previous[index].mHandle == nullptr)
+            continue;
+
+        std::size_t destination = home(previous[index].mHash);
+        while (mSlots[destination].mHandle != nullptr)
+            destination = next(destination);
+        mSlots[destination] = previous[index];
+    }
+    free(previous);
+}
+
+void InternTableBase::insert(ControlBlockInternedBase* handle) noexcept
+{
+    std::size_t index = home(handle->hash());
+    while (mSlots[index].mHandle != nullptr)
+        index = next(index);
+
+    mSlots[index].mHash = handle->hash();
+    mSlots[index].mHandle = handle;
+    ++mSize;
+}
+
+void InternTableBase::remove(const ControlBlockInternedBase* handle) noexcept
+{
+    std::size_t index = home(handle->hash());
+    while (mSlots[index].mHandle != handle)
+        index = next(index);
+
+    /* Backward shift deletion: move later slots of the probe sequence into the hole,
+    so lookups never need tombstones.
+    */
+    std::size_t candidate = index;
+    for (;;)
+    {
+        candidate = next(candidate);
+        if (mSlots[candidate].mHandle == nullptr)
+            break;
+
+        // A slot may move to the hole if its home is not in (hole, candidate]
+        const std::size_t candidateHome = home(mSlots[candidate].mHash);
+        const bool homeInRange = (index <= candidate) ?
+            ((candidateHome > index) && (candidateHome <= candidate)) :
+            ((candidateHome > index) || (candidateHome <= candidate));
+        if (!homeInRange)
+        {
+            mSlots[index] = mSlots[candidate];
+            index = candidate;
+        }
+    }
+
+    mSlots[index].mHandle = nullptr;
+    --mSize;
+}
+
+}   // namespace detail
+}   // namespace bch
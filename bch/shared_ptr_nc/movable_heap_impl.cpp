@@ -0,0 +1,233 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#include "bch/movable_shared_ptr.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <new>
+
+#include <sys/mman.h>
+
+namespace {
+
+const std::uint32_t kNoSlot = 0xFFFFFFFF;
+
+/* Map kPageSize bytes at a kPageSize aligned address. mmap only aligns to the system
+page size, so we map twice the size and unmap the unaligned head and tail.
+*/
+void* MapPage()
+{
+    const std::size_t pageSize = bch::detail::MovableHeapBase::kPageSize;
+    const std::size_t size = 2 * pageSize;
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (memory == MAP_FAILED)
+        throw std::bad_alloc();
+
+    const std::uintptr_t start = reinterpret_cast<std::uintptr_t>(memory);
+    const std::uintptr_t aligned = (start + pageSize - 1) & ~static_cast<std::uintptr_t>(pageSize - 1);
+    if (aligned != start)
+        munmap(memory, aligned - start);
+    const std::uintptr_t end = aligned + pageSize;
+    if (end != start + size)
+        munmap(reinterpret_cast<void*>(end), (start + size) - end);
+
+    return reinterpret_cast<void*>(aligned);
+}
+
+void UnmapPage(void* page)
+{
+    munmap(page, bch::detail::MovableHeapBase::kPageSize);
+}
+
+}   // namespace
+
+namespace bch {
+namespace detail {
+
+/* Header at the start of each page. The slots follow the header.
+A used slot starts with the address of the control block of its instance.
+A free slot starts with (index of the next free slot << 1) | 1. Control block
+addresses are aligned, so the low bit distinguishes the two.
+*/
+struct MovableHeapBase::Page
+{
+    std::uint32_t   mLiveCount{0};
+    // Number of slots that have been handed out (including released slots)
+    std::uint32_t   mUsedCount{0};
+    // Head of the list of released slots
+    std::uint32_t   mFreeList{kNoSlot};
+};
+
+namespace {
+
+std::size_t AlignUp(std::size_t value, std::size_t alignment)
+{
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+const std::size_t kOwnerSize = sizeof(ControlBlockMovableBase*);
+
+}   // namespace
+
+MovableHeapBase::MovableHeapBase(std::size_t objectSize, std::size_t objectAlignment, MoveFunction move) :
+    mMove(move)
+{
+    const std::size_t alignment = std::max(objectAlignment, alignof(ControlBlockMovableBase*));
+    mObjectOffset = AlignUp(kOwnerSize, objectAlignment);
+    mSlotSize = AlignUp(mObjectOffset + objectSize, alignment);
+
+    const std::size_t firstSlot = AlignUp(sizeof(Page), alignment);
+    if (firstSlot + mSlotSize > kPageSize)
+        throw std::bad_alloc();
+    mSlotsPerPage = static_cast<std::uint32_t>((kPageSize - firstSlot) / mSlotSize);
+}
+
+MovableHeapBase::~MovableHeapBase()
+{
+#if BCH_SMART_PTR_DEBUG
+    // All pointers to the instances of the heap must have been released
+    assert(mLiveCount == 0);
+#endif
+
+    for (Page* page: mPages)
+        UnmapPage(page);
+}
+
+MovableHeapBase::Page* MovableHeapBase::page(void* object) const noexcept
+{
+    return reinterpret_cast<Page*>(reinterpret_cast<std::uintptr_t>(object) & ~static_cast<std::uintptr_t>(kPageSize - 1));
+}
+
+char* MovableHeapBase::slot(Page* page, std::uint32_t index) const noexcept
+{
+    const std::size_t firstSlot = kPageSize - (mSlotsPerPage * mSlotSize);
+    return reinterpret_cast<char*>(page) + firstSlot + (index * mSlotSize);
+}
+
+std::uint32_t MovableHeapBase::slot_index(Page* page, void* object) const noexcept
+{
+    const std::size_t firstSlot = kPageSize - (mSlotsPerPage * mSlotSize);
+    const std::size_t offset = static_cast<std::size_t>(static_cast<char*>(object) - reinterpret_cast<char*>(page));
+    return static_cast<std::uint32_t>((offset - firstSlot - mObjectOffset) / mSlotSize);
+}
+
+void* MovableHeapBase::page_allocate(Page* page) noexcept
+{
+    std::uint32_t index = page->mFreeList;
+    if (index != kNoSlot)
+    {
+        const std::uintptr_t next = *reinterpret_cast<std::uintptr_t*>(slot(page, index));
+        page->mFreeList = static_cast<std::uint32_t>(next >> 1);
+    }
+    else
+    {
+#if BCH_SMART_PTR_DEBUG
+        assert(page->mUsedCount < mSlotsPerPage);
+#endif
+        index = page->mUsedCount++;
+    }
+
+    ++page->mLiveCount;
+    char* const address = slot(page, index);
+    *reinterpret_cast<std::uintptr_t*>(address) = 0;
+    return address + mObjectOffset;
+}
+
+void MovableHeapBase::page_release(Page* page, void* object) noexcept
+{
+    const std::uint32_t index = slot_index(page, object);
+    *reinterpret_cast<std::uintptr_t*>(slot(page, index)) = (static_cast<std::uintptr_t>(page->mFreeList) << 1) | 1;
+    page->mFreeList = index;
+    --page->mLiveCount;
+}
+
+void* MovableHeapBase::allocate_slot()
+{
+    if ((mAllocationPage == nullptr) || (mAllocationPage->mLiveCount == mSlotsPerPage))
+    {
+        mAllocationPage = nullptr;
+        for (Page* page: mPages)
+        {
+            if (page->mLiveCount < mSlotsPerPage)
+            {
+                mAllocationPage = page;
+                break;
+            }
+        }
+
+        if (mAllocationPage == nullptr)
+        {
+            mPages.reserve(mPages.size() + 1);
+            mAllocationPage = new (MapPage()) Page();
+            mPages.push_back(mAllocationPage);
+        }
+    }
+
+    ++mLiveCount;
+    return page_allocate(mAllocationPage);
+}
+
+void MovableHeapBase::release_slot(void* object) noexcept
+{
+    page_release(page(object), object);
+    --mLiveCount;
+}
+
+void MovableHeapBase::set_owner(void* object, ControlBlockMovableBase* owner) noexcept
+{
+    *reinterpret_cast<ControlBlockMovableBase**>(static_cast<char*>(object) - mObjectOffset) = owner;
+}
+
+std::size_t MovableHeapBase::compact()
+{
+    // Most used pages first. Instances are moved from the back to the front.
+    std::stable_sort(mPages.begin(), mPages.end(), [](const Page* lhs, const Page* rhs) {
+        return lhs->mLiveCount > rhs->mLiveCount;
+    });
+
+    std::size_t destination = 0;
+    std::size_t source = mPages.size();
+    while (source > destination + 1)
+    {
+        --source;
+        Page* const sourcePage = mPages[source];
+        for (std::uint32_t index = 0; (index < sourcePage->mUsedCount) && (sourcePage->mLiveCount != 0); ++index)
+        {
+            char* const sourceSlot = slot(sourcePage, index);
+            const std::uintptr_t owner = *reinterpret_cast<std::uintptr_t*>(sourceSlot);
+            if ((owner & 1) != 0)
+                continue;
+
+            while ((destination < source) && (mPages[destination]->mLiveCount == mSlotsPerPage))
+                ++destination;
+            if (destination == source)
+                break;
+
+            void* const sourceObject = sourceSlot + mObjectOffset;
+            void* const destinationObject = page_allocate(mPages[destination]);
+            mMove(destinationObject, sourceObject);
+
+            ControlBlockMovableBase* const cb = reinterpret_cast<ControlBlockMovableBase*>(owner);
+            cb->mObject = destinationObject;
+            set_owner(destinationObject, cb);
+            page_release(sourcePage, sourceObject);
+        }
+    }
+
+    // Unmap the empty pages
+    const auto empty = std::stable_partition(mPages.begin(), mPages.end(), [](const Page* page) {
+        return page->mLiveCount != 0;
+    });
+    const std::size_t released = static_cast<std::size_t>(mPages.end() - empty);
+    for (auto it = empty; it != mPages.end(); ++it)
+        UnmapPage(*it);
+    mPages.erase(empty, mPages.end());
+
+    mAllocationPage = nullptr;
+    return released;
+}
+
+}   // namespace detail
+}   // namespace bch
@@ -11,7 +11,9 @@ Copyright: Jesper Storm Bache (bache.name)
 #include <cstdint>
 #include <cstddef>
 #include <stdlib.h>
+#include <functional>
 #include <memory>
+#include <type_traits>
 
 #include "bch/common/header_prefix.hpp"
 
@@ -24,6 +26,77 @@ template <typename T, typename ... Args>
 shared_ptr_nc<T> make_shared(Args&&...);
 
 namespace detail {
+
+/* Compact identifier of a type that does not use RTTI: the address of a variable
+that exists once per type. The variable is not const, so the linker cannot merge the
+tags of different types (identical code folding merges identical constants).
+*/
+typedef const void* TypeId;
+
+template <typename T>
+struct TypeTag
+{
+    inline static char sTag;
+};
+
+template <typename T>
+constexpr TypeId type_id() noexcept
+{
+    return &TypeTag<std::remove_cv_t<T>>::sTag;
+}
+
+/* Managed instance of a control block and the type id of its concrete type (see
+ControlBlock::concrete_instance).
+*/
+struct ConcreteInstance
+{
+    TypeId  mType;
+    void*   mInstance;
+};
+
+/* Reference counts of a control block that stores its counts out of line.
+*/
+struct RefCountEntry
+{
+    std::uint32_t   mStrong;
+    std::uint32_t   mWeak;
+};
+
+/* Dense table of reference counts indexed by a compact 32 bit handle.
+The table is used by control blocks created with make_shared_out_of_line. Moving the
+counts out of the allocation of the instance ensures that the memory of the instance
+(and the control block) is not written after construction.
+The table is allocated in chunks that never move, so a lookup does not need a lock.
+Allocating and releasing entries is thread safe.
+*/
+class RefCountTable
+{
+public:
+    /* Allocate an entry with a strong count of 1 and a weak count of 0.
+    Throws std::bad_alloc if the table is exhausted.
+    */
+    static std::uint32_t allocate();
+
+    static void release(std::uint32_t index) noexcept;
+
+    static RefCountEntry& entry(std::uint32_t index) noexcept {
+        return sChunks[index >> kChunkBits][index & kChunkMask];
+    }
+
+#if BCH_SMART_PTR_UNITTEST
+    /// Number of allocated entries
+    static std::uint32_t live_entry_count() noexcept;
+#endif
+
+private:
+    static constexpr std::uint32_t kChunkBits = 14;
+    static constexpr std::uint32_t kChunkSize = 1 << kChunkBits;
+    static constexpr std::uint32_t kChunkMask = kChunkSize - 1;
+    static constexpr std::uint32_t kChunkCount = 1 << 14;
+
+    static RefCountEntry*   sChunks[kChunkCount];
+};
+
 /* Shared data that manages the lifetime of a shared instance.
 The class holds a strong and a weak reference count.
 Rules:
@@ -36,16 +109,38 @@ Rules:
     If make_shared was used, then the memory of the control block and the instance
     is shared, and we cannot delete the memory until the control block can be deleted.
 - When the strong and the weak reference count reaches 0, then the control block
-    memory is released.
+    memory is released (by on_zero_weak).
+- Strong reference counts >= kReservedCount are reserved:
+    - An immortal control block has the strong reference count kImmortalCount.
+        Changes to the reference counts of an immortal control block are ignored, and
+        the managed instance is never destroyed. See immortal.hpp.
+    - A control block with the strong reference count kOutOfLineCount stores its
+        counts in the RefCountTable, and mWeak holds the index of the table entry.
+        See make_shared_out_of_line.
+- The weak reference count bit kExpiryFlag is set while expiry listeners are
+    registered for the control block. The bit counts as a weak reference, and the
+    listeners are notified after on_zero_shared. See expiry_listener.hpp.
 */
 class ControlBlock
 {
 public:
+    // Reserved strong reference count for immortal control blocks
+    static constexpr std::uint32_t kImmortalCount = 0xFFFFFFFF;
+    // Reserved strong reference count for control blocks with out of line counts
+    static constexpr std::uint32_t kOutOfLineCount = 0xFFFFFFFE;
+    // Strong reference counts from this value are reserved
+    static constexpr std::uint32_t kReservedCount = kOutOfLineCount;
+    // Weak reference count bit that marks control blocks with expiry listeners
+    static constexpr std::uint32_t kExpiryFlag = 0x80000000;
+
     virtual ~ControlBlock() = default;
 
     // Increase the strong reference count
     void add_shared() noexcept;
 
+    // Increase the strong reference count by count (a single write for count references)
+    void add_shared(std::uint32_t count) noexcept;
+
     /* Decrease the strong reference count. If the reference count reaches 0, then
     we invoke the destructor of the provided ptr and optionally release its memory
     (depending on whether or not we are sharing memory between the control block
@@ -58,6 +153,11 @@ public:
     */
     void release_shared();
 
+    /* Decrease the strong reference count by count. Used to release count
+    references with a single write.
+    */
+    void release_shared(std::uint32_t count);
+
     // Increase the weak reference count
     void add_weak() noexcept;
 
@@ -72,8 +172,58 @@ public:
     // Return true if the strong reference count is > 0
     bool has_shared_references() const noexcept;
 
+    // Return true if reference count changes are ignored
+    bool is_immortal() const noexcept {
+        return (mStrong == kImmortalCount);
+    }
+
+    // Return true if the reference counts are stored in the RefCountTable
+    bool is_out_of_line() const noexcept {
+        return (mStrong == kOutOfLineCount);
+    }
+
+    /* Move the reference counts to the RefCountTable. Must be invoked when the
+    control block is created (before the control block is shared).
+    Throws std::bad_alloc if an entry cannot be allocated (the control block is
+    then unchanged).
+    */
+    void move_counts_out_of_line();
+
+    /* Set or clear kExpiryFlag. Invoked by the expiry listener table (with its lock
+    held). The flag is ignored for immortal control blocks.
+    */
+    void set_expiry_flag() noexcept;
+    void clear_expiry_flag() noexcept;
+
     std::uint32_t use_count() const {
-        return mStrong;
+        return is_out_of_line() ? RefCountTable::entry(mWeak).mStrong : mStrong;
+    }
+
+    /* A pending control block is constructed before its instance (see make_shared)
+    with a strong reference count of 0, so shared_from_this returns an empty pointer
+    while the instance is constructed. activate sets the count to 1 once the instance
+    exists.
+    */
+    struct PendingTag {};
+
+    void activate() noexcept {
+#if BCH_SMART_PTR_DEBUG
+        assert(mStrong == 0);
+#endif
+        mStrong = 1;
+    }
+
+    /* Release a pending control block that is not activated (for example because the
+    constructor of its instance threw). Releases the memory of the control block.
+    */
+    void release_pending() noexcept;
+
+    /* Return the managed instance and its concrete type, as created by make_shared or
+    by a shared_ptr_nc constructor (see fast_pointer_cast). Returns {nullptr, nullptr}
+    for control blocks that do not record the type.
+    */
+    virtual ConcreteInstance concrete_instance() const noexcept {
+        return ConcreteInstance{nullptr, nullptr};
     }
 
 #if BCH_SMART_PTR_UNITTEST
@@ -86,8 +236,24 @@ public:
 protected:
     ControlBlock() noexcept;
 
+    explicit ControlBlock(PendingTag) noexcept;
+
+    /* Constructor for immortal control blocks. The constructor can be evaluated at
+    compile time. Immortal control blocks are not included in live_instance_count.
+    */
+    struct ImmortalTag {};
+    constexpr explicit ControlBlock(ImmortalTag) noexcept :
+        mStrong(kImmortalCount)
+    { }
+
     virtual void on_zero_shared() = 0;
 
+    /* Invoked when both reference counts have reached 0. Destroys the control block
+    and releases its memory. Control blocks that are not allocated with malloc
+    override this to return the memory to their allocator (see compact_region).
+    */
+    virtual void on_zero_weak() noexcept;
+
 private:
     ControlBlock(const ControlBlock&) = delete;
     ControlBlock(ControlBlock&&) = delete;
@@ -96,6 +262,14 @@ private:
 
     void adjust() noexcept;
 
+    // Address of the weak reference count (nullptr for immortal control blocks)
+    std::uint32_t* weak_count_address() noexcept;
+
+    // Return true for immortal and out of line control blocks
+    bool has_reserved_count() const noexcept {
+        return (mStrong >= kReservedCount);
+    }
+
     /* Reference count.
     Performance for changing the reference count is on the order of 100,000,000 per second.
     The size of the control block is around 10 bytes depending on the ref count data type.
@@ -127,6 +301,11 @@ private:
 #endif
 };
 
+/* Notify the expiry listeners of handle, and clear its kExpiryFlag.
+Invoked by ControlBlock::release_shared after on_zero_shared.
+*/
+void NotifyExpiry(ControlBlock* handle) noexcept;
+
 inline ControlBlock::
 ControlBlock() noexcept
 {
@@ -135,71 +314,219 @@ ControlBlock() noexcept
 #endif
 }
 
+inline ControlBlock::
+ControlBlock(PendingTag) noexcept :
+    mStrong(0)
+{
+#if BCH_SMART_PTR_UNITTEST
+    register_cb_ctor();
+#endif
+}
+
 inline void ControlBlock::
 add_shared() noexcept
 {
+    std::uint32_t* strong = &mStrong;
+    if (has_reserved_count())
+    {
+        if (is_immortal())
+            return;
+        strong = &RefCountTable::entry(mWeak).mStrong;
+    }
+
 #if BCH_SMART_PTR_DEBUG
-    assert(mStrong > 0);
+    assert(*strong > 0);
 #endif
 
-    ++mStrong;
+    ++*strong;
 
 #if BCH_SMART_PTR_DEBUG
     // If we reach 1M references to the same instance, then something is likely to be wrong.
-    assert(mStrong < 1000000);
+    assert(*strong < 1000000);
+#endif
+}
+
+inline void ControlBlock::
+add_shared(std::uint32_t count) noexcept
+{
+    std::uint32_t* strong = &mStrong;
+    if (has_reserved_count())
+    {
+        if (is_immortal())
+            return;
+        strong = &RefCountTable::entry(mWeak).mStrong;
+    }
+
+#if BCH_SMART_PTR_DEBUG
+    assert(*strong > 0);
+#endif
+
+    *strong += count;
+
+#if BCH_SMART_PTR_DEBUG
+    assert(*strong < 1000000);
 #endif
 }
 
 inline bool ControlBlock::
 has_shared_references() const noexcept
 {
-    return (mStrong > 0);
+    return (use_count() > 0);
 }
 
 inline void ControlBlock::
 add_weak() noexcept
 {
-    ++mWeak;
+    std::uint32_t* weak = &mWeak;
+    if (has_reserved_count())
+    {
+        if (is_immortal())
+            return;
+        weak = &RefCountTable::entry(mWeak).mWeak;
+    }
+
+    ++*weak;
 
 #if BCH_SMART_PTR_DEBUG
     // If we reach 1M references to the same instance, then something is likely to be wrong.
-    assert(mWeak < 1000000);
+    assert((*weak & ~kExpiryFlag) < 1000000);
 #endif
 }
 
 inline void ControlBlock::
 release_shared()
 {
-    if (--mStrong == 0)
+    std::uint32_t* strong = &mStrong;
+    std::uint32_t* weak = &mWeak;
+    if (has_reserved_count())
+    {
+        if (is_immortal())
+            return;
+        RefCountEntry& entry = RefCountTable::entry(mWeak);
+        strong = &entry.mStrong;
+        weak = &entry.mWeak;
+    }
+
+    if (--*strong == 0)
     {
         // temp weak ptr around releasing the shared ptr. This is to ensure that
         // the control block is kept alive during the dtor call.
         // If the dtor tries to lock a weak ptr to self, then we would otherwise
         // delete the control block inside the call to on_zero_shared
         
-        ++mWeak;
+        ++*weak;
         // TODO: Not exception safe - but std spec says that if the dtor throws
         // then functionality of standard library is undefined.
         on_zero_shared();
-        --mWeak;
+        // Expiry listeners are notified after the instance has been destroyed
+        if ((*weak & kExpiryFlag) != 0)
+            NotifyExpiry(this);
+        --*weak;
         
         adjust();
     }
 }
 
+inline void ControlBlock::
+release_shared(std::uint32_t count)
+{
+    if (count == 0)
+        return;
+
+    std::uint32_t* strong = &mStrong;
+    if (has_reserved_count())
+    {
+        if (is_immortal())
+            return;
+        strong = &RefCountTable::entry(mWeak).mStrong;
+    }
+
+#if BCH_SMART_PTR_DEBUG
+    assert(*strong >= count);
+#endif
+
+    // Release all but the last reference here; the last reference is released
+    // by release_shared, which destroys the instance when the count reaches 0.
+    *strong -= (count - 1);
+    release_shared();
+}
+
 inline void ControlBlock::
 release_weak() noexcept
 {
-    if (--mWeak == 0)
+    std::uint32_t* weak = &mWeak;
+    if (has_reserved_count())
+    {
+        if (is_immortal())
+            return;
+        weak = &RefCountTable::entry(mWeak).mWeak;
+    }
+
+    if (--*weak == 0)
         adjust();
 }
 
+inline std::uint32_t* ControlBlock::
+weak_count_address() noexcept
+{
+    if (has_reserved_count())
+    {
+        if (is_immortal())
+            return nullptr;
+        return &RefCountTable::entry(mWeak).mWeak;
+    }
+    return &mWeak;
+}
+
+inline void ControlBlock::
+set_expiry_flag() noexcept
+{
+    std::uint32_t* const weak = weak_count_address();
+    if (weak == nullptr)
+        return;
+
+#if BCH_SMART_PTR_DEBUG
+    assert((*weak & kExpiryFlag) == 0);
+#endif
+    *weak |= kExpiryFlag;
+}
+
+inline void ControlBlock::
+clear_expiry_flag() noexcept
+{
+    std::uint32_t* const weak = weak_count_address();
+    if (weak == nullptr)
+        return;
+
+#if BCH_SMART_PTR_DEBUG
+    assert((*weak & kExpiryFlag) != 0);
+#endif
+    // The caller holds a strong or a weak reference, so the count does not reach 0
+    *weak &= ~kExpiryFlag;
+}
+
+inline void ControlBlock::
+move_counts_out_of_line()
+{
+#if BCH_SMART_PTR_DEBUG
+    assert(mStrong == 1 && mWeak == 0);
+#endif
+
+    mWeak = RefCountTable::allocate();
+    mStrong = kOutOfLineCount;
+}
+
 template <typename T>
 class ControlBlockDeleter: public ControlBlock
 {
 public:
     static ControlBlockDeleter* Create(T* ptr);
 
+    virtual ConcreteInstance concrete_instance() const noexcept
+    {
+        return ConcreteInstance{type_id<T>(), const_cast<std::remove_cv_t<T>*>(mPtr)};
+    }
+
 protected:
     virtual void on_zero_shared()
     {
@@ -239,6 +566,17 @@ public:
         assert(mPtr != nullptr);
     }
 
+    // Pending control block of the instance that will be constructed at ptr
+    ControlBlockDeleterInlineData(T* ptr, PendingTag tag) noexcept :
+        ControlBlock(tag),
+        mPtr(ptr)
+    { }
+
+    virtual ConcreteInstance concrete_instance() const noexcept
+    {
+        return ConcreteInstance{type_id<T>(), const_cast<std::remove_cv_t<T>*>(mPtr)};
+    }
+
 protected:
     virtual void on_zero_shared()
     {
@@ -254,12 +592,99 @@ private:
     T*      mPtr;
 };
 
+/* Control block for an instance that is never destroyed.
+The control block is embedded in bch::immortal together with the instance, so no
+heap allocation is needed and the control block can be constructed at compile time.
+*/
+class ControlBlockImmortal: public ControlBlock
+{
+public:
+    constexpr ControlBlockImmortal() noexcept :
+        ControlBlock(ImmortalTag())
+    { }
+
+protected:
+    virtual void on_zero_shared()
+    {
+        // Never invoked: the strong reference count of an immortal never changes
+        assert(false);
+    }
+
+private:
+    ControlBlockImmortal(const ControlBlockImmortal&) = delete;
+    ControlBlockImmortal(ControlBlockImmortal&&) = delete;
+    ControlBlockImmortal& operator=(const ControlBlockImmortal&) = delete;
+    ControlBlockImmortal& operator=(ControlBlockImmortal&&) = delete;
+};
+
 /** shared_from_this support.
 In this case a tracked instance will store a pointer to its control block in
 a base class.
-set_shared_from_this is used to update this association */
+set_shared_from_this is used to create this association. It is invoked once when
+the instance is first owned by a control block (and not when a shared pointer is
+copied or cast) to avoid writing to the instance memory */
 template <typename T>
-void set_shared_from_this(T* ptr, detail::ControlBlock* cb);
+constexpr void set_shared_from_this(T* ptr, detail::ControlBlock* cb);
+
+/** Return the control block of an instance that was created by make_shared.
+make_shared places the control block at a fixed offset in front of the instance,
+so the control block can be calculated from the instance address.
+This is used by enable_shared_from_this_inline and is only valid for instances that
+were created with make_shared<T> (where T is the exact type of the instance) */
+template <typename T>
+ControlBlock* inline_control_block(T* ptr) noexcept;
+
+/* Access to the internals of shared_ptr_nc for bch extensions that manage the
+reference counts directly (for example ref_scope).
+The methods are defined in suffix.hpp.
+*/
+struct SharedPtrAccess
+{
+    template <typename T>
+    static ControlBlock* handle(const shared_ptr_nc<T>& ptr) noexcept;
+
+    /* Create a shared pointer from a control block and an instance pointer. If
+    increaseRefCount is false, then the caller transfers a strong reference to the
+    returned pointer.
+    */
+    template <typename T>
+    static constexpr shared_ptr_nc<T> make(ControlBlock* handle, T* ptr, bool increaseRefCount) noexcept;
+
+    /* Reset ptr without releasing its strong reference. The caller takes over the
+    reference (of the control block returned by handle).
+    */
+    template <typename T>
+    static void detach(shared_ptr_nc<T>& ptr) noexcept;
+};
+
+/* Identity of a shared instance: its control block and its address. Several
+instances can share a control block (an aliasing pointer to a member, or the
+instances that are stored in one allocation), so the control block alone does not
+identify an instance.
+*/
+struct InstanceKey
+{
+    const ControlBlock* mHandle;
+    const void*         mPtr;
+
+    bool operator==(const InstanceKey& other) const noexcept {
+        return (mHandle == other.mHandle) && (mPtr == other.mPtr);
+    }
+};
+
+struct InstanceKeyHash
+{
+    std::size_t operator()(const InstanceKey& key) const noexcept {
+        const std::size_t handleHash = std::hash<const void*>()(key.mHandle);
+        return handleHash ^ (std::hash<const void*>()(key.mPtr) + 0x9e3779b9 + (handleHash << 6) + (handleHash >> 2));
+    }
+};
+
+/* Base class of enable_shared_from_this_inline. Used to detect types that locate
+their control block from the instance address. */
+class SharedFromThisInlineBase
+{
+};
 
 }   // namespace detail
 }   //namespace bch
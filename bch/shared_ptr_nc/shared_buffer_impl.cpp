@@ -0,0 +1,136 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#include "bch/shared_buffer_nc.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+namespace bch {
+
+shared_buffer_nc shared_buffer_nc::allocate(std::size_t size)
+{
+    typedef detail::ControlBlockBuffer ControlBlockType;
+
+    if (size == 0)
+        return shared_buffer_nc();
+
+    if (size > static_cast<std::size_t>(-1) - ControlBlockType::data_offset())
+        throw std::bad_alloc();
+
+    void* const address = malloc(ControlBlockType::data_offset() + size);
+    if (address == nullptr)
+        throw std::bad_alloc();
+
+    ControlBlockType* const handle = new (address) ControlBlockType();
+    return shared_buffer_nc(handle, handle->data(), size);
+}
+
+shared_buffer_nc shared_buffer_nc::copy(const void* data, std::size_t size)
+{
+    shared_buffer_nc result = allocate(size);
+    if (size != 0)
+        memcpy(result.mData, data, size);
+    return result;
+}
+
+// -----------------------------------------------------------------------------
+
+void buffer_chain::append(shared_buffer_nc buffer)
+{
+    if (buffer.empty())
+        return;
+
+    const std::size_t size = buffer.size();
+    mBuffers.push_back(std::move(buffer));
+    mSize += size;
+}
+
+void buffer_chain::append(const buffer_chain& other)
+{
+    mBuffers.reserve(mBuffers.size() + other.buffer_count());
+    for (std::size_t index = 0; index < other.buffer_count(); ++index)
+        append(other.buffer(index));
+}
+
+void buffer_chain::consume(std::size_t count) noexcept
+{
+#if BCH_SMART_PTR_DEBUG
+    assert(count <= mSize);
+#endif
+
+    mSize -= count;
+    while (count != 0)
+    {
+        shared_buffer_nc& front = mBuffers[mFront];
+        if (count < front.size())
+        {
+            front.remove_prefix(count);
+            break;
+        }
+
+        count -= front.size();
+        front.reset();
+        ++mFront;
+    }
+
+    // Remove the consumed buffers when they are at least half of the buffers
+    if (mFront * 2 >= mBuffers.size())
+    {
+        mBuffers.erase(mBuffers.begin(), mBuffers.begin() + mFront);
+        mFront = 0;
+    }
+}
+
+buffer_chain buffer_chain::split(std::size_t count)
+{
+#if BCH_SMART_PTR_DEBUG
+    assert(count <= mSize);
+#endif
+
+    buffer_chain result;
+    std::size_t remaining = count;
+    for (std::size_t index = mFront; remaining != 0; ++index)
+    {
+        const shared_buffer_nc& current = mBuffers[index];
+        const std::size_t size = (remaining < current.size()) ? remaining : current.size();
+        result.append(current.slice(0, size));
+        remaining -= size;
+    }
+
+    consume(count);
+    return result;
+}
+
+int buffer_chain::to_iovec(iovec* vectors, std::size_t maxCount) const noexcept
+{
+    std::size_t count = buffer_count();
+    if (count > maxCount)
+        count = maxCount;
+
+    for (std::size_t index = 0; index < count; ++index)
+        vectors[index] = buffer(index).to_iovec();
+    return static_cast<int>(count);
+}
+
+void buffer_chain::copy_to(void* destination) const noexcept
+{
+    char* address = static_cast<char*>(destination);
+    for (std::size_t index = mFront; index < mBuffers.size(); ++index)
+    {
+        const shared_buffer_nc& current = mBuffers[index];
+        memcpy(address, current.data(), current.size());
+        address += current.size();
+    }
+}
+
+void buffer_chain::clear() noexcept
+{
+    mBuffers.clear();
+    mFront = 0;
+    mSize = 0;
+}
+
+}   // namespace bch
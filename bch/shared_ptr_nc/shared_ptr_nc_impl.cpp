@@ -4,6 +4,9 @@ Copyright: Jesper Storm Bache (bache.name)
 
 #include "bch/shared_ptr_nc.hpp"
 
+#include <mutex>
+#include <new>
+
 #if BCH_SMART_PTR_UNITTEST
 #include <atomic>
 #endif
@@ -15,9 +18,79 @@ std::atomic_ulong sCBInstanceCount;
 }   // namespace
 #endif
 
+namespace {
+const std::uint32_t kNoEntry = 0xFFFFFFFF;
+// Protects allocation and release of reference count table entries
+std::mutex sRefCountTableMutex;
+// Number of table entries that have been handed out (including released entries)
+std::uint32_t sRefCountTableSize = 0;
+// Head of the list of released entries. The next index is stored in mWeak.
+std::uint32_t sRefCountTableFreeList = kNoEntry;
+#if BCH_SMART_PTR_UNITTEST
+std::uint32_t sRefCountTableLiveCount = 0;
+#endif
+}   // namespace
+
 namespace bch {
 namespace detail {
 
+RefCountEntry* RefCountTable::sChunks[RefCountTable::kChunkCount];
+
+std::uint32_t RefCountTable::allocate()
+{
+    std::lock_guard<std::mutex> lock(sRefCountTableMutex);
+
+    std::uint32_t index = sRefCountTableFreeList;
+    if (index != kNoEntry)
+    {
+        sRefCountTableFreeList = entry(index).mWeak;
+    }
+    else
+    {
+        index = sRefCountTableSize;
+        const std::uint32_t chunk = index >> kChunkBits;
+        if (chunk >= kChunkCount)
+            throw std::bad_alloc();
+
+        if (sChunks[chunk] == nullptr)
+        {
+            sChunks[chunk] = static_cast<RefCountEntry*>(malloc(sizeof(RefCountEntry) * kChunkSize));
+            if (sChunks[chunk] == nullptr)
+                throw std::bad_alloc();
+        }
+        ++sRefCountTableSize;
+    }
+
+#if BCH_SMART_PTR_UNITTEST
+    ++sRefCountTableLiveCount;
+#endif
+
+    RefCountEntry& result = entry(index);
+    result.mStrong = 1;
+    result.mWeak = 0;
+    return index;
+}
+
+void RefCountTable::release(std::uint32_t index) noexcept
+{
+    std::lock_guard<std::mutex> lock(sRefCountTableMutex);
+
+#if BCH_SMART_PTR_UNITTEST
+    --sRefCountTableLiveCount;
+#endif
+
+    entry(index).mWeak = sRefCountTableFreeList;
+    sRefCountTableFreeList = index;
+}
+
+#if BCH_SMART_PTR_UNITTEST
+std::uint32_t RefCountTable::live_entry_count() noexcept
+{
+    std::lock_guard<std::mutex> lock(sRefCountTableMutex);
+    return sRefCountTableLiveCount;
+}
+#endif
+
 #if BCH_SMART_PTR_UNITTEST
 void ControlBlock::register_cb_ctor() noexcept
 {
@@ -0,0 +1,102 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#include "bch/offset_shared_ptr.hpp"
+
+#include <cstring>
+
+namespace bch {
+
+namespace {
+
+std::size_t AlignUp(std::size_t value, std::size_t alignment)
+{
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+}   // namespace
+
+shared_segment::shared_segment(std::size_t size) noexcept :
+    mSize(size),
+    mUsed(AlignUp(sizeof(shared_segment), kAlignment))
+{
+    memset(mFreeLists, 0, sizeof(mFreeLists));
+}
+
+shared_segment* shared_segment::create(void* memory, std::size_t size)
+{
+#if BCH_SMART_PTR_DEBUG
+    assert((reinterpret_cast<std::uintptr_t>(memory) & (kAlignment - 1)) == 0);
+#endif
+
+    if (size < AlignUp(sizeof(shared_segment), kAlignment))
+        throw std::bad_alloc();
+
+    return new (memory) shared_segment(size);
+}
+
+shared_segment* shared_segment::attach(void* memory, std::size_t size) noexcept
+{
+    if (size < sizeof(shared_segment))
+        return nullptr;
+
+    shared_segment* const segment = static_cast<shared_segment*>(memory);
+    if ((segment->mMagic != kMagic) || (segment->mSize != size))
+        return nullptr;
+    return segment;
+}
+
+std::size_t shared_segment::size_class(std::size_t size, std::size_t& classSize) noexcept
+{
+    const std::size_t kSmallLimit = kSmallClassCount * kAlignment;
+    if (size <= kSmallLimit)
+    {
+        classSize = AlignUp((size == 0) ? 1 : size, kAlignment);
+        return (classSize / kAlignment) - 1;
+    }
+
+    std::size_t index = kSmallClassCount;
+    classSize = kSmallLimit * 2;
+    while (classSize < size)
+    {
+        classSize *= 2;
+        ++index;
+    }
+    return index;
+}
+
+void* shared_segment::allocate(std::size_t size)
+{
+    std::size_t classSize = 0;
+    const std::size_t index = size_class(size, classSize);
+    if (index >= kClassCount)
+        throw std::bad_alloc();
+
+    const std::uint64_t head = mFreeLists[index];
+    if (head != 0)
+    {
+        // The offset of the next free allocation is stored in the allocation
+        void* const result = base() + head;
+        memcpy(&mFreeLists[index], result, sizeof(std::uint64_t));
+        return result;
+    }
+
+    if (classSize > mSize - mUsed)
+        throw std::bad_alloc();
+
+    void* const result = base() + mUsed;
+    mUsed += classSize;
+    return result;
+}
+
+void shared_segment::deallocate(void* ptr, std::size_t size) noexcept
+{
+    std::size_t classSize = 0;
+    const std::size_t index = size_class(size, classSize);
+
+    memcpy(ptr, &mFreeLists[index], sizeof(std::uint64_t));
+    mFreeLists[index] = static_cast<std::uint64_t>(static_cast<char*>(ptr) - base());
+}
+
+}   // namespace bch
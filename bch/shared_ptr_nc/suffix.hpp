@@ -5,6 +5,7 @@ Copyright: Jesper Storm Bache (bache.name)
 #ifndef BCH_SHARED_PTR_NC_SUFFIX
 #define BCH_SHARED_PTR_NC_SUFFIX
 
+#include <typeinfo>
 #include <utility>
 
 #include "bch/common/memory.hpp"
@@ -13,20 +14,46 @@ namespace bch {
 
 namespace detail {
 
+/* Overloads used to locate the enable_shared_from_this base class of an instance.
+The base class is found by template argument deduction, so a sub-class of a class
+that derives from enable_shared_from_this is also handled.
+*/
+template <typename T>
+inline constexpr enable_shared_from_this<T>* shared_from_this_base(enable_shared_from_this<T>* ptr) noexcept {
+    return ptr;
+}
+
+inline constexpr std::nullptr_t shared_from_this_base(...) noexcept {
+    return nullptr;
+}
+
 /** Set _shared_from_this_data to point to the control block for the instance.
 The implementation must handle types that do not derrive from enable_shared_from_this
 */
 template <typename T>
-inline void set_shared_from_this(T* ptr, detail::ControlBlock* cb) {
-    if constexpr (std::is_base_of_v<enable_shared_from_this<T>, T>) {
-        ptr ->_shared_from_this_data = cb;
+inline constexpr void set_shared_from_this(T* ptr, detail::ControlBlock* cb) {
+    auto const base = shared_from_this_base(const_cast<std::remove_cv_t<T>*>(ptr));
+    if constexpr (!std::is_null_pointer_v<decltype(base)>) {
+        base->_shared_from_this_data = cb;
     }
 }
 
+template <typename T>
+inline ControlBlock* inline_control_block(T* ptr) noexcept {
+    typedef std::remove_cv_t<T> Type;
+    typedef ControlBlockDeleterInlineData<Type> ControlBlockType;
+    static_assert(alignof(Type) <= alignof(std::max_align_t),
+        "the control block offset of an over-aligned type depends on the allocation address");
+
+    constexpr std::size_t kOffset = InstancePairOffset(sizeof(ControlBlockType), alignof(Type));
+    char* const address = reinterpret_cast<char*>(const_cast<Type*>(ptr)) - kOffset;
+    return reinterpret_cast<ControlBlockType*>(address);
+}
+
 }   // detail
 
 template <typename T>
-inline shared_ptr_nc<T>::~shared_ptr_nc()
+inline constexpr shared_ptr_nc<T>::~shared_ptr_nc()
 {
     if (mHandle != nullptr)
         mHandle->release_shared();
@@ -52,6 +79,9 @@ inline
 shared_ptr_nc<T>::shared_ptr_nc(U* ptr) :
     mPtr(static_cast<T*>(ptr))
 {
+    static_assert(!std::is_base_of_v<detail::SharedFromThisInlineBase, U>,
+        "types deriving from enable_shared_from_this_inline must be created with make_shared");
+
     if (mPtr != nullptr) {
         mHandle = detail::ControlBlockDeleter<U>::Create(ptr);
         detail::set_shared_from_this<U>(ptr, mHandle);
@@ -112,7 +142,7 @@ shared_ptr_nc<T>::operator=(const shared_ptr_nc<U>& ptr) noexcept
 }
 
 template <typename T>
-void shared_ptr_nc<T>::reset()
+void shared_ptr_nc<T>::reset() noexcept
 {
     if (mHandle != nullptr)
     {
@@ -126,6 +156,9 @@ template <typename T>
 template <typename U>
 void shared_ptr_nc<T>::reset(U* ptr)
 {
+    static_assert(!std::is_base_of_v<detail::SharedFromThisInlineBase, U>,
+        "types deriving from enable_shared_from_this_inline must be created with make_shared");
+
     reset();
     if (ptr != nullptr)
     {
@@ -155,7 +188,18 @@ shared_ptr_nc<T>::shared_ptr_nc(shared_ptr_nc<U>&& ptr) noexcept :
 }
 
 template <typename T>
-shared_ptr_nc<T>& shared_ptr_nc<T>::operator=(shared_ptr_nc<T>&& ptr)
+template <typename U>
+inline
+shared_ptr_nc<T>::shared_ptr_nc(const shared_ptr_nc<U>& owner, T* ptr) noexcept :
+    mHandle(owner.mHandle),
+    mPtr(ptr)
+{
+    if (mHandle != nullptr)
+        mHandle->add_shared();
+}
+
+template <typename T>
+shared_ptr_nc<T>& shared_ptr_nc<T>::operator=(shared_ptr_nc<T>&& ptr) noexcept
 {
     if (this != &ptr)
     {
@@ -168,7 +212,7 @@ shared_ptr_nc<T>& shared_ptr_nc<T>::operator=(shared_ptr_nc<T>&& ptr)
 
 template <typename T>
 template <typename U>
-shared_ptr_nc<T>& shared_ptr_nc<T>::operator=(shared_ptr_nc<U>&& ptr)
+shared_ptr_nc<T>& shared_ptr_nc<T>::operator=(shared_ptr_nc<U>&& ptr) noexcept
 {
     reset();
     std::swap(mHandle, ptr.mHandle);
@@ -197,17 +241,32 @@ inline T* shared_ptr_nc<T>::operator->() const noexcept
 }
 
 template <typename T>
-inline
+inline constexpr
 shared_ptr_nc<T>::shared_ptr_nc(detail::ControlBlock* handle, T* ptr, bool increaseRefCount) noexcept :
     mHandle(handle),
     mPtr(ptr)
 {
     if (increaseRefCount && mHandle != nullptr)
         mHandle->add_shared();
+}
 
-    if (mPtr != nullptr) {
-        detail::set_shared_from_this<T>(ptr, mHandle);
-    }
+template <typename T>
+inline detail::ControlBlock* detail::SharedPtrAccess::handle(const shared_ptr_nc<T>& ptr) noexcept
+{
+    return ptr.mHandle;
+}
+
+template <typename T>
+inline constexpr shared_ptr_nc<T> detail::SharedPtrAccess::make(ControlBlock* handle, T* ptr, bool increaseRefCount) noexcept
+{
+    return shared_ptr_nc<T>(handle, ptr, increaseRefCount);
+}
+
+template <typename T>
+inline void detail::SharedPtrAccess::detach(shared_ptr_nc<T>& ptr) noexcept
+{
+    ptr.mPtr = nullptr;
+    ptr.mHandle = nullptr;
 }
 
 template <typename T>
@@ -302,6 +361,15 @@ weak_ptr<T>::weak_ptr(const shared_ptr_nc<U>& ptr) noexcept
     Assign(ptr.mPtr, ptr.mHandle);
 }
 
+template <typename T>
+weak_ptr<T>::weak_ptr(weak_ptr<T>&& ptr) noexcept :
+    mPtr(ptr.mPtr),
+    mHandle(ptr.mHandle)
+{
+    ptr.mHandle = nullptr;
+    ptr.mPtr = nullptr;
+}
+
 template <typename T>
 template <typename U>
 weak_ptr<T>::weak_ptr(weak_ptr<U>&& ptr) noexcept :
@@ -335,7 +403,7 @@ weak_ptr<T>::operator=(const weak_ptr<U>& ptr) noexcept
 }
 
 template <typename T>
-weak_ptr<T>& weak_ptr<T>::operator=(weak_ptr<T>&& ptr)
+weak_ptr<T>& weak_ptr<T>::operator=(weak_ptr<T>&& ptr) noexcept
 {
     if (this != &ptr)
     {
@@ -348,23 +416,25 @@ weak_ptr<T>& weak_ptr<T>::operator=(weak_ptr<T>&& ptr)
 
 template <typename T>
 template <typename U>
-weak_ptr<T>& weak_ptr<T>::operator=(weak_ptr<U>&& ptr)
+weak_ptr<T>& weak_ptr<T>::operator=(weak_ptr<U>&& ptr) noexcept
 {
     reset();
-    std::swap(mHandle, ptr.mHandle);
-    std::swap(mPtr, ptr.mPtr);
+    mHandle = ptr.mHandle;
+    mPtr = static_cast<T*>(ptr.mPtr);
+    ptr.mHandle = nullptr;
+    ptr.mPtr = nullptr;
     return *this;
 }
 
 template <typename T>
-weak_ptr<T>& weak_ptr<T>::operator=(const shared_ptr_nc<T>& ptr) {
+weak_ptr<T>& weak_ptr<T>::operator=(const shared_ptr_nc<T>& ptr) noexcept {
     reset();
-    Assign(mPtr, ptr.mHandle);
+    Assign(ptr.mPtr, ptr.mHandle);
     return *this;
 }
 
 template <typename T>
-shared_ptr_nc<T> weak_ptr<T>::lock() const
+shared_ptr_nc<T> weak_ptr<T>::lock() const noexcept
 {
     if (mHandle == nullptr)
         return shared_ptr_nc<T>();
@@ -379,14 +449,14 @@ shared_ptr_nc<T> weak_ptr<T>::lock() const
 }
 
 template <typename T>
-bool weak_ptr<T>::expired() const {
+bool weak_ptr<T>::expired() const noexcept {
     if (mHandle == nullptr) return true;
     if (!mHandle->has_shared_references()) return true;
     return false;
 }
 
 template <typename T>
-void weak_ptr<T>::reset() const
+void weak_ptr<T>::reset() const noexcept
 {
     if (mHandle != nullptr)
     {
@@ -423,27 +493,159 @@ std::uint32_t weak_ptr<T>::weak_count() const
 }
 #endif
 
+template <typename T>
+inline constexpr
+borrowed_ptr<T>::borrowed_ptr(std::nullptr_t) noexcept
+{
+}
+
+template <typename T>
+template <typename U>
+inline
+borrowed_ptr<T>::borrowed_ptr(const shared_ptr_nc<U>& ptr) noexcept :
+    mPtr(static_cast<T*>(ptr.mPtr)),
+    mHandle(ptr.mHandle)
+{
+#if BCH_SMART_PTR_DEBUG
+    if (mHandle != nullptr)
+        mHandle->add_weak();
+#endif
+}
+
+template <typename T>
+template <typename U>
+inline
+borrowed_ptr<T>::borrowed_ptr(const borrowed_ptr<U>& ptr) noexcept :
+    mPtr(static_cast<T*>(ptr.mPtr)),
+    mHandle(ptr.mHandle)
+{
+#if BCH_SMART_PTR_DEBUG
+    if (mHandle != nullptr)
+        mHandle->add_weak();
+#endif
+}
+
+#if BCH_SMART_PTR_DEBUG
+template <typename T>
+inline
+borrowed_ptr<T>::borrowed_ptr(const borrowed_ptr& ptr) noexcept :
+    mPtr(ptr.mPtr),
+    mHandle(ptr.mHandle)
+{
+    if (mHandle != nullptr)
+        mHandle->add_weak();
+}
+
+template <typename T>
+inline
+borrowed_ptr<T>::~borrowed_ptr()
+{
+    if (mHandle != nullptr)
+        mHandle->release_weak();
+}
+
+template <typename T>
+borrowed_ptr<T>&
+borrowed_ptr<T>::operator=(const borrowed_ptr& ptr) noexcept
+{
+    if (ptr.mHandle != nullptr)
+        ptr.mHandle->add_weak();
+    if (mHandle != nullptr)
+        mHandle->release_weak();
+
+    mPtr = ptr.mPtr;
+    mHandle = ptr.mHandle;
+    return *this;
+}
+
+template <typename T>
+inline void borrowed_ptr<T>::validate() const noexcept
+{
+    // The weak reference keeps the control block alive, so it is safe to test
+    // the strong reference count after the instance has been destroyed.
+    assert(mHandle == nullptr || mHandle->has_shared_references());
+}
+#endif
+
+template <typename T>
+shared_ptr_nc<T> borrowed_ptr<T>::to_shared() const noexcept
+{
+#if BCH_SMART_PTR_DEBUG
+    validate();
+#endif
+    return shared_ptr_nc<T>(mHandle, mPtr, true);
+}
+
+template <typename T>
+inline T* borrowed_ptr<T>::get() const noexcept
+{
+    return mPtr;
+}
+
+template <typename T>
+inline T& borrowed_ptr<T>::operator*() const noexcept
+{
+#if BCH_SMART_PTR_DEBUG
+    validate();
+#endif
+    return *mPtr;
+}
+
+template <typename T>
+inline T* borrowed_ptr<T>::operator->() const noexcept
+{
+#if BCH_SMART_PTR_DEBUG
+    validate();
+#endif
+    return mPtr;
+}
+
 #if BCH_SMART_PTR_UNITTEST
 
 inline std::uint32_t detail::ControlBlock::weak_count() const
 {
-    return mWeak;
+    return (is_out_of_line() ? RefCountTable::entry(mWeak).mWeak : mWeak) & ~kExpiryFlag;
 }
 #endif
 
 inline void detail::ControlBlock::adjust() noexcept
 {
+    if (is_out_of_line())
+    {
+        const RefCountEntry& entry = RefCountTable::entry(mWeak);
+        if ((entry.mStrong != 0) || (entry.mWeak != 0))
+            return;
+
+        RefCountTable::release(mWeak);
+        mStrong = 0;
+        mWeak = 0;
+    }
+
     if ((mStrong == 0) && (mWeak == 0))
     {
 #if BCH_SMART_PTR_UNITTEST
         register_cb_dtor();
 #endif
 
-        this->~ControlBlock();
-        free(this);
+        on_zero_weak();
     }
 }
 
+inline void detail::ControlBlock::release_pending() noexcept
+{
+#if BCH_SMART_PTR_DEBUG
+    assert((mStrong == 0) && (mWeak == 0));
+#endif
+
+    adjust();
+}
+
+inline void detail::ControlBlock::on_zero_weak() noexcept
+{
+    this->~ControlBlock();
+    free(this);
+}
+
 /** Create a shared pointer by creating an instance of T with the provided arguments.
 The shared pointer will use a single memory allocation for both the control block and
 the instance.
@@ -453,6 +655,10 @@ shared_ptr_nc<T> make_shared(Args&& ... args)
 {
     typedef detail::ControlBlockDeleterInlineData<T> ControlBlockType;
 
+    static_assert(!std::is_base_of_v<detail::SharedFromThisInlineBase, T> ||
+                  std::is_base_of_v<enable_shared_from_this_inline<T>, T>,
+        "make_shared must create the exact type that derives from enable_shared_from_this_inline");
+
     void* cbAddress = nullptr;
     void* instanceAddress = nullptr;
     AllocateInstancePair(   sizeof(ControlBlockType),
@@ -461,23 +667,55 @@ shared_ptr_nc<T> make_shared(Args&& ... args)
                             cbAddress,
                             instanceAddress);
 
-    auto deleteWithFree = [](void* p) {free(p);};
-    std::unique_ptr<void, decltype(deleteWithFree)> guard(cbAddress, deleteWithFree);
-
     /* Invoke constructors for the control block and for T.
     Only the constructor for T can throw an exception.
-    We therefore invoke the ctor of T first and then if that succeds we invoke the ctor of the control block.
+    The control block is constructed first with a strong reference count of 0, so
+    shared_from_this (enable_shared_from_this_inline) returns an empty pointer while T
+    is constructed. The count is set to 1 when the ctor of T succeeds.
     */
+    ControlBlockType* const cbPtr = new (cbAddress) ControlBlockType(static_cast<T*>(instanceAddress),
+                                                                     detail::ControlBlock::PendingTag());
+
+    T* ptr = nullptr;
+    try
+    {
+        ptr = new (instanceAddress) T(std::forward<Args>(args)...);
+    }
+    catch (...)
+    {
+        cbPtr->release_pending();
+        throw;
+    }
 
-    T* const ptr = new (instanceAddress) T(std::forward<Args>(args)...);
+    cbPtr->activate();
 
-    ControlBlockType* const cbPtr = new (cbAddress) ControlBlockType(ptr);
+    detail::set_shared_from_this<T>(ptr, cbPtr);
 
-    guard.release();
+#if BCH_SMART_PTR_DEBUG
+    if constexpr (std::is_base_of_v<detail::SharedFromThisInlineBase, T>) {
+        assert(detail::inline_control_block(ptr) == cbPtr);
+    }
+#endif
 
     return shared_ptr_nc<T>(cbPtr, ptr, false);
 }
 
+/** Create a shared pointer like make_shared, but store the reference counts in the
+dense RefCountTable rather than in the control block.
+The memory of the instance and its control block is then not written after
+construction (until the instance is destroyed). Sharing instances read-only does not
+invalidate the cache lines of the instance, pages stay shared after fork, and the
+instance memory can be made read-only (mprotect).
+The cost is an extra indirection for reference count changes.
+*/
+template <typename T, typename ...Args>
+shared_ptr_nc<T> make_shared_out_of_line(Args&& ... args)
+{
+    shared_ptr_nc<T> result = make_shared<T>(std::forward<Args>(args)...);
+    detail::SharedPtrAccess::handle(result)->move_counts_out_of_line();
+    return result;
+}
+
 template<typename T, typename U>
 shared_ptr_nc<T> static_pointer_cast(const shared_ptr_nc<U>& ptr)
 {
@@ -490,6 +728,44 @@ shared_ptr_nc<T> dynamic_pointer_cast(const shared_ptr_nc<U>& ptr)
     return shared_ptr_nc<T>(ptr.mHandle, dynamic_cast<T*>(ptr.mPtr), true);
 }
 
+template<typename T, typename U>
+shared_ptr_nc<T> fast_pointer_cast(const shared_ptr_nc<U>& ptr)
+{
+    static_assert(std::is_polymorphic_v<U>, "fast_pointer_cast requires a polymorphic type");
+
+    typedef std::remove_cv_t<T> Type;
+
+    if (ptr.mPtr == nullptr)
+        return shared_ptr_nc<T>();
+
+    if constexpr (std::is_convertible_v<T*, U*>)
+    {
+        const detail::ConcreteInstance concrete = (ptr.mHandle != nullptr) ?
+            ptr.mHandle->concrete_instance() : detail::ConcreteInstance{nullptr, nullptr};
+
+        /* The managed instance is a T. The pointer may refer to another instance (see
+        the aliasing constructor), so it is compared with the managed instance.
+        */
+        if (concrete.mType == detail::type_id<Type>())
+        {
+            T* const instance = static_cast<Type*>(concrete.mInstance);
+            if (static_cast<U*>(instance) == ptr.mPtr)
+                return shared_ptr_nc<T>(ptr.mHandle, instance, true);
+        }
+        else if constexpr (std::is_final_v<Type>)
+        {
+            /* A final type has no subclasses, so the cast fails unless the dynamic type
+            of the instance is T (a read of the vtable rather than a search of the bases).
+            */
+            if (!(typeid(*ptr.mPtr) == typeid(Type)))
+                return shared_ptr_nc<T>();
+        }
+    }
+
+    T* const result = dynamic_cast<T*>(ptr.mPtr);
+    return (result != nullptr) ? shared_ptr_nc<T>(ptr.mHandle, result, true) : shared_ptr_nc<T>();
+}
+
 template<typename T, typename U>
 shared_ptr_nc<T> const_pointer_cast(const shared_ptr_nc<const U>& ptr)
 {
@@ -511,6 +787,24 @@ shared_ptr_nc<const T> enable_shared_from_this<T>::shared_from_this() const {
     return shared_ptr_nc<const T>(_shared_from_this_data, const_cast<T*>(static_cast<const T*>(this)), true);
 }
 
+template <typename T>
+shared_ptr_nc<T> enable_shared_from_this_inline<T>::shared_from_this() {
+    T* const ptr = static_cast<T*>(this);
+    detail::ControlBlock* const cb = detail::inline_control_block(ptr);
+    if (!cb->has_shared_references()) return shared_ptr_nc<T>();
+
+    return shared_ptr_nc<T>(cb, ptr, true);
+}
+
+template <typename T>
+shared_ptr_nc<const T> enable_shared_from_this_inline<T>::shared_from_this() const {
+    const T* const ptr = static_cast<const T*>(this);
+    detail::ControlBlock* const cb = detail::inline_control_block(ptr);
+    if (!cb->has_shared_references()) return shared_ptr_nc<const T>();
+
+    return shared_ptr_nc<const T>(cb, ptr, true);
+}
+
 }   // namespace bch
 
 #endif // BCH_SHARED_PTR_NC_SUFFIX
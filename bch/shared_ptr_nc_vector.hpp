@@ -0,0 +1,386 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#ifndef BCH_SHARED_PTR_NC_VECTOR
+#define BCH_SHARED_PTR_NC_VECTOR
+
+#pragma once
+
+#include <utility>
+
+#include "bch/shared_ptr_nc.hpp"
+#include "bch/relocatable_vector.hpp"
+
+#include "bch/common/header_prefix.hpp"
+
+namespace bch {
+
+/* Vector of shared pointers that stores the instance pointers and the control block
+pointers in separate arrays (structure of arrays).
+Most operations on a large vector of shared pointers only touch one of the two
+pointers: iteration only reads the instance pointers, and copying and clearing only
+use the control blocks. Separate arrays halve the memory that is read by these
+operations.
+
+Reference count changes are grouped: when consecutive entries share a control block
+(for example after fill), then copying or clearing the vector changes the reference
+count with a single write per run of entries.
+
+Entries may be empty (null).
+*/
+template <typename T>
+class shared_ptr_nc_vector
+{
+public:
+    using size_type = std::size_t;
+
+    // Number of entries that iteration and scans prefetch ahead of the current entry
+    static constexpr size_type kPrefetchDistance = 8;
+
+    shared_ptr_nc_vector() noexcept = default;
+    shared_ptr_nc_vector(const shared_ptr_nc_vector& other);
+    shared_ptr_nc_vector(shared_ptr_nc_vector&& other) noexcept = default;
+    ~shared_ptr_nc_vector();
+
+    shared_ptr_nc_vector& operator=(const shared_ptr_nc_vector& other);
+    shared_ptr_nc_vector& operator=(shared_ptr_nc_vector&& other) noexcept;
+
+    void swap(shared_ptr_nc_vector& other) noexcept;
+
+    size_type size() const noexcept {
+        return mPtrs.size();
+    }
+
+    bool empty() const noexcept {
+        return mPtrs.empty();
+    }
+
+    size_type capacity() const noexcept {
+        return mPtrs.capacity();
+    }
+
+    void reserve(size_type capacity);
+
+    // Instance pointer of the entry at index
+    T* get(size_type index) const noexcept {
+        return mPtrs[index];
+    }
+
+    // The instance pointers of all entries
+    T* const* pointers() const noexcept {
+        return mPtrs.data();
+    }
+
+    // Return a shared pointer to the entry at index
+    shared_ptr_nc<T> share(size_type index) const noexcept;
+
+    void push_back(const shared_ptr_nc<T>& ptr);
+    void push_back(shared_ptr_nc<T>&& ptr);
+
+    // Append count copies of ptr. The reference count is increased with a single write.
+    void fill(const shared_ptr_nc<T>& ptr, size_type count);
+
+    // Append the entries of other
+    void append(const shared_ptr_nc_vector& other);
+
+    // Replace the entry at index
+    void set(size_type index, shared_ptr_nc<T> ptr);
+
+    void pop_back();
+
+    /* Release all entries. References to the same control block in consecutive
+    entries are released with a single write.
+    */
+    void clear();
+
+    /* Invoke functor(T&) for each non-empty entry. The instances kPrefetchDistance
+    entries ahead are prefetched.
+    */
+    template <typename Functor>
+    void for_each(Functor functor) const;
+
+    // Number of entries whose instance is only referenced by that entry
+    size_type count_unique() const noexcept;
+
+    /* Erase the entries whose instance is only referenced by that entry (for
+    example: entries of a cache that nobody else uses). The order of the
+    remaining entries is preserved. Returns the number of erased entries.
+    The instances are destroyed after the vector has been compacted.
+    */
+    size_type erase_unique();
+
+private:
+    // Grow both arrays (geometrically) so they can hold count entries
+    void ensure_capacity(size_type count);
+
+    // Add the references held by the entries in [first, last) to their control blocks
+    static void add_references(detail::ControlBlock* const* first, detail::ControlBlock* const* last) noexcept;
+
+    // Release the references held by the entries in [first, last)
+    static void release_references(detail::ControlBlock* const* first, detail::ControlBlock* const* last);
+
+    relocatable_vector<T*>                      mPtrs;
+    relocatable_vector<detail::ControlBlock*>   mHandles;
+};
+
+template <typename T>
+struct is_trivially_relocatable<shared_ptr_nc_vector<T>>: std::true_type {};
+
+// -----------------------------------------------------------------------------
+
+template <typename T>
+inline
+shared_ptr_nc_vector<T>::shared_ptr_nc_vector(const shared_ptr_nc_vector& other) :
+    mPtrs(other.mPtrs),
+    mHandles(other.mHandles)
+{
+    add_references(mHandles.begin(), mHandles.end());
+}
+
+template <typename T>
+inline
+shared_ptr_nc_vector<T>::~shared_ptr_nc_vector()
+{
+    clear();
+}
+
+template <typename T>
+inline shared_ptr_nc_vector<T>&
+shared_ptr_nc_vector<T>::operator=(const shared_ptr_nc_vector& other)
+{
+    if (this != &other)
+    {
+        shared_ptr_nc_vector copy(other);
+        swap(copy);
+    }
+    return *this;
+}
+
+template <typename T>
+inline shared_ptr_nc_vector<T>&
+shared_ptr_nc_vector<T>::operator=(shared_ptr_nc_vector&& other) noexcept
+{
+    shared_ptr_nc_vector temp(std::move(other));
+    swap(temp);
+    return *this;
+}
+
+template <typename T>
+inline void shared_ptr_nc_vector<T>::swap(shared_ptr_nc_vector& other) noexcept
+{
+    mPtrs.swap(other.mPtrs);
+    mHandles.swap(other.mHandles);
+}
+
+template <typename T>
+inline void shared_ptr_nc_vector<T>::reserve(size_type capacity)
+{
+    mPtrs.reserve(capacity);
+    mHandles.reserve(capacity);
+}
+
+template <typename T>
+inline void shared_ptr_nc_vector<T>::ensure_capacity(size_type count)
+{
+    if ((count <= mPtrs.capacity()) && (count <= mHandles.capacity()))
+        return;
+
+    const size_type grown = 2 * mPtrs.capacity();
+    reserve((count < grown) ? grown : count);
+}
+
+template <typename T>
+inline shared_ptr_nc<T> shared_ptr_nc_vector<T>::share(size_type index) const noexcept
+{
+    return detail::SharedPtrAccess::make(mHandles[index], mPtrs[index], true);
+}
+
+template <typename T>
+inline void shared_ptr_nc_vector<T>::push_back(const shared_ptr_nc<T>& ptr)
+{
+    push_back(shared_ptr_nc<T>(ptr));
+}
+
+template <typename T>
+inline void shared_ptr_nc_vector<T>::push_back(shared_ptr_nc<T>&& ptr)
+{
+    ensure_capacity(size() + 1);
+    mPtrs.push_back(ptr.get());
+    mHandles.push_back(detail::SharedPtrAccess::handle(ptr));
+    detail::SharedPtrAccess::detach(ptr);
+}
+
+template <typename T>
+void shared_ptr_nc_vector<T>::fill(const shared_ptr_nc<T>& ptr, size_type count)
+{
+    if (count == 0)
+        return;
+
+    ensure_capacity(size() + count);
+    T* const instance = ptr.get();
+    detail::ControlBlock* const handle = detail::SharedPtrAccess::handle(ptr);
+    for (size_type index = 0; index < count; ++index)
+    {
+        mPtrs.push_back(instance);
+        mHandles.push_back(handle);
+    }
+
+    if (handle != nullptr)
+        handle->add_shared(static_cast<std::uint32_t>(count));
+}
+
+template <typename T>
+void shared_ptr_nc_vector<T>::append(const shared_ptr_nc_vector& other)
+{
+    const size_type otherSize = other.size();
+    ensure_capacity(size() + otherSize);
+    // other may be this vector, so only the first otherSize entries are appended
+    for (size_type index = 0; index < otherSize; ++index)
+    {
+        mPtrs.push_back(other.mPtrs[index]);
+        mHandles.push_back(other.mHandles[index]);
+    }
+    add_references(mHandles.end() - otherSize, mHandles.end());
+}
+
+template <typename T>
+inline void shared_ptr_nc_vector<T>::set(size_type index, shared_ptr_nc<T> ptr)
+{
+    detail::ControlBlock* const previous = mHandles[index];
+    mPtrs[index] = ptr.get();
+    mHandles[index] = detail::SharedPtrAccess::handle(ptr);
+    detail::SharedPtrAccess::detach(ptr);
+
+    if (previous != nullptr)
+        previous->release_shared();
+}
+
+template <typename T>
+inline void shared_ptr_nc_vector<T>::pop_back()
+{
+    detail::ControlBlock* const handle = mHandles.back();
+    mPtrs.pop_back();
+    mHandles.pop_back();
+
+    if (handle != nullptr)
+        handle->release_shared();
+}
+
+template <typename T>
+void shared_ptr_nc_vector<T>::clear()
+{
+    release_references(mHandles.begin(), mHandles.end());
+    mPtrs.clear();
+    mHandles.clear();
+}
+
+template <typename T>
+template <typename Functor>
+void shared_ptr_nc_vector<T>::for_each(Functor functor) const
+{
+    T* const* const ptrs = mPtrs.data();
+    const size_type count = mPtrs.size();
+    for (size_type index = 0; index < count; ++index)
+    {
+        if (index + kPrefetchDistance < count)
+            BCH_PREFETCH(ptrs[index + kPrefetchDistance]);
+
+        if (ptrs[index] != nullptr)
+            functor(*ptrs[index]);
+    }
+}
+
+template <typename T>
+typename shared_ptr_nc_vector<T>::size_type
+shared_ptr_nc_vector<T>::count_unique() const noexcept
+{
+    detail::ControlBlock* const* const handles = mHandles.data();
+    const size_type count = mHandles.size();
+    size_type result = 0;
+    for (size_type index = 0; index < count; ++index)
+    {
+        if (index + kPrefetchDistance < count)
+            BCH_PREFETCH(handles[index + kPrefetchDistance]);
+
+        if ((handles[index] != nullptr) && (handles[index]->use_count() == 1))
+            ++result;
+    }
+    return result;
+}
+
+template <typename T>
+typename shared_ptr_nc_vector<T>::size_type
+shared_ptr_nc_vector<T>::erase_unique()
+{
+    const size_type uniqueCount = count_unique();
+    if (uniqueCount == 0)
+        return 0;
+
+    // Allocate up front, so the compaction below cannot fail
+    relocatable_vector<detail::ControlBlock*> released;
+    released.reserve(uniqueCount);
+
+    const size_type count = mHandles.size();
+    size_type destination = 0;
+    for (size_type index = 0; index < count; ++index)
+    {
+        if (index + kPrefetchDistance < count)
+            BCH_PREFETCH(mHandles[index + kPrefetchDistance]);
+
+        detail::ControlBlock* const handle = mHandles[index];
+        if ((handle != nullptr) && (handle->use_count() == 1))
+        {
+            released.push_back(handle);
+            continue;
+        }
+
+        mPtrs[destination] = mPtrs[index];
+        mHandles[destination] = handle;
+        ++destination;
+    }
+
+    mPtrs.erase(mPtrs.begin() + destination, mPtrs.end());
+    mHandles.erase(mHandles.begin() + destination, mHandles.end());
+
+    release_references(released.begin(), released.end());
+    return uniqueCount;
+}
+
+template <typename T>
+void shared_ptr_nc_vector<T>::add_references(detail::ControlBlock* const* first, detail::ControlBlock* const* last) noexcept
+{
+    while (first != last)
+    {
+        detail::ControlBlock* const handle = *first;
+        detail::ControlBlock* const* run = first + 1;
+        while ((run != last) && (*run == handle))
+            ++run;
+
+        if (handle != nullptr)
+            handle->add_shared(static_cast<std::uint32_t>(run - first));
+        first = run;
+    }
+}
+
+template <typename T>
+void shared_ptr_nc_vector<T>::release_references(detail::ControlBlock* const* first, detail::ControlBlock* const* last)
+{
+    while (first != last)
+    {
+        detail::ControlBlock* const handle = *first;
+        detail::ControlBlock* const* run = first + 1;
+        while ((run != last) && (*run == handle))
+            ++run;
+
+        if (handle != nullptr)
+            handle->release_shared(static_cast<std::uint32_t>(run - first));
+        first = run;
+    }
+}
+
+}   // namespace bch
+
+#include "bch/common/header_suffix.hpp"
+
+#endif  // BCH_SHARED_PTR_NC_VECTOR
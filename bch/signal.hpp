@@ -0,0 +1,237 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#ifndef BCH_SIGNAL
+#define BCH_SIGNAL
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <type_traits>
+
+#include "bch/relocatable_vector.hpp"
+#include "bch/shared_ptr_nc.hpp"
+
+#include "bch/common/header_prefix.hpp"
+
+namespace bch {
+
+/* Signal that invokes a function of each connected observer.
+Observers are held weakly: a slot holds a weak reference to the control block of its
+observer, and emit only invokes the slots whose observer has a strong reference (the
+check of weak_ptr::expired). emit does not change any reference count, so dispatch
+costs a load of the strong count and an indirect call per slot.
+Slots of released observers are skipped, and removed by the next compaction (when at
+least half of the slots are dead, or when compact is invoked).
+
+Slots are stored densely in a relocatable_vector. The function of a slot is a
+template argument, so a slot is three pointers:
+/code
+    bch::signal<int> changed;
+    changed.connect<&Observer::on_changed>(observer);  // member function
+    changed.connect<&OnChanged>(observer);             // void OnChanged(Observer&, int)
+    changed.emit(42);
+/endcode
+
+emit does not keep the observers alive: an observer must not release the last
+reference to itself from its own slot. A slot may release other observers (they are
+skipped), and may connect and disconnect slots (slots connected during emit are
+invoked by the next emit).
+Not thread safe: the signal and its observers must be used by one thread at a time.
+*/
+template <typename ... Args>
+class signal
+{
+public:
+    signal() noexcept = default;
+    ~signal();
+
+    // Connect Function to observer. Throws std::bad_alloc.
+    template <auto Function, typename T>
+    void connect(const shared_ptr_nc<T>& observer);
+
+    // Disconnect all slots of observer. Returns the number of disconnected slots.
+    template <typename T>
+    std::size_t disconnect(const shared_ptr_nc<T>& observer) noexcept;
+
+    /* Invoke the slots of the live observers. An exception thrown by a slot propagates
+    to the caller (the remaining slots are not invoked).
+    */
+    void emit(Args ... args);
+
+    // Remove the slots of disconnected and released observers
+    void compact() noexcept;
+
+    // Number of slots (including dead slots that have not been compacted)
+    std::size_t size() const noexcept {
+        return mSlots.size();
+    }
+
+private:
+    signal(const signal&) = delete;
+    signal(signal&&) = delete;
+    signal& operator=(const signal&) = delete;
+    signal& operator=(signal&&) = delete;
+
+    typedef void (*Invoker)(void* observer, Args& ... args);
+
+    struct Slot
+    {
+        // nullptr for a disconnected slot. The slot holds a weak reference.
+        detail::ControlBlock*   mHandle;
+        void*                   mObserver;
+        Invoker                 mInvoke;
+    };
+
+    template <typename T, auto Function>
+    static void invoke(void* observer, Args& ... args);
+
+    // Increments the emit depth while a scope is active (also when a slot throws)
+    class EmitScope
+    {
+    public:
+        explicit EmitScope(unsigned int& depth) noexcept :
+            mDepth(depth)
+        {
+            ++mDepth;
+        }
+
+        ~EmitScope() {
+            --mDepth;
+        }
+
+    private:
+        EmitScope(const EmitScope&) = delete;
+        EmitScope& operator=(const EmitScope&) = delete;
+
+        unsigned int&   mDepth;
+    };
+
+    relocatable_vector<Slot>    mSlots;
+    // Number of slots that are known to be dead
+    std::size_t                 mDeadCount{0};
+    // Number of active emit calls (slots are not removed while emitting)
+    unsigned int                mEmitDepth{0};
+};
+
+// -----------------------------------------------------------------------------
+
+template <typename ... Args>
+signal<Args...>::~signal()
+{
+#if BCH_SMART_PTR_DEBUG
+    assert(mEmitDepth == 0);
+#endif
+
+    for (const Slot& slot: mSlots)
+    {
+        if (slot.mHandle != nullptr)
+            slot.mHandle->release_weak();
+    }
+}
+
+template <typename ... Args>
+template <typename T, auto Function>
+void signal<Args...>::invoke(void* observer, Args& ... args)
+{
+    T& instance = *static_cast<T*>(observer);
+    if constexpr (std::is_member_function_pointer_v<decltype(Function)>)
+        (instance.*Function)(args...);
+    else
+        Function(instance, args...);
+}
+
+template <typename ... Args>
+template <auto Function, typename T>
+void signal<Args...>::connect(const shared_ptr_nc<T>& observer)
+{
+    detail::ControlBlock* const handle = detail::SharedPtrAccess::handle(observer);
+
+#if BCH_SMART_PTR_DEBUG
+    assert(handle != nullptr);
+#endif
+
+    mSlots.push_back(Slot{handle, const_cast<std::remove_cv_t<T>*>(observer.get()), &invoke<T, Function>});
+    handle->add_weak();
+}
+
+template <typename ... Args>
+template <typename T>
+std::size_t signal<Args...>::disconnect(const shared_ptr_nc<T>& observer) noexcept
+{
+    const void* const address = observer.get();
+    std::size_t count = 0;
+    for (Slot& slot: mSlots)
+    {
+        if ((slot.mHandle != nullptr) && (slot.mObserver == address))
+        {
+            slot.mHandle->release_weak();
+            slot.mHandle = nullptr;
+            ++count;
+        }
+    }
+
+    mDeadCount += count;
+    if ((mEmitDepth == 0) && (mDeadCount * 2 >= mSlots.size()))
+        compact();
+    return count;
+}
+
+template <typename ... Args>
+void signal<Args...>::emit(Args ... args)
+{
+    // Slots that are connected by a slot are not invoked by this emit
+    const std::size_t count = mSlots.size();
+    std::size_t deadCount = 0;
+    {
+        const EmitScope scope(mEmitDepth);
+        for (std::size_t index = 0; index < count; ++index)
+        {
+            // The slots may be reallocated by a slot, so they are accessed by index
+            const Slot slot = mSlots[index];
+            if ((slot.mHandle != nullptr) && slot.mHandle->has_shared_references())
+                slot.mInvoke(slot.mObserver, args...);
+            else
+                ++deadCount;
+        }
+    }
+
+    if ((mEmitDepth == 0) && (deadCount * 2 >= count) && (deadCount != 0))
+        compact();
+}
+
+template <typename ... Args>
+void signal<Args...>::compact() noexcept
+{
+#if BCH_SMART_PTR_DEBUG
+    assert(mEmitDepth == 0);
+#endif
+
+    Slot* const begin = mSlots.data();
+    Slot* const end = begin + mSlots.size();
+    Slot* destination = begin;
+    for (Slot* slot = begin; slot != end; ++slot)
+    {
+        if (slot->mHandle == nullptr)
+            continue;
+
+        if (!slot->mHandle->has_shared_references())
+        {
+            slot->mHandle->release_weak();
+            continue;
+        }
+
+        *destination++ = *slot;
+    }
+
+    mSlots.erase(mSlots.begin() + (destination - begin), mSlots.end());
+    mDeadCount = 0;
+}
+
+}   // namespace bch
+
+#include "bch/common/header_suffix.hpp"
+
+#endif  // BCH_SIGNAL
@@ -0,0 +1,289 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#ifndef BCH_SLOT_MAP
+#define BCH_SLOT_MAP
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+#include "bch/relocatable_vector.hpp"
+
+#include "bch/common/header_prefix.hpp"
+
+namespace bch {
+
+/* Handle of a value in a slot_map: a 32 bit slot index and the generation of the slot.
+A default constructed handle does not refer to a value.
+*/
+class slot_handle
+{
+public:
+    static constexpr std::uint32_t kInvalidIndex = 0xFFFFFFFF;
+
+    constexpr slot_handle() noexcept = default;
+
+    constexpr slot_handle(std::uint32_t index, std::uint32_t generation) noexcept :
+        mIndex(index),
+        mGeneration(generation)
+    { }
+
+    constexpr std::uint32_t index() const noexcept {
+        return mIndex;
+    }
+
+    constexpr std::uint32_t generation() const noexcept {
+        return mGeneration;
+    }
+
+    constexpr explicit operator bool() const noexcept {
+        return (mIndex != kInvalidIndex);
+    }
+
+    constexpr bool operator==(const slot_handle& other) const noexcept {
+        return (mIndex == other.mIndex) && (mGeneration == other.mGeneration);
+    }
+
+    constexpr bool operator!=(const slot_handle& other) const noexcept {
+        return !(*this == other);
+    }
+
+private:
+    std::uint32_t   mIndex{kInvalidIndex};
+    std::uint32_t   mGeneration{0};
+};
+
+/* Container of values that are referenced by generational handles.
+A weak_ptr keeps the allocation of a make_shared instance alive, and lock changes
+the reference count in the control block. A slot_handle is two 32 bit integers:
+checking a handle compares the generation of its slot, and erasing a value releases
+it immediately. Erasing a value increments the generation of its slot, so the
+handles of the value no longer refer to a value, and the slot is reused by the next
+insertion.
+
+The values are stored densely (erase relocates the last value into the gap), so
+iteration visits contiguous values. Pointers to values, and the order of the values,
+are invalidated by emplace and erase. Handles remain valid until their value is
+erased (a slot is reused after 2^32 erasures, at which point an old handle may refer
+to a new value).
+
+The value type must be trivially relocatable or nothrow move constructible (see
+relocatable_vector).
+Not thread safe: the slot map must be used by one thread at a time.
+*/
+template <typename T>
+class slot_map
+{
+public:
+    using iterator = T*;
+    using const_iterator = const T*;
+
+    slot_map() noexcept = default;
+
+    // Insert a value constructed from args. Throws std::bad_alloc.
+    template <typename ... Args>
+    slot_handle emplace(Args&& ... args);
+
+    // Returns true if handle referred to a value (that is now destroyed)
+    bool erase(slot_handle handle) noexcept;
+
+    bool contains(slot_handle handle) const noexcept {
+        return (slot(handle) != nullptr);
+    }
+
+    // Return the value of handle (nullptr if the value has been erased)
+    T* find(slot_handle handle) noexcept;
+    const T* find(slot_handle handle) const noexcept;
+
+    // Return the handle of the value at index (in iteration order)
+    slot_handle handle_at(std::size_t index) const noexcept;
+
+    void reserve(std::size_t capacity);
+
+    // Erase all values (all handles are invalidated)
+    void clear() noexcept;
+
+    std::size_t size() const noexcept {
+        return mValues.size();
+    }
+
+    bool empty() const noexcept {
+        return mValues.empty();
+    }
+
+    T* data() noexcept {
+        return mValues.data();
+    }
+
+    const T* data() const noexcept {
+        return mValues.data();
+    }
+
+    iterator begin() noexcept {
+        return mValues.begin();
+    }
+
+    iterator end() noexcept {
+        return mValues.end();
+    }
+
+    const_iterator begin() const noexcept {
+        return mValues.begin();
+    }
+
+    const_iterator end() const noexcept {
+        return mValues.end();
+    }
+
+private:
+    slot_map(const slot_map&) = delete;
+    slot_map(slot_map&&) = delete;
+    slot_map& operator=(const slot_map&) = delete;
+    slot_map& operator=(slot_map&&) = delete;
+
+    struct Slot
+    {
+        // Index of the value (or of the next free slot if the slot is free)
+        std::uint32_t   mIndex;
+        std::uint32_t   mGeneration;
+    };
+
+    // Return the slot of handle (nullptr if handle does not refer to a value)
+    const Slot* slot(slot_handle handle) const noexcept;
+
+    void release_slot(std::uint32_t index) noexcept;
+
+    relocatable_vector<T>               mValues;
+    // Slot index of each value
+    relocatable_vector<std::uint32_t>   mValueSlots;
+    relocatable_vector<Slot>            mSlots;
+    // Most recently freed slot (slots are reused in LIFO order)
+    std::uint32_t                       mFreeSlot{slot_handle::kInvalidIndex};
+};
+
+// -----------------------------------------------------------------------------
+
+template <typename T>
+inline const typename slot_map<T>::Slot*
+slot_map<T>::slot(slot_handle handle) const noexcept
+{
+    // A free slot has a newer generation than the handles of its erased values
+    if ((handle.index() >= mSlots.size()) || (mSlots[handle.index()].mGeneration != handle.generation()))
+        return nullptr;
+    return &mSlots[handle.index()];
+}
+
+template <typename T>
+inline T* slot_map<T>::find(slot_handle handle) noexcept
+{
+    const Slot* const entry = slot(handle);
+    return (entry != nullptr) ? &mValues[entry->mIndex] : nullptr;
+}
+
+template <typename T>
+inline const T* slot_map<T>::find(slot_handle handle) const noexcept
+{
+    const Slot* const entry = slot(handle);
+    return (entry != nullptr) ? &mValues[entry->mIndex] : nullptr;
+}
+
+template <typename T>
+inline slot_handle slot_map<T>::handle_at(std::size_t index) const noexcept
+{
+    const std::uint32_t slotIndex = mValueSlots[index];
+    return slot_handle(slotIndex, mSlots[slotIndex].mGeneration);
+}
+
+template <typename T>
+void slot_map<T>::reserve(std::size_t capacity)
+{
+    mValues.reserve(capacity);
+    mValueSlots.reserve(capacity);
+    mSlots.reserve(capacity);
+}
+
+template <typename T>
+template <typename ... Args>
+slot_handle slot_map<T>::emplace(Args&& ... args)
+{
+    const std::size_t index = mValues.size();
+
+#if BCH_SMART_PTR_DEBUG
+    assert(index < slot_handle::kInvalidIndex);
+#endif
+
+    mValues.emplace_back(std::forward<Args>(args)...);
+    try
+    {
+        if (mFreeSlot == slot_handle::kInvalidIndex)
+        {
+            mValueSlots.push_back(static_cast<std::uint32_t>(mSlots.size()));
+            mSlots.push_back(Slot{static_cast<std::uint32_t>(index), 0});
+        }
+        else
+        {
+            mValueSlots.push_back(mFreeSlot);
+        }
+    }
+    catch (...)
+    {
+        if (mValueSlots.size() == mValues.size())
+            mValueSlots.pop_back();
+        mValues.pop_back();
+        throw;
+    }
+
+    const std::uint32_t slotIndex = mValueSlots.back();
+    Slot& entry = mSlots[slotIndex];
+    if (slotIndex == mFreeSlot)
+        mFreeSlot = entry.mIndex;
+    entry.mIndex = static_cast<std::uint32_t>(index);
+    return slot_handle(slotIndex, entry.mGeneration);
+}
+
+template <typename T>
+inline void slot_map<T>::release_slot(std::uint32_t index) noexcept
+{
+    Slot& entry = mSlots[index];
+    ++entry.mGeneration;
+    entry.mIndex = mFreeSlot;
+    mFreeSlot = index;
+}
+
+template <typename T>
+bool slot_map<T>::erase(slot_handle handle) noexcept
+{
+    const Slot* const entry = slot(handle);
+    if (entry == nullptr)
+        return false;
+
+    // The last value is relocated into the gap
+    const std::uint32_t index = entry->mIndex;
+    const std::uint32_t lastSlot = mValueSlots.back();
+    mValues.erase_unordered(mValues.begin() + index);
+    mValueSlots.erase_unordered(mValueSlots.begin() + index);
+    mSlots[lastSlot].mIndex = index;
+
+    release_slot(handle.index());
+    return true;
+}
+
+template <typename T>
+void slot_map<T>::clear() noexcept
+{
+    for (const std::uint32_t index: mValueSlots)
+        release_slot(index);
+    mValueSlots.clear();
+    mValues.clear();
+}
+
+}   // namespace bch
+
+#include "bch/common/header_suffix.hpp"
+
+#endif  // BCH_SLOT_MAP
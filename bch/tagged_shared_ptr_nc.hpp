@@ -0,0 +1,265 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#ifndef BCH_TAGGED_SHARED_PTR_NC
+#define BCH_TAGGED_SHARED_PTR_NC
+
+#pragma once
+
+#include <cstdint>
+#include <utility>
+
+#include "bch/shared_ptr_nc.hpp"
+
+#include "bch/common/header_prefix.hpp"
+
+namespace bch {
+
+namespace detail {
+
+// Number of low bits that are always zero in a pointer to a type with the given alignment
+constexpr unsigned int AlignmentBits(std::size_t alignment)
+{
+    unsigned int result = 0;
+    while ((alignment > 1) && ((alignment & 1) == 0))
+    {
+        alignment >>= 1;
+        ++result;
+    }
+    return result;
+}
+
+}   // namespace detail
+
+/* Shared pointer that stores a small user tag in the bits of its pointers that are
+always zero because of alignment.
+A shared_ptr_nc next to a few flag bits is padded to 24 bytes; a tagged_shared_ptr_nc
+is the size of a shared_ptr_nc (16 bytes on a 64 bit platform).
+
+The low bits of the instance pointer hold the low bits of the tag (log2(alignof(T))
+bits are available), and the low bits of the control block pointer hold the
+remaining bits (log2(alignof(ControlBlock)) bits are available: 3 on a 64 bit
+platform). The tag bits are masked out before the pointers are used.
+
+The high (unused) address bits are not used: they are not portable, and they are
+not available with hardware pointer tagging or 5-level paging.
+
+Usage:
+/code
+    bch::tagged_shared_ptr_nc<Node, 2> edge(node, kLeaf | kDirty);
+    if (edge.tag() & kLeaf)
+        edge->Visit();
+/endcode
+*/
+template <typename T, unsigned int Bits>
+class tagged_shared_ptr_nc
+{
+public:
+    using element_type = T;
+    using tag_type = std::uintptr_t;
+
+    // Number of tag bits stored in the instance and control block pointers
+    static constexpr unsigned int kPtrTagBits =
+        (Bits < detail::AlignmentBits(alignof(T))) ? Bits : detail::AlignmentBits(alignof(T));
+    static constexpr unsigned int kHandleTagBits = Bits - kPtrTagBits;
+
+    static_assert(kHandleTagBits <= detail::AlignmentBits(alignof(detail::ControlBlock)),
+        "not enough alignment bits for the requested number of tag bits");
+
+    static constexpr tag_type kTagMask = (tag_type(1) << Bits) - 1;
+
+    constexpr tagged_shared_ptr_nc() noexcept = default;
+    constexpr tagged_shared_ptr_nc(std::nullptr_t) noexcept {}
+
+    explicit tagged_shared_ptr_nc(const shared_ptr_nc<T>& ptr, tag_type tag = 0) noexcept;
+    explicit tagged_shared_ptr_nc(shared_ptr_nc<T>&& ptr, tag_type tag = 0) noexcept;
+
+    tagged_shared_ptr_nc(const tagged_shared_ptr_nc& ptr) noexcept;
+    tagged_shared_ptr_nc(tagged_shared_ptr_nc&& ptr) noexcept;
+
+    ~tagged_shared_ptr_nc();
+
+    tagged_shared_ptr_nc& operator=(const tagged_shared_ptr_nc& ptr);
+    tagged_shared_ptr_nc& operator=(tagged_shared_ptr_nc&& ptr) noexcept;
+
+    void swap(tagged_shared_ptr_nc& ptr) noexcept;
+
+    // Release the instance. The tag is kept.
+    void reset();
+    void reset(shared_ptr_nc<T> ptr, tag_type tag);
+
+    tag_type tag() const noexcept;
+    void set_tag(tag_type tag) noexcept;
+
+    // Return a shared pointer to the instance (without the tag)
+    shared_ptr_nc<T> share() const noexcept;
+
+    T* get() const noexcept {
+        return reinterpret_cast<T*>(mPtrBits & ~kPtrMask);
+    }
+
+    T& operator*() const noexcept {
+        return *get();
+    }
+
+    T* operator->() const noexcept {
+        return get();
+    }
+
+    explicit operator bool() const noexcept {
+        return (get() != nullptr);
+    }
+
+    long use_count() const noexcept {
+        detail::ControlBlock* const handle = this->handle();
+        return static_cast<long>((handle != nullptr) ? handle->use_count() : 0);
+    }
+
+private:
+    static constexpr tag_type kPtrMask = (tag_type(1) << kPtrTagBits) - 1;
+    static constexpr tag_type kHandleMask = (tag_type(1) << kHandleTagBits) - 1;
+
+    detail::ControlBlock* handle() const noexcept {
+        return reinterpret_cast<detail::ControlBlock*>(mHandleBits & ~kHandleMask);
+    }
+
+    // Take over the strong reference of ptr
+    void assign(shared_ptr_nc<T>& ptr, tag_type tag) noexcept;
+
+    std::uintptr_t  mPtrBits{0};
+    std::uintptr_t  mHandleBits{0};
+};
+
+template <typename T, unsigned int Bits>
+struct is_trivially_relocatable<tagged_shared_ptr_nc<T, Bits>>: std::true_type {};
+
+// -----------------------------------------------------------------------------
+
+template <typename T, unsigned int Bits>
+inline
+tagged_shared_ptr_nc<T, Bits>::tagged_shared_ptr_nc(const shared_ptr_nc<T>& ptr, tag_type tag) noexcept
+{
+    shared_ptr_nc<T> copy(ptr);
+    assign(copy, tag);
+}
+
+template <typename T, unsigned int Bits>
+inline
+tagged_shared_ptr_nc<T, Bits>::tagged_shared_ptr_nc(shared_ptr_nc<T>&& ptr, tag_type tag) noexcept
+{
+    assign(ptr, tag);
+}
+
+template <typename T, unsigned int Bits>
+inline
+tagged_shared_ptr_nc<T, Bits>::tagged_shared_ptr_nc(const tagged_shared_ptr_nc& ptr) noexcept :
+    mPtrBits(ptr.mPtrBits),
+    mHandleBits(ptr.mHandleBits)
+{
+    detail::ControlBlock* const handle = this->handle();
+    if (handle != nullptr)
+        handle->add_shared();
+}
+
+template <typename T, unsigned int Bits>
+inline
+tagged_shared_ptr_nc<T, Bits>::tagged_shared_ptr_nc(tagged_shared_ptr_nc&& ptr) noexcept :
+    mPtrBits(ptr.mPtrBits),
+    mHandleBits(ptr.mHandleBits)
+{
+    ptr.mPtrBits = 0;
+    ptr.mHandleBits = 0;
+}
+
+template <typename T, unsigned int Bits>
+inline
+tagged_shared_ptr_nc<T, Bits>::~tagged_shared_ptr_nc()
+{
+    detail::ControlBlock* const handle = this->handle();
+    if (handle != nullptr)
+        handle->release_shared();
+}
+
+template <typename T, unsigned int Bits>
+inline tagged_shared_ptr_nc<T, Bits>&
+tagged_shared_ptr_nc<T, Bits>::operator=(const tagged_shared_ptr_nc& ptr)
+{
+    tagged_shared_ptr_nc(ptr).swap(*this);
+    return *this;
+}
+
+template <typename T, unsigned int Bits>
+inline tagged_shared_ptr_nc<T, Bits>&
+tagged_shared_ptr_nc<T, Bits>::operator=(tagged_shared_ptr_nc&& ptr) noexcept
+{
+    tagged_shared_ptr_nc(std::move(ptr)).swap(*this);
+    return *this;
+}
+
+template <typename T, unsigned int Bits>
+inline void tagged_shared_ptr_nc<T, Bits>::swap(tagged_shared_ptr_nc& ptr) noexcept
+{
+    std::swap(mPtrBits, ptr.mPtrBits);
+    std::swap(mHandleBits, ptr.mHandleBits);
+}
+
+template <typename T, unsigned int Bits>
+inline void tagged_shared_ptr_nc<T, Bits>::reset()
+{
+    detail::ControlBlock* const handle = this->handle();
+    mPtrBits &= kPtrMask;
+    mHandleBits &= kHandleMask;
+    if (handle != nullptr)
+        handle->release_shared();
+}
+
+template <typename T, unsigned int Bits>
+inline void tagged_shared_ptr_nc<T, Bits>::reset(shared_ptr_nc<T> ptr, tag_type tag)
+{
+    tagged_shared_ptr_nc(std::move(ptr), tag).swap(*this);
+}
+
+template <typename T, unsigned int Bits>
+inline typename tagged_shared_ptr_nc<T, Bits>::tag_type
+tagged_shared_ptr_nc<T, Bits>::tag() const noexcept
+{
+    return (mPtrBits & kPtrMask) | ((mHandleBits & kHandleMask) << kPtrTagBits);
+}
+
+template <typename T, unsigned int Bits>
+inline void tagged_shared_ptr_nc<T, Bits>::set_tag(tag_type tag) noexcept
+{
+#if BCH_SMART_PTR_DEBUG
+    assert((tag & ~kTagMask) == 0);
+#endif
+
+    mPtrBits = (mPtrBits & ~kPtrMask) | (tag & kPtrMask);
+    mHandleBits = (mHandleBits & ~kHandleMask) | ((tag >> kPtrTagBits) & kHandleMask);
+}
+
+template <typename T, unsigned int Bits>
+inline shared_ptr_nc<T> tagged_shared_ptr_nc<T, Bits>::share() const noexcept
+{
+    return detail::SharedPtrAccess::make(handle(), get(), true);
+}
+
+template <typename T, unsigned int Bits>
+inline void tagged_shared_ptr_nc<T, Bits>::assign(shared_ptr_nc<T>& ptr, tag_type tag) noexcept
+{
+    mPtrBits = reinterpret_cast<std::uintptr_t>(ptr.get());
+    mHandleBits = reinterpret_cast<std::uintptr_t>(detail::SharedPtrAccess::handle(ptr));
+    detail::SharedPtrAccess::detach(ptr);
+
+#if BCH_SMART_PTR_DEBUG
+    assert(((mPtrBits & kPtrMask) == 0) && ((mHandleBits & kHandleMask) == 0));
+#endif
+
+    set_tag(tag);
+}
+
+}   // namespace bch
+
+#include "bch/common/header_suffix.hpp"
+
+#endif  // BCH_TAGGED_SHARED_PTR_NC
@@ -0,0 +1,232 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#ifndef BCH_UNIQUE_PTR_NC
+#define BCH_UNIQUE_PTR_NC
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdlib>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+#include "bch/shared_ptr_nc.hpp"
+#include "bch/common/memory.hpp"
+#include "bch/common/relocation.hpp"
+
+#include "bch/common/header_prefix.hpp"
+
+namespace bch {
+
+/* Unique owner of an instance created by make_unique_promotable.
+The instance is allocated with room for a control block in front of it (the layout
+of make_shared), but the control block is not constructed: a unique_ptr_nc is a
+single pointer with no reference counts. Promoting the pointer to a shared_ptr_nc
+constructs the control block in place, so sharing an instance never allocates, and
+the shared instance has the locality of make_shared.
+/code
+    bch::unique_ptr_nc<Node> node = bch::make_unique_promotable<Node>();
+    node->mValue = 1;
+    bch::shared_ptr_nc<Node> shared = std::move(node).to_shared();
+/endcode
+
+A unique_ptr_nc only converts to a pointer to its own type (the control block is
+located from the instance address); the promoted shared_ptr_nc converts as usual.
+For types deriving from enable_shared_from_this_inline, the control block is
+constructed with a strong reference count of 0 (see make_shared), so
+shared_from_this returns an empty pointer until the instance is promoted.
+*/
+template <typename T>
+class unique_ptr_nc
+{
+public:
+    static_assert(!std::is_const_v<T> && !std::is_array_v<T>, "unique_ptr_nc manages a non-const instance");
+
+    using element_type = T;
+
+    constexpr unique_ptr_nc() noexcept = default;
+
+    constexpr unique_ptr_nc(std::nullptr_t) noexcept
+    { }
+
+    unique_ptr_nc(unique_ptr_nc&& other) noexcept :
+        mPtr(other.mPtr)
+    {
+        other.mPtr = nullptr;
+    }
+
+    ~unique_ptr_nc() {
+        reset();
+    }
+
+    unique_ptr_nc& operator=(unique_ptr_nc&& other) noexcept;
+
+    T* get() const noexcept {
+        return mPtr;
+    }
+
+    T& operator*() const noexcept {
+        return *mPtr;
+    }
+
+    T* operator->() const noexcept {
+        return mPtr;
+    }
+
+    explicit operator bool() const noexcept {
+        return (mPtr != nullptr);
+    }
+
+    // Destroy the instance (if any) and release its memory
+    void reset();
+
+    void swap(unique_ptr_nc& other) noexcept {
+        std::swap(mPtr, other.mPtr);
+    }
+
+    /* Transfer the instance to a shared_ptr_nc by constructing its control block.
+    Does not allocate. The unique_ptr_nc is empty afterwards.
+    */
+    shared_ptr_nc<T> to_shared() && noexcept;
+
+    template <typename U, typename = std::enable_if_t<std::is_convertible_v<T*, U*>>>
+    operator shared_ptr_nc<U>() && noexcept {
+        return std::move(*this).to_shared();
+    }
+
+private:
+    unique_ptr_nc(const unique_ptr_nc&) = delete;
+    unique_ptr_nc& operator=(const unique_ptr_nc&) = delete;
+
+    template <typename U, typename ... Args>
+    friend unique_ptr_nc<U> make_unique_promotable(Args&& ... args);
+
+    typedef detail::ControlBlockDeleterInlineData<T> ControlBlockType;
+
+    // Types that locate their control block from the instance address (shared_from_this)
+    static constexpr bool kPendingControlBlock = std::is_base_of_v<detail::SharedFromThisInlineBase, T>;
+
+    explicit unique_ptr_nc(T* ptr) noexcept :
+        mPtr(ptr)
+    { }
+
+    /* Address of the control block of ptr: the start of the allocation. The control
+    block is only constructed (pending) if kPendingControlBlock is true.
+    */
+    static void* block(T* ptr) noexcept {
+        constexpr std::size_t kOffset = InstancePairOffset(sizeof(ControlBlockType), alignof(T));
+        return reinterpret_cast<char*>(ptr) - kOffset;
+    }
+
+    T*      mPtr{nullptr};
+};
+
+template <typename T>
+struct is_trivially_relocatable<unique_ptr_nc<T>>: std::true_type {};
+
+/* Create an instance of T with the layout of make_shared, owned by a unique_ptr_nc.
+Throws std::bad_alloc, or the exception thrown by the constructor of T.
+*/
+template <typename T, typename ... Args>
+unique_ptr_nc<T> make_unique_promotable(Args&& ... args);
+
+// -----------------------------------------------------------------------------
+
+template <typename T>
+inline unique_ptr_nc<T>& unique_ptr_nc<T>::operator=(unique_ptr_nc&& other) noexcept
+{
+    unique_ptr_nc(std::move(other)).swap(*this);
+    return *this;
+}
+
+template <typename T>
+inline void unique_ptr_nc<T>::reset()
+{
+    T* const ptr = mPtr;
+    if (ptr == nullptr)
+        return;
+
+    mPtr = nullptr;
+    ptr->~T();
+    if constexpr (kPendingControlBlock)
+        static_cast<ControlBlockType*>(block(ptr))->release_pending();
+    else
+        free(block(ptr));
+}
+
+template <typename T>
+inline shared_ptr_nc<T> unique_ptr_nc<T>::to_shared() && noexcept
+{
+    T* const ptr = mPtr;
+    if (ptr == nullptr)
+        return shared_ptr_nc<T>();
+
+    mPtr = nullptr;
+    ControlBlockType* cbPtr = nullptr;
+    if constexpr (kPendingControlBlock)
+    {
+        cbPtr = static_cast<ControlBlockType*>(block(ptr));
+        cbPtr->activate();
+    }
+    else
+    {
+        cbPtr = new (block(ptr)) ControlBlockType(ptr);
+    }
+    detail::set_shared_from_this<T>(ptr, cbPtr);
+    return detail::SharedPtrAccess::make<T>(cbPtr, ptr, false);
+}
+
+template <typename T, typename ... Args>
+unique_ptr_nc<T> make_unique_promotable(Args&& ... args)
+{
+    typedef detail::ControlBlockDeleterInlineData<T> ControlBlockType;
+
+    static_assert(alignof(T) <= alignof(std::max_align_t),
+        "the control block offset of an over-aligned type depends on the allocation address");
+    static_assert(!std::is_base_of_v<detail::SharedFromThisInlineBase, T> ||
+                  std::is_base_of_v<enable_shared_from_this_inline<T>, T>,
+        "make_unique_promotable must create the exact type that derives from enable_shared_from_this_inline");
+
+    void* cbAddress = nullptr;
+    void* instanceAddress = nullptr;
+    AllocateInstancePair(   sizeof(ControlBlockType),
+                            sizeof(T),
+                            alignof(T),
+                            cbAddress,
+                            instanceAddress);
+
+    // shared_from_this reads the strong reference count of the control block (see make_shared)
+    ControlBlockType* cbPtr = nullptr;
+    if constexpr (unique_ptr_nc<T>::kPendingControlBlock)
+        cbPtr = new (cbAddress) ControlBlockType(static_cast<T*>(instanceAddress), detail::ControlBlock::PendingTag());
+
+    T* ptr = nullptr;
+    try
+    {
+        ptr = new (instanceAddress) T(std::forward<Args>(args)...);
+    }
+    catch (...)
+    {
+        if (cbPtr != nullptr)
+            cbPtr->release_pending();
+        else
+            free(cbAddress);
+        throw;
+    }
+
+#if BCH_SMART_PTR_DEBUG
+    assert(unique_ptr_nc<T>::block(ptr) == cbAddress);
+#endif
+
+    return unique_ptr_nc<T>(ptr);
+}
+
+}   // namespace bch
+
+#include "bch/common/header_suffix.hpp"
+
+#endif  // BCH_UNIQUE_PTR_NC
@@ -0,0 +1,149 @@
+/**
+Copyright: Jesper Storm Bache (bache.name)
+*/
+
+#ifndef BCH_WEAK_VALUE_CACHE
+#define BCH_WEAK_VALUE_CACHE
+
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+
+#include "bch/expiry_listener.hpp"
+#include "bch/shared_ptr_nc.hpp"
+
+#include "bch/common/header_prefix.hpp"
+
+namespace bch {
+
+/* Cache of weak references to shared instances.
+The cache does not keep its values alive. Each entry listens for the expiry of its
+value (see expiry_listener) and is removed as soon as the value is released, so the
+cache only holds live values and lookups never find expired entries.
+
+Not thread safe: the cache must be used by one thread at a time, and its values
+must be released by that thread.
+*/
+template <typename K, typename T, typename Hash = std::hash<K>, typename KeyEqual = std::equal_to<K>>
+class weak_value_cache
+{
+public:
+    weak_value_cache() = default;
+
+    // Return the value of key (an empty pointer if the cache does not contain key)
+    shared_ptr_nc<T> find(const K& key) const;
+
+    /* Insert or replace the value of key. value must not be empty.
+    Throws std::bad_alloc.
+    */
+    void insert(const K& key, const shared_ptr_nc<T>& value);
+
+    /* Return the value of key, or insert the value returned by create() if the cache
+    does not contain key.
+    */
+    template <typename Function>
+    shared_ptr_nc<T> find_or_create(const K& key, Function&& create);
+
+    // Returns true if key was removed (the value is not affected)
+    bool erase(const K& key);
+
+    void clear() noexcept {
+        mEntries.clear();
+    }
+
+    std::size_t size() const noexcept {
+        return mEntries.size();
+    }
+
+private:
+    weak_value_cache(const weak_value_cache&) = delete;
+    weak_value_cache(weak_value_cache&&) = delete;
+    weak_value_cache& operator=(const weak_value_cache&) = delete;
+    weak_value_cache& operator=(weak_value_cache&&) = delete;
+
+    class Entry: public expiry_listener
+    {
+    public:
+        explicit Entry(weak_value_cache* cache) noexcept :
+            mCache(cache)
+        { }
+
+        weak_value_cache*   mCache;
+        // The key is stored in the map node (which does not move)
+        const K*            mKey{nullptr};
+        weak_ptr<T>         mValue;
+
+    protected:
+        virtual void on_expired() noexcept
+        {
+            // Destroys this entry
+            mCache->mEntries.erase(mCache->mEntries.find(*mKey));
+        }
+    };
+
+    std::unordered_map<K, std::unique_ptr<Entry>, Hash, KeyEqual>  mEntries;
+};
+
+// -----------------------------------------------------------------------------
+
+template <typename K, typename T, typename Hash, typename KeyEqual>
+shared_ptr_nc<T> weak_value_cache<K, T, Hash, KeyEqual>::find(const K& key) const
+{
+    const auto it = mEntries.find(key);
+    if (it == mEntries.end())
+        return shared_ptr_nc<T>();
+    return it->second->mValue.lock();
+}
+
+template <typename K, typename T, typename Hash, typename KeyEqual>
+void weak_value_cache<K, T, Hash, KeyEqual>::insert(const K& key, const shared_ptr_nc<T>& value)
+{
+    const auto result = mEntries.try_emplace(key);
+    try
+    {
+        if (result.second)
+        {
+            result.first->second.reset(new Entry(this));
+            result.first->second->mKey = &result.first->first;
+        }
+
+        Entry& entry = *result.first->second;
+        entry.listen(value);
+        entry.mValue = value;
+    }
+    catch (...)
+    {
+        if (result.second)
+            mEntries.erase(result.first);
+        throw;
+    }
+}
+
+template <typename K, typename T, typename Hash, typename KeyEqual>
+template <typename Function>
+shared_ptr_nc<T> weak_value_cache<K, T, Hash, KeyEqual>::find_or_create(const K& key, Function&& create)
+{
+    shared_ptr_nc<T> result = find(key);
+    if (!result)
+    {
+        result = create();
+        insert(key, result);
+    }
+    return result;
+}
+
+template <typename K, typename T, typename Hash, typename KeyEqual>
+bool weak_value_cache<K, T, Hash, KeyEqual>::erase(const K& key)
+{
+    return (mEntries.erase(key) != 0);
+}
+
+}   // namespace bch
+
+#include "bch/common/header_suffix.hpp"
+
+#endif  // BCH_WEAK_VALUE_CACHE
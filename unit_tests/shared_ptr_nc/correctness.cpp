@@ -5,11 +5,40 @@ Copyright: Jesper Storm Bache (bache.name)
 #include "correctness.hpp"
 
 #include "bch/shared_ptr_nc.hpp"
+#include "bch/compact_shared_ptr.hpp"
+#include "bch/cow_ptr_nc.hpp"
+#include "bch/deep_clone.hpp"
+#include "bch/expiry_listener.hpp"
+#include "bch/future_nc.hpp"
+#include "bch/graph_serializer.hpp"
+#include "bch/immortal.hpp"
+#include "bch/intern_table.hpp"
+#include "bch/lru_cache.hpp"
+#include "bch/movable_shared_ptr.hpp"
+#include "bch/offset_shared_ptr.hpp"
+#include "bch/persistent_map.hpp"
+#include "bch/ref_scope.hpp"
+#include "bch/relocatable_vector.hpp"
+#include "bch/shared_buffer_nc.hpp"
+#include "bch/shared_function_nc.hpp"
+#include "bch/shared_ptr_nc_vector.hpp"
+#include "bch/signal.hpp"
+#include "bch/slot_map.hpp"
+#include "bch/tagged_shared_ptr_nc.hpp"
+#include "bch/unique_ptr_nc.hpp"
+#include "bch/weak_value_cache.hpp"
 
 #if BCH_SMART_PTR_UNITTEST
 #include <iostream>
 #include <cassert>
+#include <cstring>
 #include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <unistd.h>
 
 namespace unittest {
 
@@ -1152,6 +1181,34 @@ struct Test04: public bch::enable_shared_from_this<Test04>
     ~Test04() = default;
 };
 
+struct Test05: public Test04
+{
+};
+
+struct Test06: public bch::enable_shared_from_this_inline<Test06>
+{
+    Test06()
+    {
+        // The strong reference count is 0 while the instance is constructed
+        UNITTEST_REQUIRE(shared_from_this() == nullptr);
+    }
+
+    explicit Test06(int value) :
+        mValue(value)
+    {
+        UNITTEST_REQUIRE(shared_from_this() == nullptr);
+        throw std::runtime_error("Test06");
+    }
+
+    ~Test06()
+    {
+        // The strong reference count is 0 while the instance is destroyed
+        UNITTEST_REQUIRE(shared_from_this() == nullptr);
+    }
+
+    int mValue{0};
+};
+
 void SharedFromThisTest()
 {
     {
@@ -1167,6 +1224,2046 @@ void SharedFromThisTest()
         auto foo2 = foo_ptr->shared_from_this();
         UNITTEST_REQUIRE(foo.get() == foo2.get());
     }
+
+    // Sub-class of a class that derives from enable_shared_from_this
+    {
+        bch::shared_ptr_nc<Test04> foo(new Test05);
+        auto foo2 = foo->shared_from_this();
+        UNITTEST_REQUIRE(foo.get() == foo2.get());
+        ValidateStrongCount(foo, 2);
+    }
+
+    // The association is kept when casting and locking
+    {
+        bch::shared_ptr_nc<Test05> foo = bch::make_shared<Test05>();
+        bch::shared_ptr_nc<Test04> bar = bch::static_pointer_cast<Test04>(foo);
+        bch::weak_ptr<Test04> weak(bar);
+        auto baz = weak.lock();
+        auto foo2 = baz->shared_from_this();
+        UNITTEST_REQUIRE(foo.get() == foo2.get());
+        ValidateStrongCount(foo, 4);
+    }
+
+    // Control block is calculated from the instance address
+    {
+        ControlBlockInstanceValidator cbValidator;
+        static_assert(sizeof(Test06) == sizeof(int), "enable_shared_from_this_inline must not add data");
+        {
+            bch::shared_ptr_nc<Test06> foo = bch::make_shared<Test06>();
+            auto foo2 = foo->shared_from_this();
+            UNITTEST_REQUIRE(foo.get() == foo2.get());
+            ValidateStrongCount(foo, 2);
+
+            const Test06* const constPtr = foo.get();
+            bch::shared_ptr_nc<const Test06> foo3 = constPtr->shared_from_this();
+            UNITTEST_REQUIRE(foo.get() == foo3.get());
+            ValidateStrongCount(foo, 3);
+            cbValidator.ValidateDelta(1);
+        }
+        cbValidator.ValidateInitialState();
+
+        // The control block is released when the constructor throws
+        bool exceptionThrown = false;
+        try
+        {
+            bch::make_shared<Test06>(1);
+        }
+        catch (const std::runtime_error&)
+        {
+            exceptionThrown = true;
+        }
+        UNITTEST_REQUIRE(exceptionThrown);
+        cbValidator.ValidateInitialState();
+    }
+}
+
+// -----------------------------------------------------------------------------
+
+void BorrowedMethod(bch::borrowed_ptr<TestInstance> ptr, uint32_t expectedStrongCount)
+{
+    UNITTEST_REQUIRE(ptr.get() != nullptr);
+    bch::shared_ptr_nc<TestInstance> owner = ptr.to_shared();
+    ValidateStrongCount(owner, expectedStrongCount + 1);
+}
+
+void BorrowedPtrTest()
+{
+    // null
+    {
+        bch::borrowed_ptr<TestInstance> foo;
+        UNITTEST_REQUIRE(!foo);
+        UNITTEST_REQUIRE(foo.to_shared() == nullptr);
+
+        bch::shared_ptr_nc<TestInstance> bar;
+        bch::borrowed_ptr<TestInstance> baz(bar);
+        UNITTEST_REQUIRE(baz.get() == nullptr);
+    }
+
+    // borrowing does not change the strong reference count
+    {
+        ControlBlockInstanceValidator cbValidator;
+        TestInstanceValidator testInstanceValidator;
+        {
+            bch::shared_ptr_nc<TestInstanceSubclass> foo = bch::make_shared<TestInstanceSubclass>();
+            bch::borrowed_ptr<TestInstanceSubclass> bar(foo);
+            bch::borrowed_ptr<TestInstance> baz(bar);
+            UNITTEST_REQUIRE(baz.get() == foo.get());
+            UNITTEST_REQUIRE(&*baz == foo.get());
+            ValidateStrongCount(foo, 1);
+#if BCH_SMART_PTR_DEBUG
+            // debug builds retain the control block while borrowed
+            ValidateWeakCount(foo, 2);
+#endif
+
+            BorrowedMethod(foo, 1);
+            ValidateStrongCount(foo, 1);
+
+            bch::shared_ptr_nc<TestInstance> owner = baz.to_shared();
+            ValidateStrongCount(foo, 2);
+            testInstanceValidator.ValidateDelta(1);
+        }
+        testInstanceValidator.ValidateInitialState();
+        cbValidator.ValidateInitialState();
+    }
+
+    // the control block outlives the instance while borrowed (debug builds)
+    {
+        ControlBlockInstanceValidator cbValidator;
+        {
+            bch::shared_ptr_nc<TestInstance> foo(new TestInstance);
+            bch::borrowed_ptr<TestInstance> bar(foo);
+            bch::borrowed_ptr<TestInstance> baz;
+            baz = bar;
+            foo.reset();
+#if BCH_SMART_PTR_DEBUG
+            cbValidator.ValidateDelta(1);
+#endif
+        }
+        cbValidator.ValidateInitialState();
+    }
+}
+
+// -----------------------------------------------------------------------------
+
+void RefScopeTest()
+{
+    // copies within the scope do not change the strong reference count
+    {
+        ControlBlockInstanceValidator cbValidator;
+        TestInstanceValidator testInstanceValidator;
+        {
+            bch::shared_ptr_nc<TestInstance> foo = bch::make_shared<TestInstance>();
+            bch::shared_ptr_nc<TestInstance> escaped;
+            {
+                bch::ref_scope scope;
+                bch::scoped_ptr_nc<TestInstance> bar = scope.share(foo);
+                ValidateStrongCount(foo, 2);
+
+                bch::scoped_ptr_nc<TestInstance> baz = scope.share(foo);
+                ValidateStrongCount(foo, 2);
+
+                for (int i = 0; i < 10; ++i)
+                {
+                    bch::scoped_ptr_nc<TestInstance> temp = bar;
+                    UNITTEST_REQUIRE(temp.get() == foo.get());
+                    ValidateStrongCount(foo, 2);
+                }
+
+                // the scope keeps the instance alive
+                foo.reset();
+                testInstanceValidator.ValidateDelta(1);
+
+                escaped = baz.to_shared();
+                ValidateStrongCount(escaped, 2);
+            }
+            ValidateStrongCount(escaped, 1);
+            testInstanceValidator.ValidateDelta(1);
+        }
+        testInstanceValidator.ValidateInitialState();
+        cbValidator.ValidateInitialState();
+    }
+
+    // more control blocks than the inline capacity
+    {
+        ControlBlockInstanceValidator cbValidator;
+        TestInstanceValidator testInstanceValidator;
+        {
+            const std::size_t count = bch::ref_scope::kInlineCapacity * 2 + 1;
+            std::vector<bch::shared_ptr_nc<TestInstance>> pointers;
+            for (std::size_t i = 0; i < count; ++i)
+                pointers.push_back(bch::make_shared<TestInstance>());
+
+            {
+                bch::ref_scope scope;
+                std::vector<bch::scoped_ptr_nc<TestInstance>> scoped;
+                for (std::size_t i = 0; i < count; ++i)
+                    scoped.push_back(scope.share(pointers[i]));
+
+                for (std::size_t i = 0; i < count; ++i)
+                {
+                    UNITTEST_REQUIRE(scoped[i].get() == pointers[i].get());
+                    ValidateStrongCount(pointers[i], 2);
+                }
+
+                bch::scoped_ptr_nc<TestInstance> null = scope.share(bch::shared_ptr_nc<TestInstance>());
+                UNITTEST_REQUIRE(!null);
+            }
+
+            for (std::size_t i = 0; i < count; ++i)
+                ValidateStrongCount(pointers[i], 1);
+        }
+        testInstanceValidator.ValidateInitialState();
+        cbValidator.ValidateInitialState();
+    }
+}
+
+// -----------------------------------------------------------------------------
+
+struct ImmortalValue
+{
+    constexpr explicit ImmortalValue(int value) :
+        mValue(value)
+    { }
+
+    int mValue;
+};
+
+struct ImmortalSharedFromThis: public bch::enable_shared_from_this<ImmortalSharedFromThis>
+{
+    constexpr ImmortalSharedFromThis() = default;
+};
+
+constinit bch::immortal<ImmortalValue> sImmortalValue(42);
+constinit bch::shared_ptr_nc<ImmortalValue> sImmortalPtr = sImmortalValue.share();
+constinit const bch::immortal<ImmortalValue> kImmortalConstant(7);
+bch::immortal<ImmortalSharedFromThis> sImmortalSharedFromThis;
+
+void ImmortalTest()
+{
+    ControlBlockInstanceValidator cbValidator;
+    {
+        UNITTEST_REQUIRE(sImmortalPtr->mValue == 42);
+        UNITTEST_REQUIRE(sImmortalPtr.get() == sImmortalValue.get());
+
+        const long count = sImmortalPtr.use_count();
+        {
+            bch::shared_ptr_nc<ImmortalValue> foo = sImmortalPtr;
+            bch::shared_ptr_nc<ImmortalValue> bar = sImmortalValue.share();
+            bar = foo;
+            bch::weak_ptr<ImmortalValue> weak(foo);
+            UNITTEST_REQUIRE(!weak.expired());
+            bch::shared_ptr_nc<ImmortalValue> baz = weak.lock();
+            UNITTEST_REQUIRE(baz.get() == sImmortalValue.get());
+            UNITTEST_REQUIRE(sImmortalPtr.use_count() == count);
+            UNITTEST_REQUIRE(!sImmortalPtr.unique());
+        }
+        UNITTEST_REQUIRE(sImmortalPtr.use_count() == count);
+
+        bch::shared_ptr_nc<const ImmortalValue> constant = kImmortalConstant.share();
+        UNITTEST_REQUIRE(constant->mValue == 7);
+
+        bch::shared_ptr_nc<ImmortalSharedFromThis> foo = sImmortalSharedFromThis.get()->shared_from_this();
+        UNITTEST_REQUIRE(foo.get() == sImmortalSharedFromThis.get());
+    }
+    cbValidator.ValidateInitialState();
+}
+
+// -----------------------------------------------------------------------------
+
+struct RefCountTableWrapper
+{
+    static uint32_t LiveInstanceCount()
+    {
+        return bch::detail::RefCountTable::live_entry_count();
+    }
+};
+
+typedef InstanceValidator<RefCountTableWrapper>      RefCountTableValidator;
+
+struct Test07: public bch::enable_shared_from_this_inline<Test07>
+{
+    int mValue{3};
+};
+
+void OutOfLineTest()
+{
+    // reference counting
+    {
+        ControlBlockInstanceValidator cbValidator;
+        TestInstanceValidator testInstanceValidator;
+        RefCountTableValidator tableValidator;
+        {
+            bch::shared_ptr_nc<TestInstance> foo = bch::make_shared_out_of_line<TestInstance>();
+            testInstanceValidator.ValidateDelta(1);
+            cbValidator.ValidateDelta(1);
+            tableValidator.ValidateDelta(1);
+            ValidateStrongCount(foo, 1);
+            ValidateWeakCount(foo, 0);
+
+            bch::shared_ptr_nc<TestInstance> bar(foo);
+            ValidateStrongCount(foo, 2);
+
+            bch::weak_ptr<TestInstance> weak(foo);
+            ValidateWeakCount(foo, 1);
+
+            foo.reset();
+            bar.reset();
+            testInstanceValidator.ValidateDelta(0);
+            UNITTEST_REQUIRE(weak.expired());
+            cbValidator.ValidateDelta(1);
+            tableValidator.ValidateDelta(1);
+
+            weak.reset();
+            cbValidator.ValidateDelta(0);
+            tableValidator.ValidateDelta(0);
+
+            // released entries are reused
+            bch::shared_ptr_nc<TestInstance> baz = bch::make_shared_out_of_line<TestInstance>();
+            tableValidator.ValidateDelta(1);
+        }
+        testInstanceValidator.ValidateInitialState();
+        cbValidator.ValidateInitialState();
+        tableValidator.ValidateInitialState();
+    }
+
+    // the memory of the instance and the control block is not written when sharing
+    {
+        typedef bch::detail::ControlBlockDeleterInlineData<Test07> ControlBlockType;
+        const std::size_t kSize = bch::InstancePairOffset(sizeof(ControlBlockType), alignof(Test07)) + sizeof(Test07);
+
+        bch::shared_ptr_nc<Test07> foo = bch::make_shared_out_of_line<Test07>();
+        const char* const block = reinterpret_cast<const char*>(bch::detail::inline_control_block(foo.get()));
+        char snapshot[kSize];
+        memcpy(snapshot, block, kSize);
+        {
+            bch::shared_ptr_nc<Test07> bar(foo);
+            bch::shared_ptr_nc<Test07> baz = foo->shared_from_this();
+            bch::weak_ptr<Test07> weak(bar);
+            bch::shared_ptr_nc<Test07> locked = weak.lock();
+            ValidateStrongCount(foo, 4);
+            ValidateWeakCount(foo, 1);
+            UNITTEST_REQUIRE(memcmp(snapshot, block, kSize) == 0);
+        }
+        ValidateStrongCount(foo, 1);
+        UNITTEST_REQUIRE(memcmp(snapshot, block, kSize) == 0);
+    }
+}
+
+// Instance that stores a pointer to itself (not trivially relocatable)
+class SelfPointer
+{
+public:
+    explicit SelfPointer(int value) noexcept : mSelf(this), mValue(value) {}
+    SelfPointer(const SelfPointer& other) noexcept : mSelf(this), mValue(other.mValue) {}
+    SelfPointer(SelfPointer&& other) noexcept : mSelf(this), mValue(other.mValue) {}
+    ~SelfPointer() {
+        mSelf = nullptr;
+    }
+
+    bool valid() const {
+        return (mSelf == this);
+    }
+
+    int value() const {
+        return mValue;
+    }
+
+private:
+    SelfPointer*    mSelf;
+    int             mValue;
+};
+
+// Instance whose copy constructor throws after a number of copies
+class ThrowingCopy
+{
+public:
+    ThrowingCopy() noexcept
+    {
+        ++sLiveCount;
+    }
+
+    ThrowingCopy(const ThrowingCopy&)
+    {
+        if (sCopiesLeft-- == 0)
+            throw std::runtime_error("ThrowingCopy");
+        ++sLiveCount;
+    }
+
+    ThrowingCopy(ThrowingCopy&&) noexcept
+    {
+        ++sLiveCount;
+    }
+
+    ~ThrowingCopy()
+    {
+        --sLiveCount;
+    }
+
+    static int  sLiveCount;
+    static int  sCopiesLeft;
+};
+
+int ThrowingCopy::sLiveCount = 0;
+int ThrowingCopy::sCopiesLeft = 1000;
+
+void RelocationTest()
+{
+    static_assert(bch::is_trivially_relocatable_v<bch::shared_ptr_nc<TestInstance>>);
+    static_assert(bch::is_trivially_relocatable_v<bch::weak_ptr<TestInstance>>);
+    static_assert(bch::is_trivially_relocatable_v<bch::borrowed_ptr<TestInstance>>);
+    static_assert(bch::is_trivially_relocatable_v<int>);
+    static_assert(!bch::is_trivially_relocatable_v<SelfPointer>);
+
+    static_assert(std::is_nothrow_move_constructible_v<bch::shared_ptr_nc<TestInstance>>);
+    static_assert(std::is_nothrow_move_assignable_v<bch::shared_ptr_nc<TestInstance>>);
+    static_assert(std::is_nothrow_move_constructible_v<bch::weak_ptr<TestInstance>>);
+    static_assert(std::is_nothrow_move_assignable_v<bch::weak_ptr<TestInstance>>);
+
+    // growth and erase do not change the reference counts
+    {
+        ControlBlockInstanceValidator cbValidator;
+        TestInstanceValidator testInstanceValidator;
+        {
+            bch::shared_ptr_nc<TestInstance> foo = bch::make_shared<TestInstance>();
+            bch::shared_ptr_nc<TestInstance> bar = bch::make_shared<TestInstance>();
+            bch::relocatable_vector<bch::shared_ptr_nc<TestInstance>> pointers;
+            bch::relocatable_vector<bch::weak_ptr<TestInstance>> weakPointers;
+            for (int index = 0; index < 100; ++index)
+            {
+                pointers.push_back(foo);
+                weakPointers.emplace_back(bar);
+            }
+            UNITTEST_REQUIRE(pointers.size() == 100);
+            ValidateStrongCount(foo, 101);
+            ValidateWeakCount(bar, 100);
+
+            // the new element may refer to an element in the vector
+            while (pointers.size() != pointers.capacity())
+                pointers.push_back(foo);
+            pointers.push_back(pointers[0]);
+            ValidateStrongCount(foo, static_cast<uint32_t>(pointers.size() + 1));
+
+            pointers.erase(pointers.begin() + 10, pointers.end());
+            ValidateStrongCount(foo, 11);
+            pointers.erase(pointers.begin());
+            ValidateStrongCount(foo, 10);
+            for (const bch::shared_ptr_nc<TestInstance>& ptr: pointers)
+                UNITTEST_REQUIRE(ptr == foo);
+
+            bch::relocatable_vector<bch::shared_ptr_nc<TestInstance>> copy(pointers);
+            ValidateStrongCount(foo, 19);
+            bch::relocatable_vector<bch::shared_ptr_nc<TestInstance>> moved(std::move(copy));
+            ValidateStrongCount(foo, 19);
+            UNITTEST_REQUIRE(copy.empty());
+
+            moved.pop_back();
+            ValidateStrongCount(foo, 18);
+            moved.clear();
+            ValidateStrongCount(foo, 10);
+
+            weakPointers.clear();
+            ValidateWeakCount(bar, 0);
+        }
+        testInstanceValidator.ValidateInitialState();
+        cbValidator.ValidateInitialState();
+    }
+
+    // types that are not trivially relocatable are moved
+    {
+        bch::relocatable_vector<SelfPointer> values;
+        for (int index = 0; index < 100; ++index)
+            values.emplace_back(index);
+        values.erase(values.begin() + 10, values.begin() + 20);
+        UNITTEST_REQUIRE(values.size() == 90);
+        for (std::size_t index = 0; index < values.size(); ++index)
+        {
+            UNITTEST_REQUIRE(values[index].valid());
+            UNITTEST_REQUIRE(values[index].value() == static_cast<int>((index < 10) ? index : (index + 10)));
+        }
+    }
+
+    // the elements and the buffer are released when a copy throws
+    {
+        {
+            const ThrowingCopy value;
+            bch::relocatable_vector<ThrowingCopy> values{value, value, value};
+            UNITTEST_REQUIRE(ThrowingCopy::sLiveCount == 4);
+            ThrowingCopy::sCopiesLeft = 1;
+            bool exceptionThrown = false;
+            try
+            {
+                bch::relocatable_vector<ThrowingCopy> copy(values);
+            }
+            catch (const std::runtime_error&)
+            {
+                exceptionThrown = true;
+            }
+            UNITTEST_REQUIRE(exceptionThrown);
+            UNITTEST_REQUIRE(ThrowingCopy::sLiveCount == 4);
+
+            // the initializer list holds three copies
+            ThrowingCopy::sCopiesLeft = 4;
+            exceptionThrown = false;
+            try
+            {
+                bch::relocatable_vector<ThrowingCopy> list{value, value, value};
+            }
+            catch (const std::runtime_error&)
+            {
+                exceptionThrown = true;
+            }
+            UNITTEST_REQUIRE(exceptionThrown);
+            UNITTEST_REQUIRE(ThrowingCopy::sLiveCount == 4);
+        }
+        UNITTEST_REQUIRE(ThrowingCopy::sLiveCount == 0);
+    }
+}
+
+void SharedPtrVectorTest()
+{
+    ControlBlockInstanceValidator cbValidator;
+    TestInstanceValidator testInstanceValidator;
+    {
+        bch::shared_ptr_nc<TestInstance> foo = bch::make_shared<TestInstance>();
+        bch::shared_ptr_nc<TestInstance> bar(new TestInstance);
+
+        bch::shared_ptr_nc_vector<TestInstance> pointers;
+        pointers.fill(foo, 10);
+        ValidateStrongCount(foo, 11);
+        pointers.push_back(bar);
+        pointers.push_back(bch::shared_ptr_nc<TestInstance>());
+        pointers.push_back(bch::make_shared<TestInstance>());
+        testInstanceValidator.ValidateDelta(3);
+        UNITTEST_REQUIRE(pointers.size() == 13);
+        UNITTEST_REQUIRE(pointers.get(0) == foo.get());
+        UNITTEST_REQUIRE(pointers.get(11) == nullptr);
+        UNITTEST_REQUIRE(pointers.share(10) == bar);
+        ValidateStrongCount(bar, 2);
+
+        // copies add one reference per entry (grouped by control block)
+        {
+            bch::shared_ptr_nc_vector<TestInstance> copy(pointers);
+            ValidateStrongCount(foo, 21);
+            ValidateStrongCount(bar, 3);
+            copy.append(copy);
+            UNITTEST_REQUIRE(copy.size() == 26);
+            ValidateStrongCount(foo, 31);
+            ValidateStrongCount(bar, 4);
+
+            bch::shared_ptr_nc_vector<TestInstance> moved(std::move(copy));
+            UNITTEST_REQUIRE(copy.empty());
+            ValidateStrongCount(foo, 31);
+        }
+        ValidateStrongCount(foo, 11);
+        ValidateStrongCount(bar, 2);
+
+        int visited = 0;
+        pointers.for_each([&](TestInstance&) { ++visited; });
+        UNITTEST_REQUIRE(visited == 12);
+
+        // only the last entry holds the only reference to its instance
+        UNITTEST_REQUIRE(pointers.count_unique() == 1);
+        UNITTEST_REQUIRE(pointers.erase_unique() == 1);
+        testInstanceValidator.ValidateDelta(2);
+        UNITTEST_REQUIRE(pointers.size() == 12);
+
+        bar.reset();
+        UNITTEST_REQUIRE(pointers.count_unique() == 1);
+        pointers.set(10, foo);
+        testInstanceValidator.ValidateDelta(1);
+        ValidateStrongCount(foo, 12);
+
+        pointers.pop_back();
+        pointers.pop_back();
+        ValidateStrongCount(foo, 11);
+
+        // immortal and out of line control blocks
+        bch::shared_ptr_nc_vector<ImmortalValue> immortals;
+        immortals.fill(sImmortalPtr, 4);
+        immortals.append(immortals);
+        UNITTEST_REQUIRE(immortals.count_unique() == 0);
+        immortals.clear();
+        bch::shared_ptr_nc<TestInstance> baz = bch::make_shared_out_of_line<TestInstance>();
+        pointers.fill(baz, 4);
+        ValidateStrongCount(baz, 5);
+
+        pointers.clear();
+        UNITTEST_REQUIRE(pointers.empty());
+        ValidateStrongCount(foo, 1);
+        ValidateStrongCount(baz, 1);
+    }
+    testInstanceValidator.ValidateInitialState();
+    cbValidator.ValidateInitialState();
+}
+
+void TaggedPtrTest()
+{
+    typedef bch::tagged_shared_ptr_nc<TestInstanceVtable, 5> TaggedPtr;
+    static_assert(sizeof(TaggedPtr) == sizeof(bch::shared_ptr_nc<TestInstanceVtable>));
+    static_assert(sizeof(bch::tagged_shared_ptr_nc<char, 3>) == sizeof(bch::shared_ptr_nc<char>));
+
+    ControlBlockInstanceValidator cbValidator;
+    TestInstanceVtableValidator testInstanceValidator;
+    {
+        bch::shared_ptr_nc<TestInstanceVtable> foo = bch::make_shared<TestInstanceVtable>();
+        TaggedPtr tagged(foo, 0x15);
+        UNITTEST_REQUIRE(tagged.get() == foo.get());
+        UNITTEST_REQUIRE(tagged.tag() == 0x15);
+        ValidateStrongCount(foo, 2);
+
+        TaggedPtr copy(tagged);
+        UNITTEST_REQUIRE(copy.get() == foo.get());
+        UNITTEST_REQUIRE(copy.tag() == 0x15);
+        ValidateStrongCount(foo, 3);
+
+        copy.set_tag(0x0A);
+        UNITTEST_REQUIRE(copy.tag() == 0x0A);
+        UNITTEST_REQUIRE(tagged.tag() == 0x15);
+        UNITTEST_REQUIRE(copy.get() == foo.get());
+        UNITTEST_REQUIRE(copy.use_count() == 3);
+
+        bch::shared_ptr_nc<TestInstanceVtable> shared = copy.share();
+        UNITTEST_REQUIRE(shared == foo);
+        ValidateStrongCount(foo, 4);
+        shared.reset();
+
+        // reset keeps the tag
+        copy.reset();
+        UNITTEST_REQUIRE(!copy);
+        UNITTEST_REQUIRE(copy.tag() == 0x0A);
+        ValidateStrongCount(foo, 2);
+
+        copy = std::move(tagged);
+        UNITTEST_REQUIRE(!tagged);
+        UNITTEST_REQUIRE(copy.tag() == 0x15);
+        ValidateStrongCount(foo, 2);
+
+        copy.reset(bch::make_shared<TestInstanceVtable>(), 0x1F);
+        UNITTEST_REQUIRE(copy.tag() == 0x1F);
+        UNITTEST_REQUIRE(copy.use_count() == 1);
+        testInstanceValidator.ValidateDelta(2);
+        ValidateStrongCount(foo, 1);
+
+        // character pointers have no spare bits: the tag is stored in the control block pointer
+        bch::tagged_shared_ptr_nc<char, 3> character(bch::make_shared<char>('a'), 5);
+        UNITTEST_REQUIRE(*character == 'a');
+        UNITTEST_REQUIRE(character.tag() == 5);
+    }
+    testInstanceValidator.ValidateInitialState();
+    cbValidator.ValidateInitialState();
+}
+
+struct ThrowingInstance
+{
+    explicit ThrowingInstance(bool shouldThrow)
+    {
+        if (shouldThrow)
+            throw std::runtime_error("ThrowingInstance");
+    }
+};
+
+void CompactPtrTest()
+{
+    static_assert(sizeof(bch::compact_shared_ptr<TestInstance>) == 8);
+
+    ControlBlockInstanceValidator cbValidator;
+    TestInstanceValidator testInstanceValidator;
+    {
+        bch::compact_region<TestInstance> region(2);
+        UNITTEST_REQUIRE(region.capacity() == 2);
+        {
+            bch::compact_shared_ptr<TestInstance> foo = region.make_shared();
+            testInstanceValidator.ValidateDelta(1);
+            cbValidator.ValidateDelta(1);
+            UNITTEST_REQUIRE(region.size() == 1);
+            UNITTEST_REQUIRE(foo.use_count() == 1);
+
+            bch::compact_shared_ptr<TestInstance> bar(foo);
+            UNITTEST_REQUIRE(bar == foo);
+            UNITTEST_REQUIRE(bar.get() == foo.get());
+            UNITTEST_REQUIRE(foo.use_count() == 2);
+
+            // conversion to shared_ptr_nc and weak_ptr
+            bch::shared_ptr_nc<TestInstance> shared = foo.to_shared();
+            UNITTEST_REQUIRE(shared.get() == foo.get());
+            ValidateStrongCount(shared, 3);
+            bch::weak_ptr<TestInstance> weak(shared);
+            shared.reset();
+            bar.reset();
+            foo.reset();
+            UNITTEST_REQUIRE(!foo);
+            testInstanceValidator.ValidateDelta(0);
+            UNITTEST_REQUIRE(weak.expired());
+
+            // the slot is in use until the weak reference is released
+            UNITTEST_REQUIRE(region.size() == 1);
+            weak.reset();
+            UNITTEST_REQUIRE(region.size() == 0);
+            cbValidator.ValidateDelta(0);
+
+            // released slots are reused, and a full region throws
+            bch::compact_shared_ptr<TestInstance> first = region.make_shared();
+            bch::compact_shared_ptr<TestInstance> second = region.make_shared();
+            UNITTEST_REQUIRE(first.get() != second.get());
+            bool exceptionThrown = false;
+            try
+            {
+                bch::compact_shared_ptr<TestInstance> third = region.make_shared();
+            }
+            catch (const std::bad_alloc&)
+            {
+                exceptionThrown = true;
+            }
+            UNITTEST_REQUIRE(exceptionThrown);
+            testInstanceValidator.ValidateDelta(2);
+        }
+        UNITTEST_REQUIRE(region.size() == 0);
+
+        // a constructor that throws releases the slot
+        bch::compact_region<ThrowingInstance> throwingRegion(1);
+        bool exceptionThrown = false;
+        try
+        {
+            throwingRegion.make_shared(true);
+        }
+        catch (const std::runtime_error&)
+        {
+            exceptionThrown = true;
+        }
+        UNITTEST_REQUIRE(exceptionThrown);
+        UNITTEST_REQUIRE(throwingRegion.size() == 0);
+        bch::compact_shared_ptr<ThrowingInstance> instance = throwingRegion.make_shared(false);
+        UNITTEST_REQUIRE(instance.get() != nullptr);
+    }
+    testInstanceValidator.ValidateInitialState();
+    cbValidator.ValidateInitialState();
+}
+
+void MovableHeapTest()
+{
+    static_assert(sizeof(bch::movable_shared_ptr<int>) == sizeof(void*));
+
+    ControlBlockInstanceValidator cbValidator;
+    {
+        bch::movable_heap<SelfPointer> heap;
+        std::vector<bch::movable_shared_ptr<SelfPointer>> pointers;
+        const int kCount = 20000;
+        for (int index = 0; index < kCount; ++index)
+            pointers.push_back(heap.make_shared(index));
+        cbValidator.ValidateDelta(kCount);
+        UNITTEST_REQUIRE(heap.size() == kCount);
+        const std::size_t pageCount = heap.page_count();
+        UNITTEST_REQUIRE(pageCount > 4);
+
+        // keep every fourth instance
+        std::vector<bch::movable_shared_ptr<SelfPointer>> kept;
+        for (int index = 0; index < kCount; index += 4)
+            kept.push_back(pointers[index]);
+        UNITTEST_REQUIRE(kept[1].use_count() == 2);
+        pointers.clear();
+        UNITTEST_REQUIRE(heap.size() == kept.size());
+        UNITTEST_REQUIRE(heap.page_count() == pageCount);
+
+        const SelfPointer* before = kept.back().get();
+        const std::size_t released = heap.compact();
+        UNITTEST_REQUIRE(released >= pageCount / 2);
+        UNITTEST_REQUIRE(heap.page_count() == pageCount - released);
+        UNITTEST_REQUIRE(kept.back().get() != before);
+
+        for (std::size_t index = 0; index < kept.size(); ++index)
+        {
+            UNITTEST_REQUIRE(kept[index]->valid());
+            UNITTEST_REQUIRE(kept[index]->value() == static_cast<int>(index * 4));
+            UNITTEST_REQUIRE(kept[index].use_count() == 1);
+        }
+
+        // compacting a dense heap does not move instances
+        const SelfPointer* first = kept.front().get();
+        UNITTEST_REQUIRE(heap.compact() == 0);
+        UNITTEST_REQUIRE(kept.front().get() == first);
+
+        // freed slots are reused
+        bch::movable_shared_ptr<SelfPointer> extra = heap.make_shared(-1);
+        UNITTEST_REQUIRE(extra->value() == -1);
+        UNITTEST_REQUIRE(heap.page_count() == pageCount - released);
+
+        kept.clear();
+        extra.reset();
+        UNITTEST_REQUIRE(heap.size() == 0);
+        const std::size_t remaining = heap.page_count();
+        UNITTEST_REQUIRE(heap.compact() == remaining);
+        UNITTEST_REQUIRE(heap.page_count() == 0);
+    }
+    cbValidator.ValidateInitialState();
+}
+
+struct SegmentNode
+{
+    SegmentNode(int value, bch::offset_shared_ptr<SegmentNode> next) :
+        mValue(value),
+        mNext(std::move(next))
+    {
+        ++sInstanceCount;
+    }
+
+    ~SegmentNode()
+    {
+        --sInstanceCount;
+    }
+
+    int                                 mValue;
+    bch::offset_shared_ptr<SegmentNode> mNext;
+
+    static int  sInstanceCount;
+};
+int SegmentNode::sInstanceCount = 0;
+
+void OffsetPtrTest()
+{
+    const std::size_t kSize = 64 * 1024;
+    void* const memory = malloc(kSize);
+    void* const copy = malloc(kSize);
+    {
+        bch::shared_segment* const segment = bch::shared_segment::create(memory, kSize);
+        UNITTEST_REQUIRE(bch::shared_segment::attach(memory, kSize) == segment);
+        UNITTEST_REQUIRE(bch::shared_segment::attach(memory, kSize / 2) == nullptr);
+
+        // list of 10 nodes: 9 -> 8 -> ... -> 0
+        bch::offset_shared_ptr<SegmentNode> head;
+        for (int index = 0; index < 10; ++index)
+            head = segment->make_shared<SegmentNode>(index, head);
+        UNITTEST_REQUIRE(SegmentNode::sInstanceCount == 10);
+        UNITTEST_REQUIRE(head.use_count() == 1);
+
+        bch::offset_shared_ptr<SegmentNode> second = head->mNext;
+        UNITTEST_REQUIRE(second.use_count() == 2);
+        UNITTEST_REQUIRE(second == head->mNext);
+        second.reset();
+
+        segment->set_root(head);
+        UNITTEST_REQUIRE(head.use_count() == 2);
+        head.reset();
+        UNITTEST_REQUIRE(SegmentNode::sInstanceCount == 10);
+
+        // the segment is valid at another address (a mapping in another process)
+        memcpy(copy, memory, kSize);
+        bch::shared_segment* const mapped = bch::shared_segment::attach(copy, kSize);
+        UNITTEST_REQUIRE(mapped != nullptr);
+        int expected = 9;
+        for (const SegmentNode* node = mapped->root<SegmentNode>(); node != nullptr; node = node->mNext.get())
+        {
+            UNITTEST_REQUIRE((reinterpret_cast<const char*>(node) > static_cast<const char*>(copy)) &&
+                             (reinterpret_cast<const char*>(node) < static_cast<const char*>(copy) + kSize));
+            UNITTEST_REQUIRE(node->mValue == expected);
+            --expected;
+        }
+        UNITTEST_REQUIRE(expected == -1);
+
+        // releasing the root releases the list, and the memory is reused
+        const std::size_t unused = segment->unused_size();
+        segment->reset_root<SegmentNode>();
+        UNITTEST_REQUIRE(SegmentNode::sInstanceCount == 0);
+        UNITTEST_REQUIRE(segment->root<SegmentNode>() == nullptr);
+        bch::offset_shared_ptr<SegmentNode> reused = segment->make_shared<SegmentNode>(0, nullptr);
+        UNITTEST_REQUIRE(segment->unused_size() == unused);
+        reused.reset();
+
+        // a full segment throws
+        bool exceptionThrown = false;
+        try
+        {
+            segment->allocate(kSize);
+        }
+        catch (const std::bad_alloc&)
+        {
+            exceptionThrown = true;
+        }
+        UNITTEST_REQUIRE(exceptionThrown);
+    }
+    free(copy);
+    free(memory);
+}
+
+struct GraphPoint
+{
+    double  mX;
+    double  mY;
+};
+
+struct GraphNode
+{
+    GraphNode(int value, bch::shared_ptr_nc<GraphNode> left, bch::shared_ptr_nc<GraphNode> right,
+              bch::shared_ptr_nc<const GraphPoint> point) :
+        mValue(value),
+        mLeft(std::move(left)),
+        mRight(std::move(right)),
+        mPoint(std::move(point))
+    { }
+
+    int                                     mValue;
+    bch::shared_ptr_nc<GraphNode>           mLeft;
+    bch::shared_ptr_nc<GraphNode>           mRight;
+    bch::shared_ptr_nc<const GraphPoint>    mPoint;
+};
+
+void serialize(bch::graph_writer& writer, const GraphNode& node)
+{
+    writer.write_value(node.mValue);
+    writer.write(node.mLeft);
+    writer.write(node.mRight);
+    writer.write_trivial(node.mPoint);
+}
+
+bch::shared_ptr_nc<GraphNode> deserialize(bch::graph_reader& reader, bch::graph_type<GraphNode>)
+{
+    const int value = reader.read_value<int>();
+    bch::shared_ptr_nc<GraphNode> left = reader.read<GraphNode>();
+    bch::shared_ptr_nc<GraphNode> right = reader.read<GraphNode>();
+    bch::shared_ptr_nc<const GraphPoint> point = reader.read_trivial<GraphPoint>();
+    return bch::make_shared<GraphNode>(value, std::move(left), std::move(right), std::move(point));
+}
+
+void ValidateGraph(const bch::shared_ptr_nc<GraphNode>& root)
+{
+    // diamond: root -> (a, b), a -> (c, c), b -> (c, null)
+    UNITTEST_REQUIRE(root->mValue == 1);
+    const bch::shared_ptr_nc<GraphNode>& c = root->mLeft->mLeft;
+    UNITTEST_REQUIRE(root->mLeft->mValue == 2);
+    UNITTEST_REQUIRE(root->mRight->mValue == 3);
+    UNITTEST_REQUIRE(c->mValue == 4);
+    UNITTEST_REQUIRE(root->mLeft->mRight == c);
+    UNITTEST_REQUIRE(root->mRight->mLeft == c);
+    UNITTEST_REQUIRE(!root->mRight->mRight);
+    UNITTEST_REQUIRE(c.use_count() == 3);
+    UNITTEST_REQUIRE(root->mPoint->mX == 1.5);
+    UNITTEST_REQUIRE(root->mPoint == c->mPoint);
+    UNITTEST_REQUIRE(!root->mLeft->mPoint);
+}
+
+void GraphSerializerTest()
+{
+    ControlBlockInstanceValidator cbValidator;
+    {
+        bch::shared_ptr_nc<const GraphPoint> point = bch::make_shared<GraphPoint>(GraphPoint{1.5, 2.5});
+        bch::shared_ptr_nc<GraphNode> c = bch::make_shared<GraphNode>(4, nullptr, nullptr, point);
+        bch::shared_ptr_nc<GraphNode> a = bch::make_shared<GraphNode>(2, c, c, nullptr);
+        bch::shared_ptr_nc<GraphNode> b = bch::make_shared<GraphNode>(3, c, nullptr, nullptr);
+        bch::shared_ptr_nc<GraphNode> root = bch::make_shared<GraphNode>(1, a, b, point);
+        a.reset();
+        b.reset();
+        c.reset();
+        point.reset();
+        ValidateGraph(root);
+
+        bch::graph_writer writer;
+        writer.write(root);
+        const std::vector<char>& image = writer.image();
+
+        // load from memory
+        bch::shared_ptr_nc<GraphNode> loaded;
+        {
+            bch::graph_reader reader(bch::graph_image::copy(image.data(), image.size()));
+            loaded = reader.read<GraphNode>();
+        }
+        UNITTEST_REQUIRE(loaded.get() != root.get());
+        ValidateGraph(loaded);
+        loaded.reset();
+
+        // load from a mapped file; trivial instances point into the mapping
+        char path[] = "/tmp/bch_graph_XXXXXX";
+        const int file = mkstemp(path);
+        UNITTEST_REQUIRE(file >= 0);
+        close(file);
+        writer.save(path);
+        {
+            bch::shared_ptr_nc<const bch::graph_image> mapped = bch::graph_image::map(path);
+            unlink(path);
+            UNITTEST_REQUIRE(mapped->size() == image.size());
+            bch::graph_reader reader(mapped);
+            loaded = reader.read<GraphNode>();
+            const char* const pointAddress = reinterpret_cast<const char*>(loaded->mPoint.get());
+            UNITTEST_REQUIRE((pointAddress >= mapped->data()) && (pointAddress < mapped->data() + mapped->size()));
+        }
+        // the mapping is kept alive by the trivial instances
+        ValidateGraph(loaded);
+        loaded.reset();
+
+        // instances loaded by read_trivial share the control block of the image; saving
+        // them again must keep them distinct
+        {
+            bch::shared_ptr_nc<GraphNode> leaf = bch::make_shared<GraphNode>(
+                2, nullptr, nullptr, bch::make_shared<GraphPoint>(GraphPoint{3.5, 4.5}));
+            bch::shared_ptr_nc<GraphNode> points = bch::make_shared<GraphNode>(
+                1, leaf, leaf, bch::make_shared<GraphPoint>(GraphPoint{1.5, 2.5}));
+            for (int pass = 0; pass < 2; ++pass)
+            {
+                bch::graph_writer pointWriter;
+                pointWriter.write(points);
+                const std::vector<char>& pointImage = pointWriter.image();
+                bch::graph_reader reader(bch::graph_image::copy(pointImage.data(), pointImage.size()));
+                points = reader.read<GraphNode>();
+
+                UNITTEST_REQUIRE(points->mValue == 1);
+                UNITTEST_REQUIRE(points->mLeft == points->mRight);
+                UNITTEST_REQUIRE(points->mPoint->mX == 1.5);
+                UNITTEST_REQUIRE(points->mPoint->mY == 2.5);
+                UNITTEST_REQUIRE(points->mLeft->mPoint->mX == 3.5);
+                UNITTEST_REQUIRE(points->mLeft->mPoint->mY == 4.5);
+                UNITTEST_REQUIRE(points->mPoint.get() != points->mLeft->mPoint.get());
+            }
+        }
+
+        // truncated images throw
+        bool exceptionThrown = false;
+        try
+        {
+            bch::graph_reader reader(bch::graph_image::copy(image.data(), image.size() / 2));
+            reader.read<GraphNode>();
+        }
+        catch (const std::runtime_error&)
+        {
+            exceptionThrown = true;
+        }
+        UNITTEST_REQUIRE(exceptionThrown);
+    }
+    cbValidator.ValidateInitialState();
+}
+
+void clone_members(bch::clone_context& context, GraphNode& copy)
+{
+    copy.mLeft = context.clone(copy.mLeft);
+    copy.mRight = context.clone(copy.mRight);
+    copy.mPoint = context.clone(copy.mPoint);
+}
+
+void DeepCloneTest()
+{
+    ControlBlockInstanceValidator cbValidator;
+    {
+        bch::shared_ptr_nc<const GraphPoint> point = bch::make_shared<GraphPoint>(GraphPoint{1.5, 2.5});
+        bch::shared_ptr_nc<GraphNode> c = bch::make_shared<GraphNode>(4, nullptr, nullptr, point);
+        bch::shared_ptr_nc<GraphNode> a = bch::make_shared<GraphNode>(2, c, c, nullptr);
+        bch::shared_ptr_nc<GraphNode> b = bch::make_shared<GraphNode>(3, c, nullptr, nullptr);
+        bch::shared_ptr_nc<GraphNode> root = bch::make_shared<GraphNode>(1, a, b, point);
+        a.reset();
+        b.reset();
+        c.reset();
+        point.reset();
+
+        // the clone has the same shape and shares nothing with the original
+        bch::shared_ptr_nc<GraphNode> clone = bch::deep_clone(root);
+        ValidateGraph(clone);
+        ValidateGraph(root);
+        UNITTEST_REQUIRE(clone != root);
+        UNITTEST_REQUIRE(clone->mLeft != root->mLeft);
+        UNITTEST_REQUIRE(clone->mLeft->mLeft != root->mLeft->mLeft);
+        UNITTEST_REQUIRE(clone->mPoint != root->mPoint);
+        clone.reset();
+
+        // cycles resolve to the clone
+        root->mLeft->mLeft->mRight = root;
+        {
+            bch::clone_context context;
+            clone = context.clone(root);
+            UNITTEST_REQUIRE(context.size() == 5);
+            UNITTEST_REQUIRE(context.current(root) == clone);
+        }
+        UNITTEST_REQUIRE(clone->mLeft->mLeft->mRight == clone);
+        clone->mLeft->mLeft->mRight.reset();
+        root->mLeft->mLeft->mRight.reset();
+        clone.reset();
+
+        // lazy clones only copy the written path
+        {
+            bch::lazy_clone<GraphNode> edit(root);
+            UNITTEST_REQUIRE(edit.root() == root);
+            GraphNode& rootCopy = edit.write_root();
+            GraphNode& aCopy = edit.write(rootCopy.mLeft);
+            GraphNode& cCopy = edit.write(aCopy.mLeft);
+            cCopy.mValue = 40;
+            UNITTEST_REQUIRE(edit.copy_count() == 3);
+            UNITTEST_REQUIRE(&edit.write_root() == &rootCopy);
+            UNITTEST_REQUIRE(edit.root() != root);
+
+            // other pointers to c still refer to the original until read or written
+            UNITTEST_REQUIRE(aCopy.mRight == root->mLeft->mLeft);
+            UNITTEST_REQUIRE(edit.read(aCopy.mRight).get() == &cCopy);
+            UNITTEST_REQUIRE(&edit.write(aCopy.mRight) == &cCopy);
+            UNITTEST_REQUIRE(aCopy.mLeft == aCopy.mRight);
+            UNITTEST_REQUIRE(rootCopy.mRight == root->mRight);
+            UNITTEST_REQUIRE(rootCopy.mPoint == root->mPoint);
+            UNITTEST_REQUIRE(edit.copy_count() == 3);
+
+            UNITTEST_REQUIRE(root->mLeft->mLeft->mValue == 4);
+            UNITTEST_REQUIRE(edit.root()->mLeft->mLeft->mValue == 40);
+            clone = edit.root();
+        }
+        ValidateGraph(root);
+        UNITTEST_REQUIRE(clone->mLeft->mLeft->mValue == 40);
+        UNITTEST_REQUIRE(clone->mLeft->mLeft.use_count() == 2);
+
+        // instances that share a control block (aliasing pointers) are cloned separately
+        {
+            struct PointPair
+            {
+                GraphPoint  mFirst;
+                GraphPoint  mSecond;
+            };
+            bch::shared_ptr_nc<PointPair> pair = bch::make_shared<PointPair>(PointPair{{1.5, 2.5}, {3.5, 4.5}});
+            bch::shared_ptr_nc<const GraphPoint> first(pair, &pair->mFirst);
+            bch::shared_ptr_nc<const GraphPoint> second(pair, &pair->mSecond);
+            bch::shared_ptr_nc<GraphNode> leaf = bch::make_shared<GraphNode>(2, nullptr, nullptr, second);
+            bch::shared_ptr_nc<GraphNode> node = bch::make_shared<GraphNode>(1, leaf, nullptr, first);
+
+            bch::clone_context context;
+            clone = context.clone(node);
+            UNITTEST_REQUIRE(context.size() == 4);
+            UNITTEST_REQUIRE(clone->mPoint->mX == 1.5);
+            UNITTEST_REQUIRE(clone->mLeft->mPoint->mX == 3.5);
+            UNITTEST_REQUIRE(clone->mPoint != first);
+            UNITTEST_REQUIRE(clone->mLeft->mPoint != second);
+            UNITTEST_REQUIRE(context.current(second) == clone->mLeft->mPoint);
+        }
+    }
+    cbValidator.ValidateInitialState();
+}
+
+void CowPtrTest()
+{
+    ControlBlockInstanceValidator cbValidator;
+    {
+        bch::cow_ptr_nc<std::vector<int>> a(std::in_place, 3, 7);
+        UNITTEST_REQUIRE(a.unique());
+        UNITTEST_REQUIRE(a->size() == 3);
+
+        // writing a unique value mutates in place
+        const std::vector<int>* const original = &a.read();
+        a.write().push_back(8);
+        UNITTEST_REQUIRE(&a.read() == original);
+
+        // copies share until one of them is written
+        bch::cow_ptr_nc<std::vector<int>> b = a;
+        UNITTEST_REQUIRE(b.shares_with(a));
+        UNITTEST_REQUIRE(a.use_count() == 2);
+        b.write()[0] = 1;
+        UNITTEST_REQUIRE(!b.shares_with(a));
+        UNITTEST_REQUIRE(&a.read() == original);
+        UNITTEST_REQUIRE((*a)[0] == 7);
+        UNITTEST_REQUIRE((*b)[0] == 1);
+        UNITTEST_REQUIRE(a.unique() && b.unique());
+
+        // shared values are copied out, unique values are moved out
+        bch::cow_ptr_nc<std::vector<int>> c = a;
+        std::vector<int> copied = c.try_unwrap();
+        UNITTEST_REQUIRE(copied.size() == 4);
+        UNITTEST_REQUIRE(a->size() == 4);
+        const int* const data = a->data();
+        std::vector<int> moved = a.try_unwrap();
+        UNITTEST_REQUIRE(moved.data() == data);
+        UNITTEST_REQUIRE(copied == moved);
+
+        // shared_ptr_nc view
+        bch::shared_ptr_nc<const std::vector<int>> shared = b.share();
+        UNITTEST_REQUIRE(shared.get() == &b.read());
+        b.write();
+        UNITTEST_REQUIRE(shared.get() != &b.read());
+    }
+    cbValidator.ValidateInitialState();
+}
+
+// Few distinct hashes, so entries collide
+struct CollidingHash
+{
+    std::size_t operator()(int key) const noexcept
+    {
+        return static_cast<std::size_t>(key % 7);
+    }
+};
+
+void PersistentMapTest()
+{
+    ControlBlockInstanceValidator cbValidator;
+    {
+        const int kCount = 2000;
+        bch::persistent_map<int, int> v1;
+        for (int key = 0; key < kCount; ++key)
+            UNITTEST_REQUIRE(v1.set(key, key * 2));
+        UNITTEST_REQUIRE(v1.size() == kCount);
+        UNITTEST_REQUIRE(!v1.set(5, 11));
+        UNITTEST_REQUIRE(v1.size() == kCount);
+        UNITTEST_REQUIRE(*v1.find(5) == 11);
+        UNITTEST_REQUIRE(*v1.find(kCount - 1) == (kCount - 1) * 2);
+        UNITTEST_REQUIRE(v1.find(kCount) == nullptr);
+
+        // an unshared map is changed in place
+        const std::uint32_t liveCount = bch::detail::ControlBlock::live_instance_count();
+        v1.set(6, 13);
+        UNITTEST_REQUIRE(bch::detail::ControlBlock::live_instance_count() == liveCount);
+
+        // a snapshot only copies the path to the changed entry
+        bch::persistent_map<int, int> v2 = v1;
+        v2.set(7, 15);
+        const std::uint32_t copied = bch::detail::ControlBlock::live_instance_count() - liveCount;
+        UNITTEST_REQUIRE((copied >= 2) && (copied <= 4));
+        UNITTEST_REQUIRE(*v1.find(7) == 14);
+        UNITTEST_REQUIRE(*v2.find(7) == 15);
+
+        UNITTEST_REQUIRE(v2.erase(8));
+        UNITTEST_REQUIRE(!v2.erase(8));
+        UNITTEST_REQUIRE(!v2.contains(8));
+        UNITTEST_REQUIRE(v1.contains(8));
+        UNITTEST_REQUIRE(v2.size() == kCount - 1);
+
+        long sum = 0;
+        std::size_t visited = 0;
+        v1.for_each([&](const std::pair<const int, int>& entry) {
+            sum += entry.first;
+            ++visited;
+        });
+        UNITTEST_REQUIRE(visited == kCount);
+        UNITTEST_REQUIRE(sum == static_cast<long>(kCount) * (kCount - 1) / 2);
+
+        for (int key = 0; key < kCount; ++key)
+            UNITTEST_REQUIRE(v1.erase(key));
+        UNITTEST_REQUIRE(v1.empty());
+        UNITTEST_REQUIRE(*v2.find(5) == 11);
+        v2.clear();
+        cbValidator.ValidateInitialState();
+
+        // colliding hashes are chained
+        bch::persistent_map<int, std::string, CollidingHash> colliding;
+        for (int key = 0; key < 50; ++key)
+            colliding.set(key, std::to_string(key));
+        bch::persistent_map<int, std::string, CollidingHash> snapshot = colliding;
+        colliding.set(14, "fourteen");
+        UNITTEST_REQUIRE(*colliding.find(14) == "fourteen");
+        UNITTEST_REQUIRE(*snapshot.find(14) == "14");
+        for (int key = 0; key < 50; key += 2)
+            UNITTEST_REQUIRE(colliding.erase(key));
+        for (int key = 0; key < 50; ++key)
+        {
+            UNITTEST_REQUIRE(colliding.contains(key) == ((key & 1) != 0));
+            UNITTEST_REQUIRE(snapshot.contains(key));
+        }
+    }
+    cbValidator.ValidateInitialState();
+}
+
+struct TransparentStringHash
+{
+    std::size_t operator()(std::string_view value) const noexcept
+    {
+        return std::hash<std::string_view>()(value);
+    }
+};
+
+struct TransparentStringEqual
+{
+    bool operator()(const std::string& lhs, std::string_view rhs) const noexcept
+    {
+        return (lhs == rhs);
+    }
+};
+
+void InternTableTest()
+{
+    ControlBlockInstanceValidator cbValidator;
+    {
+        bch::intern_table<std::string, TransparentStringHash, TransparentStringEqual> table;
+        bch::shared_ptr_nc<const std::string> a = table.intern(std::string("alpha"));
+        bch::shared_ptr_nc<const std::string> b = table.intern(std::string_view("alpha"));
+        UNITTEST_REQUIRE(a == b);
+        UNITTEST_REQUIRE(*a == "alpha");
+        UNITTEST_REQUIRE(table.size() == 1);
+        UNITTEST_REQUIRE(table.find(std::string_view("alpha")) == a);
+        UNITTEST_REQUIRE(!table.find(std::string_view("beta")));
+
+        // entries are removed when the last reference is released
+        a.reset();
+        UNITTEST_REQUIRE(table.size() == 1);
+        b.reset();
+        UNITTEST_REQUIRE(table.size() == 0);
+        cbValidator.ValidateInitialState();
+
+        // grow the table, then release entries in an order that moves probe sequences
+        std::vector<bch::shared_ptr_nc<const std::string>> values;
+        for (int index = 0; index < 1000; ++index)
+            values.push_back(table.intern(std::to_string(index % 500)));
+        UNITTEST_REQUIRE(table.size() == 500);
+        UNITTEST_REQUIRE(values[7] == values[507]);
+        for (std::size_t index = 0; index < values.size(); index += 3)
+            values[index].reset();
+        for (int index = 0; index < 500; ++index)
+        {
+            const bool live = values[index] || values[index + 500];
+            UNITTEST_REQUIRE(bool(table.find(std::to_string(index))) == live);
+        }
+        values.clear();
+        UNITTEST_REQUIRE(table.size() == 0);
+
+        // instances may outlive the table
+        bch::shared_ptr_nc<const int> survivor;
+        {
+            bch::intern_table<int> integers;
+            survivor = integers.intern(7);
+            UNITTEST_REQUIRE(integers.intern(7) == survivor);
+        }
+        UNITTEST_REQUIRE(*survivor == 7);
+    }
+    cbValidator.ValidateInitialState();
+}
+
+class CountingListener: public bch::expiry_listener
+{
+public:
+    int     mExpiredCount{0};
+    // Listener that is cancelled by the callback
+    CountingListener* mCancel{nullptr};
+
+protected:
+    virtual void on_expired() noexcept
+    {
+        ++mExpiredCount;
+        if (mCancel != nullptr)
+            mCancel->cancel();
+    }
+};
+
+void ExpiryTest()
+{
+    ControlBlockInstanceValidator cbValidator;
+    {
+        // listeners are notified once, after the instance is destroyed
+        TestInstanceValidator instanceValidator;
+        CountingListener first;
+        CountingListener second;
+        bch::shared_ptr_nc<TestInstance> instance = bch::make_shared<TestInstance>();
+        first.listen(instance);
+        second.listen(instance);
+        UNITTEST_REQUIRE(first.listening());
+        ValidateWeakCount(instance, 0);
+        bch::shared_ptr_nc<TestInstance> copy = instance;
+        instance.reset();
+        UNITTEST_REQUIRE(first.mExpiredCount == 0);
+        copy.reset();
+        instanceValidator.ValidateInitialState();
+        UNITTEST_REQUIRE((first.mExpiredCount == 1) && (second.mExpiredCount == 1));
+        UNITTEST_REQUIRE(!first.listening() && !second.listening());
+        cbValidator.ValidateInitialState();
+
+        // cancelled listeners are not notified, and a callback can cancel other listeners
+        instance = bch::make_shared_out_of_line<TestInstance>();
+        first.listen(instance);
+        first.cancel();
+        UNITTEST_REQUIRE(!first.listening());
+        first.listen(instance);
+        // the most recent listener is notified first
+        second.mCancel = &first;
+        second.listen(instance);
+        instance.reset();
+        UNITTEST_REQUIRE((first.mExpiredCount == 1) && (second.mExpiredCount == 2));
+        cbValidator.ValidateInitialState();
+
+        // weak pointers keep the control block alive after the listeners are notified
+        instance = bch::make_shared<TestInstance>();
+        first.listen(instance);
+        bch::weak_ptr<TestInstance> weak = instance;
+        instance.reset();
+        UNITTEST_REQUIRE(first.mExpiredCount == 2);
+        UNITTEST_REQUIRE(weak.expired());
+        cbValidator.ValidateDelta(1);
+        weak.reset();
+        cbValidator.ValidateInitialState();
+
+        // the cache only holds live values
+        bch::weak_value_cache<int, TestInstance> cache;
+        bch::shared_ptr_nc<TestInstance> a = bch::make_shared<TestInstance>();
+        bch::shared_ptr_nc<TestInstance> b = bch::make_shared<TestInstance>();
+        cache.insert(1, a);
+        cache.insert(2, b);
+        UNITTEST_REQUIRE(cache.size() == 2);
+        UNITTEST_REQUIRE(cache.find(1) == a);
+        a.reset();
+        UNITTEST_REQUIRE(cache.size() == 1);
+        UNITTEST_REQUIRE(!cache.find(1));
+        cache.insert(2, b);
+        bch::shared_ptr_nc<TestInstance> created = cache.find_or_create(3, []() {
+            return bch::make_shared<TestInstance>();
+        });
+        UNITTEST_REQUIRE(cache.find_or_create(3, []() { return bch::shared_ptr_nc<TestInstance>(); }) == created);
+        UNITTEST_REQUIRE(cache.erase(2));
+        b.reset();
+        UNITTEST_REQUIRE(cache.size() == 1);
+        created.reset();
+        UNITTEST_REQUIRE(cache.size() == 0);
+
+        // the cache can be destroyed before its values
+        {
+            bch::weak_value_cache<int, TestInstance> shortLived;
+            a = bch::make_shared<TestInstance>();
+            shortLived.insert(1, a);
+        }
+        a.reset();
+    }
+    cbValidator.ValidateInitialState();
+}
+
+struct SignalObserver
+{
+    void OnValue(int value)
+    {
+        mSum += value;
+    }
+
+    int                                     mSum{0};
+    // Released by OnValueRelease
+    bch::shared_ptr_nc<SignalObserver>      mOther;
+};
+
+void OnValueRelease(SignalObserver& observer, int value)
+{
+    observer.mSum += value;
+    observer.mOther.reset();
+}
+
+void OnValueThrow(SignalObserver& observer, int value)
+{
+    observer.mSum += value;
+    throw std::runtime_error("OnValueThrow");
+}
+
+void SignalTest()
+{
+    ControlBlockInstanceValidator cbValidator;
+    {
+        bch::signal<int> changed;
+        bch::shared_ptr_nc<SignalObserver> a = bch::make_shared<SignalObserver>();
+        bch::shared_ptr_nc<SignalObserver> b = bch::make_shared<SignalObserver>();
+        changed.connect<&SignalObserver::OnValue>(a);
+        changed.connect<&SignalObserver::OnValue>(b);
+        changed.connect<&OnValueRelease>(b);
+        ValidateWeakCount(b, 2);
+        changed.emit(2);
+        UNITTEST_REQUIRE((a->mSum == 2) && (b->mSum == 4));
+
+        // emit does not change the reference counts
+        ValidateStrongCount(a, 1);
+
+        // released observers are skipped and compacted
+        a.reset();
+        cbValidator.ValidateDelta(2);
+        changed.emit(3);
+        UNITTEST_REQUIRE(b->mSum == 10);
+        UNITTEST_REQUIRE(changed.size() == 3);
+        changed.connect<&SignalObserver::OnValue>(b);
+        bch::shared_ptr_nc<SignalObserver> c = bch::make_shared<SignalObserver>();
+        changed.connect<&SignalObserver::OnValue>(c);
+        c.reset();
+        changed.emit(1);
+        UNITTEST_REQUIRE(b->mSum == 13);
+        UNITTEST_REQUIRE(changed.size() == 5);
+        changed.compact();
+        UNITTEST_REQUIRE(changed.size() == 3);
+        cbValidator.ValidateDelta(1);
+
+        // a slot can release observers that have not been invoked yet
+        bch::signal<int> released;
+        bch::shared_ptr_nc<SignalObserver> d = bch::make_shared<SignalObserver>();
+        bch::shared_ptr_nc<SignalObserver> e = bch::make_shared<SignalObserver>();
+        d->mOther = e;
+        released.connect<&OnValueRelease>(d);
+        released.connect<&SignalObserver::OnValue>(e);
+        bch::weak_ptr<SignalObserver> weakE = e;
+        e.reset();
+        released.emit(5);
+        UNITTEST_REQUIRE(d->mSum == 5);
+        UNITTEST_REQUIRE(weakE.expired());
+
+        UNITTEST_REQUIRE(changed.disconnect(b) == 3);
+        UNITTEST_REQUIRE(changed.size() == 0);
+        ValidateWeakCount(b, 0);
+
+        // the signal compacts after a slot has thrown
+        bch::signal<int> throwing;
+        bch::shared_ptr_nc<SignalObserver> f = bch::make_shared<SignalObserver>();
+        throwing.connect<&SignalObserver::OnValue>(b);
+        throwing.connect<&OnValueThrow>(f);
+        bool exceptionThrown = false;
+        try
+        {
+            throwing.emit(1);
+        }
+        catch (const std::runtime_error&)
+        {
+            exceptionThrown = true;
+        }
+        UNITTEST_REQUIRE(exceptionThrown);
+        UNITTEST_REQUIRE((b->mSum == 14) && (f->mSum == 1));
+        f.reset();
+        throwing.emit(2);
+        UNITTEST_REQUIRE(b->mSum == 16);
+        UNITTEST_REQUIRE(throwing.size() == 1);
+    }
+    cbValidator.ValidateInitialState();
+}
+
+void LruCacheTest()
+{
+    ControlBlockInstanceValidator cbValidator;
+    {
+        typedef bch::lru_cache<int, std::string> Cache;
+        Cache cache(3 * Cache::entry_size());
+        cache.emplace(1, "one");
+        cache.emplace(2, "two");
+        cache.emplace(3, "three");
+        UNITTEST_REQUIRE(cache.size() == 3);
+        UNITTEST_REQUIRE(cache.byte_size() == 3 * Cache::entry_size());
+
+        // the least recently used entry is evicted
+        UNITTEST_REQUIRE(*cache.find(1) == "one");
+        cache.emplace(4, "four");
+        UNITTEST_REQUIRE(cache.size() == 3);
+        UNITTEST_REQUIRE(!cache.find(2));
+
+        // pinned entries are not evicted
+        bch::shared_ptr_nc<std::string> pinned = cache.find(3);
+        cache.find(1);
+        cache.find(4);
+        cache.emplace(5, "five");
+        UNITTEST_REQUIRE(cache.find(3) == pinned);
+        UNITTEST_REQUIRE(!cache.find(1));
+
+        // while pinned entries use the budget, the cache exceeds it
+        bch::shared_ptr_nc<std::string> pinned4 = cache.find(4);
+        bch::shared_ptr_nc<std::string> pinned5 = cache.find(5);
+        bch::shared_ptr_nc<std::string> six = cache.emplace(6, "six");
+        UNITTEST_REQUIRE(cache.size() == 4);
+        six.reset();
+        pinned.reset();
+        cache.trim();
+        UNITTEST_REQUIRE(cache.size() == 3);
+        UNITTEST_REQUIRE(cache.find(4) && cache.find(5));
+
+        // values outlive the cache entries
+        cache.set_budget(0);
+        UNITTEST_REQUIRE(cache.size() == 2);
+        UNITTEST_REQUIRE(cache.erase(4));
+        UNITTEST_REQUIRE(*pinned4 == "four");
+        cache.emplace(5, "FIVE");
+        UNITTEST_REQUIRE(*pinned5 == "five");
+        UNITTEST_REQUIRE(cache.size() == 1);
+        pinned5.reset();
+        cache.trim();
+        UNITTEST_REQUIRE(cache.size() == 0);
+        UNITTEST_REQUIRE(cache.byte_size() == 0);
+    }
+    cbValidator.ValidateInitialState();
+}
+
+struct SlotValue
+{
+    SlotValue(int value, bch::shared_ptr_nc<TestInstance> instance) noexcept :
+        mValue(value),
+        mInstance(std::move(instance))
+    { }
+
+    int                                 mValue;
+    bch::shared_ptr_nc<TestInstance>    mInstance;
+};
+
+void SlotMapTest()
+{
+    TestInstanceValidator instanceValidator;
+    {
+        bch::slot_map<SlotValue> map;
+        UNITTEST_REQUIRE(!map.contains(bch::slot_handle()));
+
+        const bch::slot_handle first = map.emplace(1, bch::make_shared<TestInstance>());
+        const bch::slot_handle second = map.emplace(2, bch::make_shared<TestInstance>());
+        const bch::slot_handle third = map.emplace(3, bch::make_shared<TestInstance>());
+        UNITTEST_REQUIRE(map.size() == 3);
+        UNITTEST_REQUIRE(map.find(second)->mValue == 2);
+
+        // Erasing releases the value, and the last value fills the gap
+        UNITTEST_REQUIRE(map.erase(first));
+        UNITTEST_REQUIRE(!map.erase(first));
+        UNITTEST_REQUIRE(!map.contains(first));
+        UNITTEST_REQUIRE(map.find(first) == nullptr);
+        UNITTEST_REQUIRE(TestInstance::LiveInstanceCount() == 2);
+        UNITTEST_REQUIRE(map.begin()->mValue == 3);
+        UNITTEST_REQUIRE(map.handle_at(0) == third);
+        UNITTEST_REQUIRE(map.find(third)->mValue == 3);
+
+        // The freed slot is reused with a new generation
+        const bch::slot_handle fourth = map.emplace(4, bch::make_shared<TestInstance>());
+        UNITTEST_REQUIRE(fourth.index() == first.index());
+        UNITTEST_REQUIRE(fourth != first);
+        UNITTEST_REQUIRE(!map.contains(first));
+        UNITTEST_REQUIRE(map.find(fourth)->mValue == 4);
+
+        int sum = 0;
+        for (const SlotValue& value: map)
+            sum += value.mValue;
+        UNITTEST_REQUIRE(sum == 9);
+        for (std::size_t index = 0; index < map.size(); ++index)
+            UNITTEST_REQUIRE(map.find(map.handle_at(index)) == map.data() + index);
+
+        UNITTEST_REQUIRE(map.erase(third));
+        UNITTEST_REQUIRE(map.erase(fourth));
+        UNITTEST_REQUIRE(map.size() == 1);
+        UNITTEST_REQUIRE(map.find(second)->mValue == 2);
+
+        map.emplace(5, bch::make_shared<TestInstance>());
+        map.clear();
+        UNITTEST_REQUIRE(map.empty());
+        UNITTEST_REQUIRE(!map.contains(second));
+        UNITTEST_REQUIRE(TestInstance::LiveInstanceCount() == 0);
+
+        map.emplace(6, bch::make_shared<TestInstance>());
+    }
+    instanceValidator.ValidateInitialState();
+}
+
+void SharedFunctionTest()
+{
+    ControlBlockInstanceValidator cbValidator;
+    TestInstanceValidator instanceValidator;
+    {
+        bch::shared_function_nc<int(int)> empty;
+        UNITTEST_REQUIRE(!empty);
+        UNITTEST_REQUIRE(empty.use_count() == 0);
+
+        // The callable and its state are shared by the copies
+        bch::shared_ptr_nc<TestInstance> instance = bch::make_shared<TestInstance>();
+        bch::shared_function_nc<int(int)> counter = [instance, count = 0](int delta) mutable {
+            count += delta;
+            return count;
+        };
+        instance.reset();
+        cbValidator.ValidateDelta(2);
+        instanceValidator.ValidateDelta(1);
+        UNITTEST_REQUIRE(counter(2) == 2);
+
+        bch::shared_function_nc<int(int)> copy = counter;
+        UNITTEST_REQUIRE(counter.use_count() == 2);
+        UNITTEST_REQUIRE(copy(3) == 5);
+        UNITTEST_REQUIRE(counter(1) == 6);
+        cbValidator.ValidateDelta(2);
+
+        bch::shared_function_nc<int(int)> moved = std::move(copy);
+        UNITTEST_REQUIRE(!copy);
+        UNITTEST_REQUIRE(moved.use_count() == 2);
+
+        counter.reset();
+        instanceValidator.ValidateDelta(1);
+        moved = nullptr;
+        cbValidator.ValidateInitialState();
+        instanceValidator.ValidateInitialState();
+
+        // Move only callables, reference arguments and a converted result
+        std::unique_ptr<int> value(new int(4));
+        bch::shared_function_nc<long(int&)> add = [value = std::move(value)](int& target) {
+            target += *value;
+            return target;
+        };
+        int target = 1;
+        UNITTEST_REQUIRE(add(target) == 5);
+        UNITTEST_REQUIRE(target == 5);
+
+        bch::shared_function_nc<void()> ignored = [&target]() { return ++target; };
+        ignored();
+        UNITTEST_REQUIRE(target == 6);
+
+        std::vector<bch::shared_function_nc<void()>> callbacks(3, ignored);
+        UNITTEST_REQUIRE(ignored.use_count() == 4);
+        for (const auto& callback: callbacks)
+            callback();
+        UNITTEST_REQUIRE(target == 9);
+        cbValidator.ValidateDelta(2);
+    }
+    cbValidator.ValidateInitialState();
+}
+
+void SharedBufferTest()
+{
+    ControlBlockInstanceValidator cbValidator;
+    {
+        const char text[] = "header:body";
+        bch::shared_buffer_nc buffer = bch::shared_buffer_nc::copy(text, 11);
+        cbValidator.ValidateDelta(1);
+        UNITTEST_REQUIRE(buffer.size() == 11);
+        UNITTEST_REQUIRE(memcmp(buffer.data(), text, 11) == 0);
+
+        // Slices share the bytes
+        bch::shared_buffer_nc header = buffer.slice(0, 6);
+        bch::shared_buffer_nc body = buffer.slice(7, 4);
+        cbValidator.ValidateDelta(1);
+        UNITTEST_REQUIRE(buffer.use_count() == 3);
+        UNITTEST_REQUIRE(body.data() == buffer.data() + 7);
+        UNITTEST_REQUIRE(body[0] == std::byte('b'));
+        UNITTEST_REQUIRE(buffer.slice(3, 0).empty());
+
+        buffer.reset();
+        UNITTEST_REQUIRE(header.use_count() == 2);
+        header.remove_prefix(2);
+        header.remove_suffix(1);
+        UNITTEST_REQUIRE(memcmp(header.data(), "ade", 3) == 0);
+
+        // Gather the slices and write them with writev
+        bch::buffer_chain chain;
+        chain.append(body);
+        chain.append(bch::shared_buffer_nc());
+        chain.append(header);
+        UNITTEST_REQUIRE(chain.size() == 7);
+        UNITTEST_REQUIRE(chain.buffer_count() == 2);
+
+        int fds[2];
+        UNITTEST_REQUIRE(pipe(fds) == 0);
+        iovec vectors[4];
+        UNITTEST_REQUIRE(chain.to_iovec(vectors, 1) == 1);
+        const int vectorCount = chain.to_iovec(vectors, 4);
+        UNITTEST_REQUIRE(vectorCount == 2);
+        UNITTEST_REQUIRE(writev(fds[1], vectors, vectorCount) == 7);
+
+        // Scatter the bytes into two buffers with readv, and split the bytes that were read
+        bch::buffer_chain input;
+        input.append(bch::shared_buffer_nc::allocate(5));
+        input.append(bch::shared_buffer_nc::allocate(16));
+        cbValidator.ValidateDelta(3);
+        const int inputCount = input.to_iovec(vectors, 4);
+        UNITTEST_REQUIRE(readv(fds[0], vectors, inputCount) == 7);
+        close(fds[0]);
+        close(fds[1]);
+
+        bch::buffer_chain received = input.split(7);
+        UNITTEST_REQUIRE(received.size() == 7);
+        UNITTEST_REQUIRE(received.buffer_count() == 2);
+        UNITTEST_REQUIRE(input.size() == 14);
+        UNITTEST_REQUIRE(input.buffer_count() == 1);
+        UNITTEST_REQUIRE(input.buffer(0).data() == received.buffer(1).data() + 2);
+        cbValidator.ValidateDelta(3);
+
+        char result[8] = {};
+        received.copy_to(result);
+        UNITTEST_REQUIRE(strcmp(result, "bodyade") == 0);
+
+        // Consume a partial write
+        chain.append(received);
+        chain.consume(9);
+        UNITTEST_REQUIRE(chain.size() == 5);
+        UNITTEST_REQUIRE(chain.buffer_count() == 2);
+        char rest[6] = {};
+        chain.copy_to(rest);
+        UNITTEST_REQUIRE(strcmp(rest, "dyade") == 0);
+
+        chain.clear();
+        received.clear();
+        input.consume(input.size());
+        UNITTEST_REQUIRE(input.empty());
+        cbValidator.ValidateDelta(1);
+    }
+    cbValidator.ValidateInitialState();
+}
+
+void UniquePromotableTest()
+{
+    ControlBlockInstanceValidator cbValidator;
+    TestInstanceValidator instanceValidator;
+    {
+        // A unique instance has no control block
+        bch::unique_ptr_nc<TestInstance> unique = bch::make_unique_promotable<TestInstance>();
+        instanceValidator.ValidateDelta(1);
+        cbValidator.ValidateInitialState();
+        UNITTEST_REQUIRE(unique.get() != nullptr);
+
+        bch::unique_ptr_nc<TestInstance> moved = std::move(unique);
+        UNITTEST_REQUIRE(!unique);
+        moved.reset();
+        UNITTEST_REQUIRE(!moved);
+        instanceValidator.ValidateInitialState();
+
+        // Promotion constructs the control block in front of the instance
+        unique = bch::make_unique_promotable<TestInstance>();
+        TestInstance* const instance = unique.get();
+        bch::shared_ptr_nc<TestInstance> shared = std::move(unique).to_shared();
+        UNITTEST_REQUIRE(!unique);
+        UNITTEST_REQUIRE(shared.get() == instance);
+        cbValidator.ValidateDelta(1);
+        ValidateStrongCount(shared, 1);
+        UNITTEST_REQUIRE(bch::detail::SharedPtrAccess::handle(shared) == bch::detail::inline_control_block(instance));
+
+        bch::weak_ptr<TestInstance> weak = shared;
+        shared.reset();
+        instanceValidator.ValidateInitialState();
+        UNITTEST_REQUIRE(weak.expired());
+        cbValidator.ValidateDelta(1);
+        weak.reset();
+        cbValidator.ValidateInitialState();
+
+        // Conversion to a shared pointer of a base type
+        bch::shared_ptr_nc<TestInstance> base = bch::make_unique_promotable<TestInstanceSubclass>();
+        instanceValidator.ValidateDelta(1);
+        base.reset();
+        instanceValidator.ValidateInitialState();
+
+        bch::shared_ptr_nc<TestInstance> empty = bch::unique_ptr_nc<TestInstance>().to_shared();
+        UNITTEST_REQUIRE(!empty);
+
+        // shared_from_this returns an empty pointer before promotion
+        bch::unique_ptr_nc<Test06> unpromoted = bch::make_unique_promotable<Test06>();
+        UNITTEST_REQUIRE(unpromoted->shared_from_this() == nullptr);
+        unpromoted.reset();
+        cbValidator.ValidateInitialState();
+        bool exceptionThrown = false;
+        try
+        {
+            bch::make_unique_promotable<Test06>(1);
+        }
+        catch (const std::runtime_error&)
+        {
+            exceptionThrown = true;
+        }
+        UNITTEST_REQUIRE(exceptionThrown);
+        cbValidator.ValidateInitialState();
+
+        // shared_from_this is available after promotion
+        bch::unique_ptr_nc<Test07> inlineUnique = bch::make_unique_promotable<Test07>();
+        UNITTEST_REQUIRE(inlineUnique->shared_from_this() == nullptr);
+        bch::shared_ptr_nc<Test07> inlineShared = std::move(inlineUnique).to_shared();
+        UNITTEST_REQUIRE(inlineShared->shared_from_this() == inlineShared);
+        UNITTEST_REQUIRE(inlineShared->mValue == 3);
+    }
+    cbValidator.ValidateInitialState();
+}
+
+bch::future_nc<std::size_t> AwaitLength(bch::future_nc<std::string> text)
+{
+    const std::string value = co_await std::move(text);
+    co_return value.size();
+}
+
+bch::future_nc<void> AwaitSum(bch::future_nc<std::size_t> first, bch::future_nc<std::size_t> second, std::size_t& sum)
+{
+    sum = co_await std::move(first);
+    sum += co_await std::move(second);
+}
+
+void FutureTest()
+{
+    ControlBlockInstanceValidator cbValidator;
+    {
+        // then chains continuations on a pending future
+        bch::promise_nc<int> promise;
+        bch::future_nc<int> future = promise.get_future();
+        cbValidator.ValidateDelta(1);
+        UNITTEST_REQUIRE(future.valid() && !future.ready());
+
+        // get does not wait: a pending future throws and is not consumed
+        bool pendingThrew = false;
+        try
+        {
+            future.get();
+        }
+        catch (const std::future_error& error)
+        {
+            pendingThrew = (error.code() == std::future_errc::no_state);
+        }
+        UNITTEST_REQUIRE(pendingThrew);
+        UNITTEST_REQUIRE(future.valid());
+
+        int observed = 0;
+        bch::future_nc<std::string> chained = std::move(future)
+            .then([](int value) { return value * 2; })
+            .then([&observed](int value) { observed = value; return std::to_string(value); });
+        UNITTEST_REQUIRE(!future.valid());
+        UNITTEST_REQUIRE(!chained.ready());
+
+        promise.set_value(21);
+        UNITTEST_REQUIRE(observed == 42);
+        UNITTEST_REQUIRE(chained.ready());
+        UNITTEST_REQUIRE(chained.get() == "42");
+        UNITTEST_REQUIRE(!chained.valid());
+
+        bool threw = false;
+        try
+        {
+            promise.set_value(1);
+        }
+        catch (const std::future_error&)
+        {
+            threw = true;
+        }
+        UNITTEST_REQUIRE(threw);
+    }
+    cbValidator.ValidateInitialState();
+    {
+        // then on a ready future runs immediately; exceptions skip continuations
+        int observed = 0;
+        bch::future_nc<void> done = bch::make_ready_future_nc(5).then([&observed](int value) { observed = value; });
+        UNITTEST_REQUIRE(observed == 5);
+        UNITTEST_REQUIRE(done.ready());
+        done.get();
+
+        bch::future_nc<int> failed = bch::make_ready_future_nc()
+            .then([]() -> int { throw std::runtime_error("failed"); })
+            .then([&observed](int value) { observed = value; return value; });
+        UNITTEST_REQUIRE(failed.ready());
+        UNITTEST_REQUIRE(observed == 5);
+        bool threw = false;
+        try
+        {
+            failed.get();
+        }
+        catch (const std::runtime_error&)
+        {
+            threw = true;
+        }
+        UNITTEST_REQUIRE(threw);
+
+        // A continuation that does not fit in the state is allocated
+        char large[64] = "large";
+        bch::promise_nc<void> largePromise;
+        bch::future_nc<std::size_t> largeFuture = largePromise.get_future().then([large]() { return strlen(large); });
+        largePromise.set_value();
+        UNITTEST_REQUIRE(largeFuture.get() == 5);
+    }
+    cbValidator.ValidateInitialState();
+    {
+        // A destroyed promise breaks its future
+        bch::future_nc<int> future;
+        {
+            bch::promise_nc<int> promise;
+            future = promise.get_future();
+        }
+        UNITTEST_REQUIRE(future.ready());
+        bool broken = false;
+        try
+        {
+            future.get();
+        }
+        catch (const std::future_error& error)
+        {
+            broken = (error.code() == std::future_errc::broken_promise);
+        }
+        UNITTEST_REQUIRE(broken);
+
+        // A pending continuation is destroyed with its state
+        bch::future_nc<int> pending = bch::promise_nc<int>().get_future().then([](int value) { return value; });
+        UNITTEST_REQUIRE(pending.ready());
+    }
+    cbValidator.ValidateInitialState();
+    {
+        // Coroutines suspend on pending futures and complete their own futures
+        bch::promise_nc<std::string> text;
+        bch::promise_nc<std::size_t> second;
+        std::size_t sum = 0;
+        bch::future_nc<void> done = AwaitSum(AwaitLength(text.get_future()), second.get_future(), sum);
+        UNITTEST_REQUIRE(!done.ready());
+
+        text.set_value("four");
+        UNITTEST_REQUIRE(sum == 4);
+        UNITTEST_REQUIRE(!done.ready());
+        second.set_value(3);
+        UNITTEST_REQUIRE(sum == 7);
+        UNITTEST_REQUIRE(done.ready());
+        done.get();
+
+        // Exceptions are passed through co_await
+        bch::future_nc<std::size_t> failed = AwaitLength(bch::promise_nc<std::string>().get_future());
+        UNITTEST_REQUIRE(failed.ready());
+        bool broken = false;
+        try
+        {
+            failed.get();
+        }
+        catch (const std::future_error&)
+        {
+            broken = true;
+        }
+        UNITTEST_REQUIRE(broken);
+
+        // A ready future does not suspend
+        UNITTEST_REQUIRE(AwaitLength(bch::make_ready_future_nc(std::string("ab"))).get() == 2);
+    }
+    cbValidator.ValidateInitialState();
+}
+
+struct Message
+{
+    virtual ~Message() = default;
+};
+
+struct Ping final: public Message
+{
+    int mValue{1};
+};
+
+struct Pong: public Message
+{
+};
+
+struct LoudPong: public Pong
+{
+};
+
+struct Header
+{
+    virtual ~Header() = default;
+    int mSize{0};
+};
+
+// The Message base is not at offset 0
+struct Packet final: public Header, public Message
+{
+};
+
+struct Envelope
+{
+    Ping    mPing;
+};
+
+void FastPointerCastTest()
+{
+    ControlBlockInstanceValidator cbValidator;
+    {
+        // Casts to the concrete type
+        bch::shared_ptr_nc<Message> ping = bch::make_shared<Ping>();
+        bch::shared_ptr_nc<Ping> asPing = bch::fast_pointer_cast<Ping>(ping);
+        UNITTEST_REQUIRE(asPing.get() == static_cast<Ping*>(ping.get()));
+        ValidateStrongCount(ping, 2);
+        UNITTEST_REQUIRE(!bch::fast_pointer_cast<Pong>(ping));
+        ValidateStrongCount(ping, 2);
+
+        bch::shared_ptr_nc<Message> wrapped(new Ping());
+        UNITTEST_REQUIRE(bch::fast_pointer_cast<const Ping>(wrapped)->mValue == 1);
+
+        bch::shared_ptr_nc<Message> packet = bch::make_shared<Packet>();
+        bch::shared_ptr_nc<Packet> asPacket = bch::fast_pointer_cast<Packet>(packet);
+        UNITTEST_REQUIRE(asPacket.get() == dynamic_cast<Packet*>(packet.get()));
+        UNITTEST_REQUIRE(static_cast<void*>(asPacket.get()) != static_cast<void*>(packet.get()));
+        UNITTEST_REQUIRE(bch::fast_pointer_cast<Header>(packet).get() == asPacket.get());
+
+        // Casts to a final type that is not the concrete type fail
+        bch::shared_ptr_nc<Message> pong = bch::make_shared<LoudPong>();
+        UNITTEST_REQUIRE(!bch::fast_pointer_cast<Ping>(pong));
+        UNITTEST_REQUIRE(!bch::fast_pointer_cast<Packet>(pong));
+
+        // Casts to a base of the concrete type use dynamic_cast
+        bch::shared_ptr_nc<Pong> asPong = bch::fast_pointer_cast<Pong>(pong);
+        UNITTEST_REQUIRE(asPong.get() == dynamic_cast<Pong*>(pong.get()));
+        UNITTEST_REQUIRE(bch::fast_pointer_cast<LoudPong>(asPong) != nullptr);
+        ValidateStrongCount(pong, 2);
+
+        // An aliased pointer refers to another instance than the concrete instance
+        bch::shared_ptr_nc<Envelope> envelope = bch::make_shared<Envelope>();
+        bch::shared_ptr_nc<Message> aliased(envelope, &envelope->mPing);
+        UNITTEST_REQUIRE(bch::fast_pointer_cast<Ping>(aliased).get() == &envelope->mPing);
+
+        // An empty pointer
+        bch::shared_ptr_nc<Message> empty;
+        UNITTEST_REQUIRE(!bch::fast_pointer_cast<Ping>(empty));
+    }
+    cbValidator.ValidateInitialState();
 }
 
 }   // namespace
@@ -1181,6 +3278,30 @@ try
     BasicTests();
     AlignmentTest();
     SharedFromThisTest();
+    BorrowedPtrTest();
+    RefScopeTest();
+    ImmortalTest();
+    OutOfLineTest();
+    RelocationTest();
+    SharedPtrVectorTest();
+    TaggedPtrTest();
+    CompactPtrTest();
+    MovableHeapTest();
+    OffsetPtrTest();
+    GraphSerializerTest();
+    DeepCloneTest();
+    CowPtrTest();
+    PersistentMapTest();
+    InternTableTest();
+    ExpiryTest();
+    SignalTest();
+    LruCacheTest();
+    SlotMapTest();
+    SharedFunctionTest();
+    SharedBufferTest();
+    UniquePromotableTest();
+    FutureTest();
+    FastPointerCastTest();
 
     std::cout << "unit tests for shared_ptr_nc succeeded " << std::endl;
 }
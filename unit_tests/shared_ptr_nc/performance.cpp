@@ -5,9 +5,20 @@ Copyright: Jesper Storm Bache (bache.name)
 #include "performance.hpp"
 
 #include "bch/shared_ptr_nc.hpp"
+#include "bch/future_nc.hpp"
+#include "bch/ref_scope.hpp"
+#include "bch/relocatable_vector.hpp"
+#include "bch/shared_function_nc.hpp"
+#include "bch/shared_ptr_nc_vector.hpp"
+#include "bch/signal.hpp"
+#include "bch/slot_map.hpp"
+#include "bch/unique_ptr_nc.hpp"
 
 #include <chrono>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <memory>
 #include <thread>
 #include <vector>
 
@@ -114,6 +125,491 @@ void TestRun(unsigned int count, T functor)
     }
 }
 
+// -----------------------------------------------------------------------------
+
+template <typename Functor>
+double Measure(Functor functor)
+{
+    typedef std::chrono::time_point<std::chrono::system_clock> TimerType;
+    TimerType start = std::chrono::system_clock::now();
+
+    functor();
+
+    TimerType end = std::chrono::system_clock::now();
+    std::chrono::duration<double> elapsed_seconds = end-start;
+    return elapsed_seconds.count();
+}
+
+/* The instance is aligned to a cache line to ensure that the instance does not share
+a cache line with its control block.
+*/
+struct alignas(64) SharedFromThisTest: public bch::enable_shared_from_this<SharedFromThisTest>
+{
+    volatile std::uint64_t mValue{1};
+};
+
+/* make_shared places the control block in front of the instance. The padding ensures
+that mValue does not share a cache line with the control block.
+*/
+struct SharedFromThisInlineTest: public bch::enable_shared_from_this_inline<SharedFromThisInlineTest>
+{
+    char mPadding[64];
+    volatile std::uint64_t mValue{1};
+};
+
+const unsigned int kReadCount = 200000000;
+
+/* A reader thread reads the instance while the owning thread repeatedly calls
+shared_from_this. If the smart pointer implementation writes to the instance, then
+the cache line of the reader is invalidated for every call.
+The returned value is the time spent by the reader.
+*/
+template <typename T>
+double SharedFromThisReadTime(const bch::shared_ptr_nc<T>& instance, bool createPointers)
+{
+    std::atomic_bool done(false);
+    std::thread owner([&]() {
+        while (createPointers && !done)
+        {
+            bch::shared_ptr_nc<T> ptr = instance->shared_from_this();
+            ptr->mValue;
+        }
+    });
+
+    const T* const reader = instance.get();
+    const double elapsed = Measure([&]() {
+        std::uint64_t sum = 0;
+        for (unsigned int i = 0; i < kReadCount; ++i)
+            sum += reader->mValue;
+    });
+
+    done = true;
+    owner.join();
+    return elapsed;
+}
+
+void TestSharedFromThis()
+{
+    bch::shared_ptr_nc<SharedFromThisTest> instance(new SharedFromThisTest);
+    bch::shared_ptr_nc<SharedFromThisInlineTest> inlineInstance = bch::make_shared<SharedFromThisInlineTest>();
+
+    std::cout << "shared_from_this: time for reader thread" << std::endl;
+    std::cout << "idle\tstored\tinline" << std::endl;
+    std::cout << SharedFromThisReadTime(instance, false) << '\t'
+              << SharedFromThisReadTime(instance, true) << '\t'
+              << SharedFromThisReadTime(inlineInstance, true) << std::endl << std::flush;
+}
+
+// -----------------------------------------------------------------------------
+
+void BorrowedFoo(bch::borrowed_ptr<Test> value)
+{
+    value->Baz();
+}
+
+/* Compare passing a shared_ptr_nc by value with passing a borrowed_ptr.
+*/
+void TestBorrowed()
+{
+    shared_ptr_nc<Test> value(new Test);
+
+    const double byValue = Measure([&]() {
+        for (unsigned int i = 0; i < kTestCount; ++i)
+            Foo(value);
+    });
+
+    const double borrowed = Measure([&]() {
+        for (unsigned int i = 0; i < kTestCount; ++i)
+            BorrowedFoo(value);
+    });
+
+    std::cout << "shared_ptr_nc by value\tborrowed_ptr" << std::endl;
+    std::cout << byValue << '\t' << borrowed << std::endl << std::flush;
+}
+
+// -----------------------------------------------------------------------------
+
+/* Copy a small set of pointers into temporaries in a loop. Compare regular copies
+with copies of scoped pointers (ref_scope).
+*/
+void TestRefScope()
+{
+    const unsigned int kPointerCount = 4;
+    std::vector<shared_ptr_nc<Test>> pointers;
+    for (unsigned int i = 0; i < kPointerCount; ++i)
+        pointers.push_back(bch::make_shared<Test>());
+
+    const double copies = Measure([&]() {
+        for (unsigned int i = 0; i < kTestCount; ++i)
+        {
+            shared_ptr_nc<Test> temp = pointers[i % kPointerCount];
+            temp->Baz();
+        }
+    });
+
+    const double scopedCopies = Measure([&]() {
+        bch::ref_scope scope;
+        std::vector<bch::scoped_ptr_nc<Test>> scoped;
+        for (unsigned int i = 0; i < kPointerCount; ++i)
+            scoped.push_back(scope.share(pointers[i]));
+
+        for (unsigned int i = 0; i < kTestCount; ++i)
+        {
+            bch::scoped_ptr_nc<Test> temp = scoped[i % kPointerCount];
+            temp->Baz();
+        }
+    });
+
+    std::cout << "shared_ptr_nc copies\tscoped_ptr_nc copies" << std::endl;
+    std::cout << copies << '\t' << scopedCopies << std::endl << std::flush;
+}
+
+// -----------------------------------------------------------------------------
+
+template <typename Vector>
+double MeasureGrowth(const shared_ptr_nc<Test>& ptr)
+{
+    const unsigned int kGrowthCount = 10000000;
+    return Measure([&]() {
+        Vector pointers;
+        for (unsigned int i = 0; i < kGrowthCount; ++i)
+            pointers.push_back(ptr);
+    });
+}
+
+void TestRelocation()
+{
+    const shared_ptr_nc<Test> ptr = bch::make_shared<Test>();
+
+    const double stdVector = MeasureGrowth<std::vector<shared_ptr_nc<Test>>>(ptr);
+    const double relocatableVector = MeasureGrowth<bch::relocatable_vector<shared_ptr_nc<Test>>>(ptr);
+
+    std::cout << "std::vector growth\trelocatable_vector growth" << std::endl;
+    std::cout << stdVector << '\t' << relocatableVector << std::endl << std::flush;
+}
+
+/* Compare copying and clearing a large vector of shared pointers (fanned out from a
+few instances) in a std::vector and in a shared_ptr_nc_vector.
+*/
+void TestSharedPtrVector()
+{
+    const unsigned int kPointerCount = 4;
+    const unsigned int kEntryCount = 1000000;
+    const unsigned int kRepeatCount = 10;
+
+    std::vector<shared_ptr_nc<Test>> stdPointers;
+    bch::shared_ptr_nc_vector<Test> pointers;
+    for (unsigned int i = 0; i < kPointerCount; ++i)
+    {
+        const shared_ptr_nc<Test> ptr = bch::make_shared<Test>();
+        stdPointers.insert(stdPointers.end(), kEntryCount / kPointerCount, ptr);
+        pointers.fill(ptr, kEntryCount / kPointerCount);
+    }
+
+    const double stdVector = Measure([&]() {
+        for (unsigned int i = 0; i < kRepeatCount; ++i)
+        {
+            std::vector<shared_ptr_nc<Test>> copy(stdPointers);
+            copy.clear();
+        }
+    });
+
+    const double vector = Measure([&]() {
+        for (unsigned int i = 0; i < kRepeatCount; ++i)
+        {
+            bch::shared_ptr_nc_vector<Test> copy(pointers);
+            copy.clear();
+        }
+    });
+
+    std::cout << "std::vector copy+clear\tshared_ptr_nc_vector copy+clear" << std::endl;
+    std::cout << stdVector << '\t' << vector << std::endl << std::flush;
+}
+
+struct Observer
+{
+    void Notify(int value)
+    {
+        mSum += value;
+    }
+
+    long    mSum{0};
+};
+
+/* Compare dispatching an event to many observers that are held as weak_ptr (locked
+for each call) with a signal (checked without reference count changes).
+*/
+void TestSignal()
+{
+    const unsigned int kObserverCount = 10000;
+    const unsigned int kRepeatCount = 1000;
+
+    std::vector<shared_ptr_nc<Observer>> observers;
+    std::vector<weak_ptr<Observer>> weakObservers;
+    bch::signal<int> signal;
+    for (unsigned int i = 0; i < kObserverCount; ++i)
+    {
+        observers.push_back(bch::make_shared<Observer>());
+        weakObservers.push_back(observers.back());
+        signal.connect<&Observer::Notify>(observers.back());
+    }
+
+    const double weakTime = Measure([&]() {
+        for (unsigned int i = 0; i < kRepeatCount; ++i)
+        {
+            for (const weak_ptr<Observer>& observer: weakObservers)
+            {
+                if (shared_ptr_nc<Observer> locked = observer.lock())
+                    locked->Notify(1);
+            }
+        }
+    });
+
+    const double signalTime = Measure([&]() {
+        for (unsigned int i = 0; i < kRepeatCount; ++i)
+            signal.emit(1);
+    });
+
+    std::cout << "weak_ptr dispatch\tsignal dispatch" << std::endl;
+    std::cout << weakTime << '\t' << signalTime << std::endl << std::flush;
+}
+
+/* Compare looking up values through weak_ptr (lock) with slot_map handles (a
+generation compare), and iterating the values of the slot map.
+*/
+void TestSlotMap()
+{
+    const unsigned int kValueCount = 10000;
+    const unsigned int kRepeatCount = 1000;
+
+    std::vector<shared_ptr_nc<Observer>> values;
+    std::vector<weak_ptr<Observer>> weakValues;
+    bch::slot_map<Observer> slots;
+    std::vector<bch::slot_handle> handles;
+    for (unsigned int i = 0; i < kValueCount; ++i)
+    {
+        values.push_back(bch::make_shared<Observer>());
+        weakValues.push_back(values.back());
+        handles.push_back(slots.emplace());
+    }
+
+    const double weakTime = Measure([&]() {
+        for (unsigned int i = 0; i < kRepeatCount; ++i)
+        {
+            for (const weak_ptr<Observer>& value: weakValues)
+            {
+                if (shared_ptr_nc<Observer> locked = value.lock())
+                    locked->Notify(1);
+            }
+        }
+    });
+
+    const double handleTime = Measure([&]() {
+        for (unsigned int i = 0; i < kRepeatCount; ++i)
+        {
+            for (const bch::slot_handle handle: handles)
+            {
+                if (Observer* value = slots.find(handle))
+                    value->Notify(1);
+            }
+        }
+    });
+
+    const double iterationTime = Measure([&]() {
+        for (unsigned int i = 0; i < kRepeatCount; ++i)
+        {
+            for (Observer& value: slots)
+                value.Notify(1);
+        }
+    });
+
+    std::cout << "weak_ptr lookup\tslot_map lookup\tslot_map iteration" << std::endl;
+    std::cout << weakTime << '\t' << handleTime << '\t' << iterationTime << std::endl << std::flush;
+}
+
+/* Compare creating, copying and invoking callbacks that are stored as
+std::shared_ptr<std::function> and as shared_function_nc.
+*/
+void TestSharedFunction()
+{
+    const unsigned int kCallbackCount = 1000000;
+    const unsigned int kCopyCount = 4;
+
+    long a = 1;
+    long b = 2;
+    long c = 3;
+    long sum = 0;
+
+    const double stdTime = Measure([&]() {
+        for (unsigned int i = 0; i < kCallbackCount; ++i)
+        {
+            auto callback = std::make_shared<std::function<long(long)>>([a, b, c, &sum](long value) {
+                return sum += a + b + c + value;
+            });
+            for (unsigned int j = 0; j < kCopyCount; ++j)
+            {
+                std::shared_ptr<std::function<long(long)>> copy = callback;
+                (*copy)(j);
+            }
+        }
+    });
+
+    const double ncTime = Measure([&]() {
+        for (unsigned int i = 0; i < kCallbackCount; ++i)
+        {
+            bch::shared_function_nc<long(long)> callback = [a, b, c, &sum](long value) {
+                return sum += a + b + c + value;
+            };
+            for (unsigned int j = 0; j < kCopyCount; ++j)
+            {
+                bch::shared_function_nc<long(long)> copy = callback;
+                copy(j);
+            }
+        }
+    });
+
+    std::cout << "shared_ptr<function>\tshared_function_nc" << std::endl;
+    std::cout << stdTime << '\t' << ncTime << std::endl << std::flush;
+}
+
+/* Compare creating uniquely owned instances, and sharing half of them, with
+std::unique_ptr (a control block is allocated when an instance is shared) and with
+make_unique_promotable (the control block is constructed in place).
+*/
+void TestPromotion()
+{
+    const unsigned int kInstanceCount = 1000000;
+
+    const double stdTime = Measure([&]() {
+        for (unsigned int i = 0; i < kInstanceCount; ++i)
+        {
+            std::unique_ptr<Test> unique(new Test());
+            if ((i & 1) != 0)
+                shared_ptr_nc<Test> shared(unique.release());
+        }
+    });
+
+    const double promotableTime = Measure([&]() {
+        for (unsigned int i = 0; i < kInstanceCount; ++i)
+        {
+            bch::unique_ptr_nc<Test> unique = bch::make_unique_promotable<Test>();
+            if ((i & 1) != 0)
+                shared_ptr_nc<Test> shared = std::move(unique).to_shared();
+        }
+    });
+
+    std::cout << "unique_ptr promotion\tunique_ptr_nc promotion" << std::endl;
+    std::cout << stdTime << '\t' << promotableTime << std::endl << std::flush;
+}
+
+/* Compare an asynchronous step (create a promise, retrieve its future, satisfy the
+promise and take the value) with std::promise and promise_nc, and a step that is
+chained with then.
+*/
+void TestFuture()
+{
+    const unsigned int kStepCount = 1000000;
+
+    long sum = 0;
+    const double stdTime = Measure([&]() {
+        for (unsigned int i = 0; i < kStepCount; ++i)
+        {
+            std::promise<long> promise;
+            std::future<long> future = promise.get_future();
+            promise.set_value(i);
+            sum += future.get();
+        }
+    });
+
+    const double ncTime = Measure([&]() {
+        for (unsigned int i = 0; i < kStepCount; ++i)
+        {
+            bch::promise_nc<long> promise;
+            bch::future_nc<long> future = promise.get_future();
+            promise.set_value(i);
+            sum += future.get();
+        }
+    });
+
+    const double thenTime = Measure([&]() {
+        for (unsigned int i = 0; i < kStepCount; ++i)
+        {
+            bch::promise_nc<long> promise;
+            bch::future_nc<void> future = promise.get_future().then([&sum](long value) { sum += value; });
+            promise.set_value(i);
+        }
+    });
+
+    std::cout << "std::future\tfuture_nc\tfuture_nc then" << std::endl;
+    std::cout << stdTime << '\t' << ncTime << '\t' << thenTime << std::endl << std::flush;
+}
+
+struct DispatchMessage
+{
+    virtual ~DispatchMessage() = default;
+};
+
+struct DispatchPing final: public DispatchMessage
+{
+    long    mValue{1};
+};
+
+struct DispatchPong: public DispatchMessage
+{
+};
+
+struct DispatchLoudPong final: public DispatchPong
+{
+};
+
+/* Compare dispatching messages by casting to the final message types with
+dynamic_pointer_cast and with fast_pointer_cast.
+*/
+void TestFastPointerCast()
+{
+    const unsigned int kMessageCount = 1000;
+    const unsigned int kRepeatCount = 10000;
+
+    std::vector<shared_ptr_nc<DispatchMessage>> messages;
+    for (unsigned int i = 0; i < kMessageCount; ++i)
+    {
+        if ((i % 3) == 0)
+            messages.push_back(bch::make_shared<DispatchPing>());
+        else
+            messages.push_back(bch::make_shared<DispatchLoudPong>());
+    }
+
+    long sum = 0;
+    const double dynamicTime = Measure([&]() {
+        for (unsigned int i = 0; i < kRepeatCount; ++i)
+        {
+            for (const shared_ptr_nc<DispatchMessage>& message: messages)
+            {
+                if (shared_ptr_nc<DispatchPing> ping = bch::dynamic_pointer_cast<DispatchPing>(message))
+                    sum += ping->mValue;
+                else if (shared_ptr_nc<DispatchLoudPong> pong = bch::dynamic_pointer_cast<DispatchLoudPong>(message))
+                    sum += 2;
+            }
+        }
+    });
+
+    const double fastTime = Measure([&]() {
+        for (unsigned int i = 0; i < kRepeatCount; ++i)
+        {
+            for (const shared_ptr_nc<DispatchMessage>& message: messages)
+            {
+                if (shared_ptr_nc<DispatchPing> ping = bch::fast_pointer_cast<DispatchPing>(message))
+                    sum += ping->mValue;
+                else if (shared_ptr_nc<DispatchLoudPong> pong = bch::fast_pointer_cast<DispatchLoudPong>(message))
+                    sum += 2;
+            }
+        }
+    });
+
+    std::cout << "dynamic_pointer_cast\tfast_pointer_cast" << std::endl;
+    std::cout << dynamicTime << '\t' << fastTime << std::endl << std::flush;
+}
+
 void Test(unsigned int threadCount)
 {
     TestRun(threadCount, std_pointer);
@@ -133,6 +629,18 @@ namespace shared_ptr_nc {
 
 void TestPerformance()
 {
+    TestSharedFromThis();
+    TestBorrowed();
+    TestRefScope();
+    TestRelocation();
+    TestSharedPtrVector();
+    TestSignal();
+    TestSlotMap();
+    TestSharedFunction();
+    TestPromotion();
+    TestFuture();
+    TestFastPointerCast();
+
     std::cout << "threads\tstd\tnc\tdelta" << std::endl << std::flush;
 
     for (unsigned int i = 1; i < 40; ++i)